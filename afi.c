@@ -3,78 +3,127 @@
 
 #include "usbfw.h"
 
-// keep header copy in memory; make sure it is always connected with currently open file
-FW_AFI_HEADER afi_header;
+// AFI file is written in single pass. Space for header is reserved first,
+// entries data go after it in order through big stdio buffer and header with
+// whole directory is written once when file is closed.
 
-uint32_t afi_offset(void) {
-	uint32_t offset = sizeof(FW_AFI_HEADER);
+bool afi_new_file(AFI_CONTEXT *afi, char *filename, uint16_t vid, uint16_t pid) {
+	FILE *file = fopen(filename, "w");
 
-	for (uint32_t i = 0; i < 126; i++) {
-		if (afi_header.diritem[i].filename[0]) {
-			offset = afi_header.diritem[i].offset + afi_header.diritem[i].length;
-		}
+	if (!file) {
+		afi->file = NULL;
+		return false;
 	}
+	return afi_new_stream(afi, file, vid, pid);
+}
 
-	return offset;
+// AFI is built in already open empty 'file', which is closed with it
+bool afi_new_stream(AFI_CONTEXT *afi, FILE *file, uint16_t vid, uint16_t pid) {
+	memset(&afi->header, 0 , sizeof(FW_AFI_HEADER));
+	memcpy(&afi->header.magic, "AFI", 3);
+	afi->header.vendorId = vid;
+	afi->header.productId = pid;
+	afi->count = 0;
+	afi->offset = sizeof(FW_AFI_HEADER);
+
+	afi->file = file;
+	setvbuf(afi->file, NULL, _IOFBF, AFI_BUFFER_SIZE);
+
+	if (fseek(afi->file, sizeof(FW_AFI_HEADER), SEEK_SET)) {
+		afi_close(afi);
+		return false;
+	}
+	return true;
 }
 
+static bool afi_add_entry(AFI_CONTEXT *afi, FW_AFI_DIR_ENTRY *afi_entry) {
+	if (afi->count >= 126) {
+		printf("Error: AFI directory is full.\n");
+		return false;
+	}
+
+	memcpy(&afi->header.diritem[afi->count++], afi_entry, sizeof(FW_AFI_DIR_ENTRY));
+	afi->offset += afi_entry->length;
+	return true;
+}
 
-FILE * afi_new_file(char *filename) {
-	FILE *fafi = NULL;
+// Entry data may come in pieces of any size. Entry offset and checksum are
+// filled at its end.
+void afi_entry_begin(AFI_CONTEXT *afi, FW_AFI_DIR_ENTRY *afi_entry) {
+	afi->entry = *afi_entry;
+	afi->entry.offset = afi->offset;
+	afi->entry.length = 0;
+	checksum32_init(&afi->checksum);
+}
 
-	fafi = fopen(filename, "w");
-	if (!fafi) {
-		return NULL;
+bool afi_entry_write(AFI_CONTEXT *afi, const void *data, size_t size) {
+	if (fwrite(data, 1, size, afi->file) != size) {
+		return false;
 	}
+	checksum32_update(&afi->checksum, data, size);
+	afi->entry.length += size;
+	return true;
+}
 
-	// create and write to file afi header
-	memset(&afi_header, 0 , sizeof(FW_AFI_HEADER));
-	memcpy(&afi_header.magic, "AFI", 3);
-	afi_header.vendorId = app.vid;
-	afi_header.productId = app.pid;
-	afi_header.checksum = checksum32((uint32_t *)&afi_header, sizeof(FW_AFI_HEADER) - sizeof(uint32_t), true);
+bool afi_entry_end(AFI_CONTEXT *afi, FW_AFI_DIR_ENTRY *afi_entry) {
+	afi->entry.checksum = checksum32_final(&afi->checksum);
+	*afi_entry = afi->entry;
+	return afi_add_entry(afi, afi_entry);
+}
 
-	fwrite(&afi_header, sizeof(FW_AFI_HEADER), 1, fafi);
+// make afi entry from provided data
+bool afi_add_whole(AFI_CONTEXT *afi, FW_AFI_DIR_ENTRY *afi_entry, uint8_t* data) {
+	uint32_t length = afi_entry->length;
 
-	return fafi;
+	afi_entry_begin(afi, afi_entry);
+	if (!afi_entry_write(afi, data, length)) {
+		return false;
+	}
+	return afi_entry_end(afi, afi_entry);
 }
 
-// make afi file from provided data
-void afi_add_whole(FILE *fafi, FW_AFI_DIR_ENTRY *afi_entry, uint8_t* data) {
-	// fill gaps
-	afi_entry->offset = afi_offset();
-	afi_entry->checksum = checksum32((uint32_t *)data, afi_entry->length, true);
+// Position where caller may write entry data directly to file descriptor,
+// e.g. with pwrite(). Pending buffered data is flushed first.
+off_t afi_append_base(AFI_CONTEXT *afi) {
+	if (fflush(afi->file)) {
+		return -1;
+	}
+	return afi->offset;
+}
 
-	// write data
-	fseek(fafi, afi_entry->offset, SEEK_SET);
-	fwrite(data, afi_entry->length, 1, fafi);
+// make afi entry from data already written at afi_append_base(), its
+// checksum must be already set
+bool afi_add_appended(AFI_CONTEXT *afi, FW_AFI_DIR_ENTRY *afi_entry) {
+	afi_entry->offset = afi->offset;
+	if (!afi_add_entry(afi, afi_entry)) {
+		return false;
+	}
+	// following entries go after appended data
+	return !fseeko(afi->file, afi->offset, SEEK_SET);
+}
 
+// header goes in place reserved at start, only now it is complete
+bool afi_close(AFI_CONTEXT *afi) {
+	bool retval;
 
-	// update header
-	for (uint32_t i = 0; i < 126; i++) {
-		if (!afi_header.diritem[i].filename[0]) {
-			memcpy(&afi_header.diritem[i], afi_entry, sizeof(FW_AFI_DIR_ENTRY));
-			break;
-		}
+	if (!afi->file) {
+		return true;
 	}
-	afi_header.checksum = checksum32((uint32_t *)&afi_header, sizeof(FW_AFI_HEADER) - sizeof(uint32_t), true);
-	fseek(fafi, 0, SEEK_SET);
-	fwrite(&afi_header, sizeof(FW_AFI_HEADER), 1, fafi);
+
+	afi->header.checksum = checksum32(&afi->header, sizeof(FW_AFI_HEADER) - sizeof(uint32_t));
+	retval = !fseek(afi->file, 0, SEEK_SET) && (fwrite(&afi->header, sizeof(FW_AFI_HEADER), 1, afi->file) == 1);
+	retval = !fclose(afi->file) && retval;
+	afi->file = NULL;
+	return retval;
 }
 
-// make afi file from data already appended to container
-void afi_add_appended(FILE *fafi, FW_AFI_DIR_ENTRY *afi_entry) {
-	// fill gaps
-	afi_entry->offset = afi_offset();
-
-	// update header
-	for (uint32_t i = 0; i < 126; i++) {
-		if (!afi_header.diritem[i].filename[0]) {
-			memcpy(&afi_header.diritem[i], afi_entry, sizeof(FW_AFI_DIR_ENTRY));
-			break;
-		}
+// drop unfinished AFI, header is not written so file is never taken for
+// valid one; caller removes it
+void afi_abort(AFI_CONTEXT *afi) {
+	if (!afi->file) {
+		return;
 	}
-	afi_header.checksum = checksum32((uint32_t *)&afi_header, sizeof(FW_AFI_HEADER) - sizeof(uint32_t), true);
-	fseek(fafi, 0, SEEK_SET);
-	fwrite(&afi_header, sizeof(FW_AFI_HEADER), 1, fafi);
+
+	fclose(afi->file);
+	afi->file = NULL;
 }
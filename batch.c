@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "usbfw.h"
+
+static double batch_time(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1000000000.0;
+}
+
+// split line into whitespace separated arguments, '#' starts comment
+static int batch_split(char *line, char *argv[]) {
+	int argc = 0;
+
+	argv[argc++] = "batch";
+
+	char *comment = strchr(line, '#');
+	if (comment) {
+		*comment = 0;
+	}
+
+	for (char *arg = strtok(line, " \t\r\n"); arg; arg = strtok(NULL, " \t\r\n")) {
+		if (argc >= BATCH_MAX_ARGS) {
+			return -1;
+		}
+		argv[argc++] = arg;
+	}
+	argv[argc] = NULL;
+
+	return argc;
+}
+
+bool batch_run(void) {
+	APP_CONTEXT batch_app;
+	char *argv[BATCH_MAX_ARGS + 1];
+	char *line = NULL;
+	size_t line_size = 0;
+	uint32_t line_no = 0;
+	uint32_t steps = 0;
+	bool retval = true;
+	FILE *batch_file;
+
+	if (strcmp(app.batch_filename, "-") == 0) {
+		batch_file = stdin;
+	} else {
+		batch_file = fopen(app.batch_filename, "r");
+		if (!batch_file) {
+			printf("Error: Cannot open batch file \"%s\".\n", app.batch_filename);
+			return false;
+		}
+	}
+
+	// every step starts with settings from batch command line
+	memcpy(&batch_app, &app, sizeof(APP_CONTEXT));
+	double batch_start = batch_time();
+
+	while (getline(&line, &line_size, batch_file) >= 0) {
+		line_no++;
+
+		int argc = batch_split(line, argv);
+		if (argc < 0) {
+			printf("Error: Too many arguments in batch line %u.\n", line_no);
+			retval = false;
+			break;
+		} else if (argc == 1) {
+			continue;
+		}
+
+		memcpy(&app, &batch_app, sizeof(APP_CONTEXT));
+		app.cmd = APPCMD_NONE;
+		if (parseargs(argc, argv) != PARSE_OK) {
+			printf("Error: Wrong command in batch line %u.\n", line_no);
+			retval = false;
+			break;
+		}
+
+		if ((app.cmd == APPCMD_ENUMERATE) || (app.cmd == APPCMD_DAEMON) || (app.cmd == APPCMD_BATCH)) {
+			printf("Error: Command in batch line %u is not allowed in batch mode.\n", line_no);
+			retval = false;
+			break;
+		}
+
+		// keep device in firmware mode until the end of batch
+		app.is_detach = false;
+
+		steps++;
+		double step_start = batch_time();
+		bool step_ok = run_command();
+		printf("Step %u (line %u) %s in %.3f s.\n\n", steps, line_no, step_ok ? "done" : COLOR_RED"FAILED"COLOR_DEFAULT, batch_time() - step_start);
+
+		if (!step_ok) {
+			retval = false;
+			break;
+		}
+	}
+
+	memcpy(&app, &batch_app, sizeof(APP_CONTEXT));
+	session_detach(&session, app.is_detach);
+
+	printf("Batch %s after %u step(s) in %.3f s.\n", retval ? "finished" : "stopped", steps, batch_time() - batch_start);
+
+	free(line);
+	if (batch_file != stdin) {
+		fclose(batch_file);
+	}
+
+	return retval;
+}
@@ -0,0 +1,286 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "usbfw.h"
+
+// Sector cache over read_area() for tools doing many small random reads.
+// Slots are kept on LRU list and in hash table keyed by sector. Slot being
+// read is marked pending, so other threads missing the same sector wait for
+// it instead of reading it again.
+
+static uint32_t blockdev_find(BLOCKDEV *dev, uint32_t lba) {
+	for (uint32_t i = dev->buckets[lba % dev->size]; i != BLOCKDEV_NONE; i = dev->slots[i].hash_next) {
+		if (dev->slots[i].lba == lba) {
+			return i;
+		}
+	}
+	return BLOCKDEV_NONE;
+}
+
+static void blockdev_unlink(BLOCKDEV *dev, uint32_t idx) {
+	BLOCKDEV_SLOT *slot = &dev->slots[idx];
+
+	if (slot->prev != BLOCKDEV_NONE) {
+		dev->slots[slot->prev].next = slot->next;
+	} else {
+		dev->head = slot->next;
+	}
+	if (slot->next != BLOCKDEV_NONE) {
+		dev->slots[slot->next].prev = slot->prev;
+	} else {
+		dev->tail = slot->prev;
+	}
+}
+
+// move slot to most recently used end
+static void blockdev_touch(BLOCKDEV *dev, uint32_t idx) {
+	BLOCKDEV_SLOT *slot = &dev->slots[idx];
+
+	if (dev->head == idx) {
+		return;
+	}
+	blockdev_unlink(dev, idx);
+	slot->prev = BLOCKDEV_NONE;
+	slot->next = dev->head;
+	dev->slots[dev->head].prev = idx;
+	dev->head = idx;
+	if (dev->tail == BLOCKDEV_NONE) {
+		dev->tail = idx;
+	}
+}
+
+static void blockdev_hash_remove(BLOCKDEV *dev, uint32_t idx) {
+	uint32_t *link = &dev->buckets[dev->slots[idx].lba % dev->size];
+
+	while (*link != idx) {
+		link = &dev->slots[*link].hash_next;
+	}
+	*link = dev->slots[idx].hash_next;
+	dev->slots[idx].is_used = false;
+	dev->slots[idx].is_pending = false;
+}
+
+// take least recently used slot not being read for new sector
+static uint32_t blockdev_claim(BLOCKDEV *dev, uint32_t lba) {
+	uint32_t idx = dev->tail;
+
+	while ((idx != BLOCKDEV_NONE) && dev->slots[idx].is_pending) {
+		idx = dev->slots[idx].prev;
+	}
+	if (idx == BLOCKDEV_NONE) {
+		return BLOCKDEV_NONE;
+	}
+
+	if (dev->slots[idx].is_used) {
+		blockdev_hash_remove(dev, idx);
+	}
+	dev->slots[idx].lba = lba;
+	dev->slots[idx].is_used = true;
+	dev->slots[idx].is_pending = true;
+	dev->slots[idx].hash_next = dev->buckets[lba % dev->size];
+	dev->buckets[lba % dev->size] = idx;
+	blockdev_touch(dev, idx);
+	return idx;
+}
+
+// drop slots of failed read, they go to LRU end for reuse
+static void blockdev_release(BLOCKDEV *dev, uint32_t *claimed, uint32_t count) {
+	for (uint32_t i = 0; i < count; i++) {
+		blockdev_hash_remove(dev, claimed[i]);
+		blockdev_unlink(dev, claimed[i]);
+		dev->slots[claimed[i]].next = BLOCKDEV_NONE;
+		dev->slots[claimed[i]].prev = dev->tail;
+		if (dev->tail != BLOCKDEV_NONE) {
+			dev->slots[dev->tail].next = claimed[i];
+		} else {
+			dev->head = claimed[i];
+		}
+		dev->tail = claimed[i];
+	}
+}
+
+// 'size' is count of cached sectors, 0 for default
+bool blockdev_open(BLOCKDEV *dev, SESSION_CONTEXT *session, DEVICE_AREA area, uint8_t lun, uint32_t size) {
+	if (size == 0) {
+		size = BLOCKDEV_DEFAULT_SECTORS;
+	}
+
+	dev->session = session;
+	dev->area = area;
+	dev->lun = lun;
+	dev->size = size;
+	dev->max_run = (size / 2) ? (size / 2) : 1;
+	if (dev->max_run > 2 * BLOCKDEV_MAX_READAHEAD) {
+		dev->max_run = 2 * BLOCKDEV_MAX_READAHEAD;
+	}
+	dev->slots = malloc(size * sizeof(BLOCKDEV_SLOT));
+	dev->data = malloc((size_t)size * SECTOR_SIZE);
+	dev->buckets = malloc(size * sizeof(uint32_t));
+	dev->io_buf = malloc((size_t)dev->max_run * SECTOR_SIZE);
+	if (!dev->slots || !dev->data || !dev->buckets || !dev->io_buf) {
+		free(dev->slots);
+		free(dev->data);
+		free(dev->buckets);
+		free(dev->io_buf);
+		return false;
+	}
+
+	for (uint32_t i = 0; i < size; i++) {
+		dev->slots[i].lba = 0;
+		dev->slots[i].prev = i ? (i - 1) : BLOCKDEV_NONE;
+		dev->slots[i].next = (i + 1 < size) ? (i + 1) : BLOCKDEV_NONE;
+		dev->slots[i].hash_next = BLOCKDEV_NONE;
+		dev->slots[i].is_used = false;
+		dev->slots[i].is_pending = false;
+		dev->buckets[i] = BLOCKDEV_NONE;
+	}
+	dev->head = 0;
+	dev->tail = size - 1;
+	dev->seq_next = BLOCKDEV_NONE;
+	dev->window = 0;
+	memset(&dev->stats, 0, sizeof(BLOCKDEV_STATS));
+
+	pthread_mutex_init(&dev->lock, NULL);
+	pthread_cond_init(&dev->cond, NULL);
+	pthread_mutex_init(&dev->io_lock, NULL);
+	return true;
+}
+
+// no thread may use device anymore
+void blockdev_close(BLOCKDEV *dev) {
+	pthread_mutex_destroy(&dev->io_lock);
+	pthread_cond_destroy(&dev->cond);
+	pthread_mutex_destroy(&dev->lock);
+	free(dev->io_buf);
+	free(dev->buckets);
+	free(dev->data);
+	free(dev->slots);
+	dev->slots = NULL;
+	dev->data = NULL;
+	dev->buckets = NULL;
+	dev->io_buf = NULL;
+}
+
+// Read 'count' sectors from 'lba'. Safe to call from many threads. Sequential
+// reads double read ahead window up to BLOCKDEV_MAX_READAHEAD, any other
+// read resets it.
+bool blockdev_read(BLOCKDEV *dev, uint32_t lba, uint32_t count, uint8_t *buf) {
+	uint32_t max_run = dev->max_run;
+	uint32_t claimed[max_run];
+	uint32_t waited = BLOCKDEV_NONE;
+	uint32_t window;
+	uint8_t *tmp = dev->io_buf;
+	bool retval = false;
+
+	pthread_mutex_lock(&dev->lock);
+	if (lba == dev->seq_next) {
+		dev->window = dev->window ? (dev->window * 2) : BLOCKDEV_MIN_READAHEAD;
+		if (dev->window > BLOCKDEV_MAX_READAHEAD) {
+			dev->window = BLOCKDEV_MAX_READAHEAD;
+		}
+	} else {
+		dev->window = 0;
+	}
+	dev->seq_next = lba + count;
+	window = dev->window;
+
+	for (uint32_t i = 0; i < count;) {
+		uint32_t idx = blockdev_find(dev, lba + i);
+
+		if (idx != BLOCKDEV_NONE) {
+			if (dev->slots[idx].is_pending) {
+				// count sector once, however many wakeups it takes
+				if (waited != lba + i) {
+					dev->stats.coalesced++;
+					waited = lba + i;
+				}
+				pthread_cond_wait(&dev->cond, &dev->lock);
+				continue;
+			}
+			memcpy(buf + ((size_t)i * SECTOR_SIZE), dev->data + ((size_t)idx * SECTOR_SIZE), SECTOR_SIZE);
+			blockdev_touch(dev, idx);
+			dev->stats.hits++;
+			i++;
+			continue;
+		}
+
+		// missing run up to next cached sector, extended by read ahead
+		uint32_t start = lba + i;
+		uint32_t wanted = 0;
+		uint32_t run = 0;
+		while ((run < max_run) && (run < count - i + window) && (blockdev_find(dev, start + run) == BLOCKDEV_NONE)) {
+			if ((i + run >= count) && (dev->area == AREA_RAM) && (start + run >= RAM_SECTORS)) {
+				break;
+			}
+			if ((claimed[run] = blockdev_claim(dev, start + run)) == BLOCKDEV_NONE) {
+				break;
+			}
+			run++;
+			if (i + run <= count) {
+				wanted = run;
+			}
+		}
+
+		// everything is pending, let other reads finish
+		if (run == 0) {
+			pthread_cond_wait(&dev->cond, &dev->lock);
+			continue;
+		}
+		pthread_mutex_unlock(&dev->lock);
+
+		// shared buffer stays locked until its data is moved to slots
+		pthread_mutex_lock(&dev->io_lock);
+		bool is_read = read_area(dev->session, dev->area, dev->lun, start, run, tmp);
+
+		pthread_mutex_lock(&dev->lock);
+		dev->stats.requests++;
+		if (!is_read) {
+			pthread_mutex_unlock(&dev->io_lock);
+			blockdev_release(dev, claimed, run);
+			pthread_cond_broadcast(&dev->cond);
+			// read ahead may run past area end, try again without it
+			if (run > wanted) {
+				window = 0;
+				dev->window = 0;
+				continue;
+			}
+			goto exit;
+		}
+
+		for (uint32_t j = 0; j < run; j++) {
+			memcpy(dev->data + ((size_t)claimed[j] * SECTOR_SIZE), tmp + ((size_t)j * SECTOR_SIZE), SECTOR_SIZE);
+			dev->slots[claimed[j]].is_pending = false;
+		}
+		memcpy(buf + ((size_t)i * SECTOR_SIZE), tmp, (size_t)wanted * SECTOR_SIZE);
+		pthread_mutex_unlock(&dev->io_lock);
+		dev->stats.misses += wanted;
+		dev->stats.readahead += run - wanted;
+		pthread_cond_broadcast(&dev->cond);
+		i += wanted;
+	}
+	retval = true;
+
+exit:
+	pthread_mutex_unlock(&dev->lock);
+	return retval;
+}
+
+// forget cached sectors, e.g. after device was written; reads in progress
+// still complete
+void blockdev_invalidate(BLOCKDEV *dev) {
+	pthread_mutex_lock(&dev->lock);
+	for (uint32_t i = 0; i < dev->size; i++) {
+		if (dev->slots[i].is_used && !dev->slots[i].is_pending) {
+			blockdev_hash_remove(dev, i);
+		}
+	}
+	dev->seq_next = BLOCKDEV_NONE;
+	dev->window = 0;
+	pthread_mutex_unlock(&dev->lock);
+}
+
+void blockdev_get_stats(BLOCKDEV *dev, BLOCKDEV_STATS *stats) {
+	pthread_mutex_lock(&dev->lock);
+	*stats = dev->stats;
+	pthread_mutex_unlock(&dev->lock);
+}
@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "usbfw.h"
+
+// make path of file in usbfw cache directory, creating directory if needed
+bool cache_path(char *path, size_t size, char *name) {
+	char *base = getenv("XDG_CACHE_HOME");
+	int len;
+
+	if (base && *base) {
+		len = snprintf(path, size, "%s/usbfw", base);
+	} else if ((base = getenv("HOME")) && *base) {
+		len = snprintf(path, size, "%s/.cache", base);
+		if ((len < 0) || (len >= size) || (mkdir(path, 0755) && (errno != EEXIST))) {
+			return false;
+		}
+		len = snprintf(path, size, "%s/.cache/usbfw", base);
+	} else {
+		return false;
+	}
+
+	if ((len < 0) || (len >= size) || (mkdir(path, 0755) && (errno != EEXIST))) {
+		return false;
+	}
+
+	len = snprintf(path + len, size - len, "/%s", name);
+	return (len > 0) && (len < size);
+}
+
+// Cached items are keyed by device (vid:pid and serial if it has one) and main
+// firmware directory checksum, so rewritten firmware never hits old entries.
+static bool cache_item_path(SESSION_CONTEXT *session, char *item, char *path, size_t size) {
+	char name[CACHE_MAX_NAME];
+	int len;
+
+	if (!session->is_key) {
+		return false;
+	}
+
+	len = snprintf(name, sizeof(name), "%04hX_%04hX_%s-%08X.%s", session->vid, session->pid, session->serial, session->key_checksum, item);
+	if ((len < 0) || (len >= sizeof(name))) {
+		return false;
+	}
+
+	return cache_path(path, size, name);
+}
+
+bool cache_load(SESSION_CONTEXT *session, char *item, void *buf, size_t size) {
+	char path[CACHE_MAX_PATH];
+	bool retval;
+	FILE *cache;
+
+	if (!session->is_cache || !cache_item_path(session, item, path, sizeof(path))) {
+		return false;
+	}
+
+	cache = fopen(path, "r");
+	if (!cache) {
+		return false;
+	}
+
+	// item must have exactly expected size
+	retval = (fread(buf, 1, size, cache) == size) && (fgetc(cache) == EOF);
+	fclose(cache);
+
+	dbg_printf("Cache %s for \"%s\"\n", retval ? "hit" : "broken", item);
+	return retval;
+}
+
+void cache_store(SESSION_CONTEXT *session, char *item, void *buf, size_t size) {
+	char path[CACHE_MAX_PATH];
+	char tmp_path[CACHE_MAX_PATH + 4];
+	FILE *tmp;
+
+	if (!session->is_cache || !cache_item_path(session, item, path, sizeof(path))) {
+		return;
+	}
+
+	// replace whole item at once, so readers never see partial one
+	snprintf(tmp_path, sizeof(tmp_path), "%s.new", path);
+	tmp = fopen(tmp_path, "w");
+	if (!tmp) {
+		return;
+	}
+
+	bool is_written = (fwrite(buf, 1, size, tmp) == size);
+	if (fclose(tmp) || !is_written || rename(tmp_path, path)) {
+		remove(tmp_path);
+	}
+}
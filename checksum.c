@@ -0,0 +1,297 @@
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CHECKSUM_X86
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define CHECKSUM_NEON
+#endif
+
+#include "usbfw.h"
+
+// Kernels sum whole words only, 'count' is in words. Loads are unaligned, so
+// data may start anywhere. Sums wrap, so order of adding doesn't matter.
+
+typedef uint32_t (*SUM32_KERNEL)(const uint8_t *data, size_t count);
+typedef uint16_t (*SUM16_KERNEL)(const uint8_t *data, size_t count);
+
+static uint32_t sum32_scalar(const uint8_t *data, size_t count) {
+	uint32_t sum = 0;
+
+	for (size_t i = 0; i < count; i++) {
+		uint32_t word;
+		memcpy(&word, data + (i * 4), 4);
+		sum += word;
+	}
+
+	return sum;
+}
+
+static uint16_t sum16_scalar(const uint8_t *data, size_t count) {
+	uint16_t sum = 0;
+
+	for (size_t i = 0; i < count; i++) {
+		uint16_t word;
+		memcpy(&word, data + (i * 2), 2);
+		sum += word;
+	}
+
+	return sum;
+}
+
+#ifdef CHECKSUM_X86
+__attribute__((target("sse2")))
+static uint32_t sum32_sse2(const uint8_t *data, size_t count) {
+	__m128i acc0 = _mm_setzero_si128();
+	__m128i acc1 = _mm_setzero_si128();
+	size_t i = 0;
+	uint32_t lanes[4];
+
+	// two accumulators hide add latency
+	for (; i + 8 <= count; i += 8) {
+		acc0 = _mm_add_epi32(acc0, _mm_loadu_si128((const __m128i *)(data + (i * 4))));
+		acc1 = _mm_add_epi32(acc1, _mm_loadu_si128((const __m128i *)(data + (i * 4) + 16)));
+	}
+	_mm_storeu_si128((__m128i *)lanes, _mm_add_epi32(acc0, acc1));
+
+	return lanes[0] + lanes[1] + lanes[2] + lanes[3] + sum32_scalar(data + (i * 4), count - i);
+}
+
+__attribute__((target("sse2")))
+static uint16_t sum16_sse2(const uint8_t *data, size_t count) {
+	__m128i acc0 = _mm_setzero_si128();
+	__m128i acc1 = _mm_setzero_si128();
+	size_t i = 0;
+	uint16_t lanes[8];
+	uint16_t sum = 0;
+
+	for (; i + 16 <= count; i += 16) {
+		acc0 = _mm_add_epi16(acc0, _mm_loadu_si128((const __m128i *)(data + (i * 2))));
+		acc1 = _mm_add_epi16(acc1, _mm_loadu_si128((const __m128i *)(data + (i * 2) + 16)));
+	}
+	_mm_storeu_si128((__m128i *)lanes, _mm_add_epi16(acc0, acc1));
+
+	for (uint32_t j = 0; j < 8; j++) {
+		sum += lanes[j];
+	}
+	return sum + sum16_scalar(data + (i * 2), count - i);
+}
+
+__attribute__((target("avx2")))
+static uint32_t sum32_avx2(const uint8_t *data, size_t count) {
+	__m256i acc0 = _mm256_setzero_si256();
+	__m256i acc1 = _mm256_setzero_si256();
+	__m256i acc2 = _mm256_setzero_si256();
+	__m256i acc3 = _mm256_setzero_si256();
+	size_t i = 0;
+	uint32_t lanes[8];
+	uint32_t sum = 0;
+
+	for (; i + 32 <= count; i += 32) {
+		const uint8_t *ptr = data + (i * 4);
+		acc0 = _mm256_add_epi32(acc0, _mm256_loadu_si256((const __m256i *)ptr));
+		acc1 = _mm256_add_epi32(acc1, _mm256_loadu_si256((const __m256i *)(ptr + 32)));
+		acc2 = _mm256_add_epi32(acc2, _mm256_loadu_si256((const __m256i *)(ptr + 64)));
+		acc3 = _mm256_add_epi32(acc3, _mm256_loadu_si256((const __m256i *)(ptr + 96)));
+	}
+	acc0 = _mm256_add_epi32(_mm256_add_epi32(acc0, acc1), _mm256_add_epi32(acc2, acc3));
+	_mm256_storeu_si256((__m256i *)lanes, acc0);
+
+	for (uint32_t j = 0; j < 8; j++) {
+		sum += lanes[j];
+	}
+	return sum + sum32_scalar(data + (i * 4), count - i);
+}
+
+__attribute__((target("avx2")))
+static uint16_t sum16_avx2(const uint8_t *data, size_t count) {
+	__m256i acc0 = _mm256_setzero_si256();
+	__m256i acc1 = _mm256_setzero_si256();
+	__m256i acc2 = _mm256_setzero_si256();
+	__m256i acc3 = _mm256_setzero_si256();
+	size_t i = 0;
+	uint16_t lanes[16];
+	uint16_t sum = 0;
+
+	for (; i + 64 <= count; i += 64) {
+		const uint8_t *ptr = data + (i * 2);
+		acc0 = _mm256_add_epi16(acc0, _mm256_loadu_si256((const __m256i *)ptr));
+		acc1 = _mm256_add_epi16(acc1, _mm256_loadu_si256((const __m256i *)(ptr + 32)));
+		acc2 = _mm256_add_epi16(acc2, _mm256_loadu_si256((const __m256i *)(ptr + 64)));
+		acc3 = _mm256_add_epi16(acc3, _mm256_loadu_si256((const __m256i *)(ptr + 96)));
+	}
+	acc0 = _mm256_add_epi16(_mm256_add_epi16(acc0, acc1), _mm256_add_epi16(acc2, acc3));
+	_mm256_storeu_si256((__m256i *)lanes, acc0);
+
+	for (uint32_t j = 0; j < 16; j++) {
+		sum += lanes[j];
+	}
+	return sum + sum16_scalar(data + (i * 2), count - i);
+}
+#endif
+
+#ifdef CHECKSUM_NEON
+static uint32_t sum32_neon(const uint8_t *data, size_t count) {
+	uint32x4_t acc0 = vdupq_n_u32(0);
+	uint32x4_t acc1 = vdupq_n_u32(0);
+	size_t i = 0;
+	uint32_t lanes[4];
+
+	for (; i + 8 <= count; i += 8) {
+		acc0 = vaddq_u32(acc0, vreinterpretq_u32_u8(vld1q_u8(data + (i * 4))));
+		acc1 = vaddq_u32(acc1, vreinterpretq_u32_u8(vld1q_u8(data + (i * 4) + 16)));
+	}
+	vst1q_u32(lanes, vaddq_u32(acc0, acc1));
+
+	return lanes[0] + lanes[1] + lanes[2] + lanes[3] + sum32_scalar(data + (i * 4), count - i);
+}
+
+static uint16_t sum16_neon(const uint8_t *data, size_t count) {
+	uint16x8_t acc0 = vdupq_n_u16(0);
+	uint16x8_t acc1 = vdupq_n_u16(0);
+	size_t i = 0;
+	uint16_t lanes[8];
+	uint16_t sum = 0;
+
+	for (; i + 16 <= count; i += 16) {
+		acc0 = vaddq_u16(acc0, vreinterpretq_u16_u8(vld1q_u8(data + (i * 2))));
+		acc1 = vaddq_u16(acc1, vreinterpretq_u16_u8(vld1q_u8(data + (i * 2) + 16)));
+	}
+	vst1q_u16(lanes, vaddq_u16(acc0, acc1));
+
+	for (uint32_t j = 0; j < 8; j++) {
+		sum += lanes[j];
+	}
+	return sum + sum16_scalar(data + (i * 2), count - i);
+}
+#endif
+
+static SUM32_KERNEL sum32_kernel = NULL;
+static SUM16_KERNEL sum16_kernel = NULL;
+
+// pick best kernels for running CPU, racing threads pick the same ones
+static void checksum_dispatch(void) {
+	SUM32_KERNEL k32 = sum32_scalar;
+	SUM16_KERNEL k16 = sum16_scalar;
+
+#ifdef CHECKSUM_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		k32 = sum32_avx2;
+		k16 = sum16_avx2;
+	} else if (__builtin_cpu_supports("sse2")) {
+		k32 = sum32_sse2;
+		k16 = sum16_sse2;
+	}
+#elif defined(CHECKSUM_NEON)
+	k32 = sum32_neon;
+	k16 = sum16_neon;
+#endif
+
+	__atomic_store_n(&sum16_kernel, k16, __ATOMIC_RELEASE);
+	__atomic_store_n(&sum32_kernel, k32, __ATOMIC_RELEASE);
+}
+
+static SUM32_KERNEL get_sum32(void) {
+	SUM32_KERNEL kernel = __atomic_load_n(&sum32_kernel, __ATOMIC_ACQUIRE);
+	if (!kernel) {
+		checksum_dispatch();
+		kernel = __atomic_load_n(&sum32_kernel, __ATOMIC_ACQUIRE);
+	}
+	return kernel;
+}
+
+static SUM16_KERNEL get_sum16(void) {
+	SUM16_KERNEL kernel = __atomic_load_n(&sum16_kernel, __ATOMIC_ACQUIRE);
+	if (!kernel) {
+		checksum_dispatch();
+		kernel = __atomic_load_n(&sum16_kernel, __ATOMIC_ACQUIRE);
+	}
+	return kernel;
+}
+
+
+void checksum32_init(CHECKSUM32 *ctx) {
+	ctx->sum = 0;
+	ctx->pending = 0;
+}
+
+// data may be split at any byte, word cut by previous update is completed first
+void checksum32_update(CHECKSUM32 *ctx, const void *data, size_t size) {
+	const uint8_t *ptr = data;
+
+	if (ctx->pending) {
+		while (size && (ctx->pending < 4)) {
+			ctx->partial[ctx->pending++] = *ptr++;
+			size--;
+		}
+		if (ctx->pending < 4) {
+			return;
+		}
+		ctx->sum += sum32_scalar(ctx->partial, 1);
+		ctx->pending = 0;
+	}
+
+	ctx->sum += get_sum32()(ptr, size / 4);
+
+	ptr += size & ~(size_t)3;
+	size &= 3;
+	memcpy(ctx->partial, ptr, size);
+	ctx->pending = size;
+}
+
+// trailing bytes not making whole word are ignored, like in original tools
+uint32_t checksum32_final(CHECKSUM32 *ctx) {
+	if (ctx->pending) {
+		dbg_printf("Checksum 32 data not aligned.\n");
+	}
+	return ctx->sum;
+}
+
+void checksum16_init(CHECKSUM16 *ctx) {
+	ctx->sum = 0;
+	ctx->pending = 0;
+}
+
+void checksum16_update(CHECKSUM16 *ctx, const void *data, size_t size) {
+	const uint8_t *ptr = data;
+
+	if (ctx->pending && size) {
+		ctx->partial[1] = *ptr++;
+		size--;
+		ctx->sum += sum16_scalar(ctx->partial, 1);
+		ctx->pending = 0;
+	}
+
+	ctx->sum += get_sum16()(ptr, size / 2);
+
+	if (size & 1) {
+		ctx->partial[0] = ptr[size - 1];
+		ctx->pending = 1;
+	}
+}
+
+uint16_t checksum16_final(CHECKSUM16 *ctx) {
+	if (ctx->pending) {
+		dbg_printf("Checksum 16 data not aligned.\n");
+	}
+	return ctx->sum;
+}
+
+// one shot versions, size is in bytes
+uint32_t checksum32(const void *data, size_t size) {
+	CHECKSUM32 ctx;
+
+	checksum32_init(&ctx);
+	checksum32_update(&ctx, data, size);
+	return checksum32_final(&ctx);
+}
+
+uint16_t checksum16(const void *data, size_t size) {
+	CHECKSUM16 ctx;
+
+	checksum16_init(&ctx);
+	checksum16_update(&ctx, data, size);
+	return checksum16_final(&ctx);
+}
@@ -1,6 +1,7 @@
 #include <getopt.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <libgen.h>
 
 #include "usbfw.h"
@@ -22,6 +23,11 @@ const struct option longopt[] = {
 	{"dump-raw-fw", 0, NULL, 'P'},
 	{"dump-afi-fw", 0, NULL, 'A'},
 	{"entry", 1, NULL, 'e'},
+	{"daemon", 1, NULL, CMDLINE_DAEMON},
+	{"batch", 1, NULL, CMDLINE_BATCH},
+	{"extract", 1, NULL, CMDLINE_EXTRACT},
+	{"watch", 1, NULL, CMDLINE_WATCH},
+	{"watch-csv", 1, NULL, CMDLINE_WATCHCSV},
 	{"help", 0, NULL, 'h'},
 
 	// options
@@ -36,10 +42,52 @@ const struct option longopt[] = {
 	{"show-dir", 0, NULL, 's'},
 	{"detach", 0, NULL, 'D'},
 	{"alternate", 0, NULL, 'a'},
+	{"range-list", 1, NULL, CMDLINE_RANGELIST},
+	{"max-transfer", 1, NULL, CMDLINE_MAXTRANSFER},
+	{"merge-gap", 1, NULL, CMDLINE_MERGEGAP},
+	{"no-cache", 0, NULL, CMDLINE_NOCACHE},
+	{"skip-gaps", 0, NULL, CMDLINE_SKIPGAPS},
+	{"base", 1, NULL, CMDLINE_BASE},
+	{"skip-erased", 0, NULL, CMDLINE_SKIPERASED},
+	{"erase-block", 1, NULL, CMDLINE_ERASEBLOCK},
+	{"verify-erased", 1, NULL, CMDLINE_VERIFYERASED},
+	{"interval", 1, NULL, CMDLINE_INTERVAL},
+	{"samples", 1, NULL, CMDLINE_SAMPLES},
+	{"snapshot", 0, NULL, CMDLINE_SNAPSHOT},
+	{"store", 1, NULL, CMDLINE_STORE},
+	{"progress", 1, NULL, CMDLINE_PROGRESS},
 	{"yes-i-know-what-im-doing", 0, NULL, CMDLINE_YESIKNOW},
 	{NULL, 0, NULL, 0}};
 
 
+// expected format is XXXX:XXXX where X is hex digit
+bool parse_devid(char *devstring) {
+	char *product;
+	uint32_t vid, pid;
+
+	if (!devstring) {
+		return false;
+	}
+
+
+	product = strchr(devstring, ':');
+	if (!product) {
+		return false;
+	}
+
+	vid = strtoul(devstring, NULL, 16);
+	pid = strtoul(++product, NULL, 16);
+
+	if ((vid > 0xFFFF) || (pid > 0xFFFF)) {
+		return false;
+	}
+
+	app.vid = (uint16_t)(vid & 0xFFFF);
+	app.pid = (uint16_t)(pid & 0XFFFF);
+	app.is_dev = true;
+	return true;
+}
+
 void usage(char *binfile) {
 	printf("Usage: %s COMMAND [OPTIONS]\n\n", binfile);
 	printf("You must select one of following COMMANDS:\n");
@@ -70,6 +118,21 @@ void usage(char *binfile) {
 	printf("  -A    --dump-afi-fw          Dumps whole firmware into AFI container file.\n");
 	printf("  -E    --entry PARAM          Call fw entry command with provided parameter.\n\
                                DANGEROUS!!! confirm with --yes-i-know-what-im-doing.\n");
+	printf("        --daemon SOCKET        Run as daemon keeping devices open and claimed,\n\
+                               serving requests on UNIX socket SOCKET.\n");
+	printf("        --batch FILE           Run commands listed in FILE (\"-\" for stdin) one per\n\
+                               line, in single device session. Each line has the same\n\
+                               format as usbfw command line. Device is detached only\n\
+                               after last step.\n");
+	printf("        --extract PATTERN      Extract firmware directory files with 8.3 names\n\
+                               matching PATTERN (glob, case insensitive, e.g.\n\
+                               \"*.AP\") into current directory, reading only their\n\
+                               sectors. Checksum of each file is verified.\n");
+	printf("        --watch REGIONS        Repeatedly sample RAM REGIONS (\"ADDR:LEN[,...]\" in\n\
+                               bytes) and log changed bytes with timestamps to\n\
+                               FILENAME until Ctrl-C or --samples are taken.\n");
+	printf("        --watch-csv LOG        Convert --watch LOG to CSV FILENAME with one line\n\
+                               per changed byte.\n");
 	printf("  -h    --help                 Displays this help\n\n");
 	printf("Additional you can use some of following OPTIONS.\n\n");
 	printf("  -f    --file FILENAME        File name to where data read form device is saved.\n\
@@ -89,12 +152,56 @@ void usage(char *binfile) {
 	printf("  -D    --detach               Detach (restart) device at the end of execution frimware\n\
                                specific commands.\n");
 	printf("  -a    --alternate            User alternate firmware (if present) in operations.\n");
+	printf("        --range-list FILE      Read (-r) or read firmware (-R) all ranges listed in\n\
+                               FILE instead of --lba/--block-count. Each line is\n\
+                               \"LBA COUNT [OUTFILE]\", default OUTFILE is FILENAME.LBA.\n\
+                               Ranges are sorted, merged and read in single session.\n");
+	printf("        --max-transfer N       Max sectors transferred by single read command.\n\
+                               Default is %u. Use 1 for devices not supporting\n\
+                               multi sector reads.\n", MAX_TRANSFER_SECTORS);
+	printf("        --merge-gap N          Read through gaps up to N sectors between ranges\n\
+                               instead of issuing new command. Default is %u.\n", DEFAULT_MERGE_GAP);
+	printf("        --no-cache             Don't use nor update firmware header, sysinfo,\n\
+                               bootrecord and alternate firmware location\n\
+                               cached on disk.\n");
+	printf("        --skip-gaps            During main firmware dumps read only header and\n\
+                               sectors used by directory files. Gaps between them\n\
+                               are filled with zeros in output.\n");
+	printf("        --base FILE            Incremental main firmware dump. Directory files with\n\
+                               the same name, length and checksum as in previous\n\
+                               RAW or AFI dump FILE are copied from it, only new\n\
+                               and changed ones are read. Implies --skip-gaps.\n");
+	printf("        --skip-erased          Read firmware (-R, usually with -p) only sampling\n\
+                               first and last sector of each erase block. Blocks\n\
+                               looking erased (all 0xFF) aren't read and are listed\n\
+                               in FILENAME.map.\n");
+	printf("        --erase-block N        Erase block size in sectors. Default is %u.\n", DEFAULT_ERASE_BLOCK);
+	printf("        --verify-erased N      Fully read N random skipped blocks to check they\n\
+                               are really erased. Default is 0.\n");
+	printf("        --interval MS          Time between --watch samples in milliseconds.\n\
+                               Default is 0 (as fast as possible).\n");
+	printf("        --samples N            Stop --watch after N samples. Default is 0\n\
+                               (until Ctrl-C).\n");
+	printf("        --snapshot             Read RAM (-M) twice and re-read sectors changed\n\
+                               meanwhile, for more consistent image. Byte ranges\n\
+                               still changing are listed in FILENAME.map.\n");
+	printf("        --store DIR            Put firmware dumps (-P, -A) to content addressed\n\
+                               store DIR as image named FILENAME instead of file.\n\
+                               Only chunks not yet in store are written. See\n\
+                               tools/fwstore for restoring images.\n");
+	printf("        --progress MODE        Progress of long operations: \"text\" (percent,\n\
+                               rate, ETA and errors redrawn 10 times a second),\n\
+                               \"quiet\" (none) or \"machine\" (\"progress KEY=VALUE...\"\n\
+                               lines on stderr). Default is text.\n");
 	printf("  --yes-i-know-what-im-doing   Confirm execution of dangerous command.\n");
 }
 
-void parseparams(int argc, char *argv[]) {
+PARSE_RESULT parseargs(int argc, char *argv[]) {
 	int opt;
 
+	// full getopt reinitialization, we may be called many times in batch mode
+	optind = 0;
+
 	while (true) {
 		opt = getopt_long(argc, argv, "f:ed:l:L:c:iCFISrwRTMPAE:Opo:sDah?", longopt, NULL);
 		if (opt == -1) {
@@ -106,114 +213,174 @@ void parseparams(int argc, char *argv[]) {
 			case 'e':
 				if (app.cmd != APPCMD_NONE) {
 					printf("Error: You have already select command.\n\n");
-					goto help;
+					return PARSE_HELP;
 				}
 				app.cmd = APPCMD_ENUMERATE;
 				break;
 			case 'i':
 				if (app.cmd != APPCMD_NONE) {
 					printf("Error: You have already select command.\n\n");
-					goto help;
+					return PARSE_HELP;
 				}
 				app.cmd = APPCMD_INQUIRY;
 				break;
 			case 'C':
 				if (app.cmd != APPCMD_NONE) {
 					printf("Error: You have already select command.\n\n");
-					goto help;
+					return PARSE_HELP;
 				}
 				app.cmd = APPCMD_CAPACITY;
 				break;
 			case 'F':
 				if (app.cmd != APPCMD_NONE) {
 					printf("Error: You have already select command.\n\n");
-					goto help;
+					return PARSE_HELP;
 				}
 				app.cmd = APPCMD_FCAPACITY;
 				break;
 			case 'I':
 				if (app.cmd != APPCMD_NONE) {
 					printf("Error: You have already select command.\n\n");
-					goto help;
+					return PARSE_HELP;
 				}
 				app.cmd = APPCMD_HEADINFO;
 				break;
 			case 'S':
 				if (app.cmd != APPCMD_NONE) {
 					printf("Error: You have already select command.\n\n");
-					goto help;
+					return PARSE_HELP;
 				}
 				app.cmd = APPCMD_SYSINFO;
 				break;
 			case 'r':
 				if (app.cmd != APPCMD_NONE) {
 					printf("Error: You have already select command.\n\n");
-					goto help;
+					return PARSE_HELP;
 				}
 				app.cmd = APPCMD_READ;
 				break;
 			case 'w':
 				if (app.cmd != APPCMD_NONE) {
 					printf("Error: You have already select command.\n\n");
-					goto help;
+					return PARSE_HELP;
 				}
 				app.cmd = APPCMD_WRITE;
 				break;
 			case 'R':
 				if (app.cmd != APPCMD_NONE) {
 					printf("Error: You have already select command.\n\n");
-					goto help;
+					return PARSE_HELP;
 				}
 				app.cmd = APPCMD_READ_FW;
 				break;
 			case 'T':
 				if (app.cmd != APPCMD_NONE) {
 					printf("Error: You have already select command.\n\n");
-					goto help;
+					return PARSE_HELP;
 				}
 				app.cmd = APPCMD_TEST_RAMACC;
 				break;
 			case 'M':
 				if (app.cmd != APPCMD_NONE) {
 					printf("Error: You have already select command.\n\n");
-					goto help;
+					return PARSE_HELP;
 				}
 				app.cmd = APPCMD_READ_RAM;
 				break;
 			case 'P':
 				if (app.cmd != APPCMD_NONE) {
 					printf("Error: You have already select command.\n\n");
-					goto help;
+					return PARSE_HELP;
 				}
 				app.cmd = APPCMD_DUMP_RAW;
 				break;
 			case 'A':
 				if (app.cmd != APPCMD_NONE) {
 					printf("Error: You have already select command.\n\n");
-					goto help;
+					return PARSE_HELP;
 				}
 				app.cmd = APPCMD_DUMP_AFI;
 				break;
 			case 'E':
 				if (app.cmd != APPCMD_NONE) {
 					printf("Error: You have already select command.\n\n");
-					goto help;
+					return PARSE_HELP;
 				}
 				app.cmd = APPCMD_ENTRY;
 				if (optarg == NULL) {
 					printf("Error: You must provide entry command parameter.\n\n");
-					exit(-1);
+					return PARSE_ERROR;
 				}
 				app.entry_param = strtoul(optarg, NULL, 0);
 				break;
+			case CMDLINE_DAEMON:
+				if (app.cmd != APPCMD_NONE) {
+					printf("Error: You have already select command.\n\n");
+					return PARSE_HELP;
+				}
+				app.cmd = APPCMD_DAEMON;
+				if (optarg == NULL) {
+					printf("Error: You must provide socket path.\n\n");
+					return PARSE_ERROR;
+				}
+				app.socket_path = optarg;
+				break;
+			case CMDLINE_BATCH:
+				if (app.cmd != APPCMD_NONE) {
+					printf("Error: You have already select command.\n\n");
+					return PARSE_HELP;
+				}
+				app.cmd = APPCMD_BATCH;
+				if (optarg == NULL) {
+					printf("Error: You must provide batch file name.\n\n");
+					return PARSE_ERROR;
+				}
+				app.batch_filename = optarg;
+				break;
+			case CMDLINE_EXTRACT:
+				if (app.cmd != APPCMD_NONE) {
+					printf("Error: You have already select command.\n\n");
+					return PARSE_HELP;
+				}
+				app.cmd = APPCMD_EXTRACT;
+				if (optarg == NULL) {
+					printf("Error: You must provide file name pattern.\n\n");
+					return PARSE_ERROR;
+				}
+				app.extract_pattern = optarg;
+				break;
+			case CMDLINE_WATCH:
+				if (app.cmd != APPCMD_NONE) {
+					printf("Error: You have already select command.\n\n");
+					return PARSE_HELP;
+				}
+				app.cmd = APPCMD_WATCH;
+				if (optarg == NULL) {
+					printf("Error: You must provide RAM regions to watch.\n\n");
+					return PARSE_ERROR;
+				}
+				app.watch_regions = optarg;
+				break;
+			case CMDLINE_WATCHCSV:
+				if (app.cmd != APPCMD_NONE) {
+					printf("Error: You have already select command.\n\n");
+					return PARSE_HELP;
+				}
+				app.cmd = APPCMD_WATCH_CSV;
+				if (optarg == NULL) {
+					printf("Error: You must provide watch log file name.\n\n");
+					return PARSE_ERROR;
+				}
+				app.watch_log = optarg;
+				break;
 			case '?':
 			case 'h':
-				goto help;
+				return PARSE_HELP;
 			// options
 			case 'f':
 				if (optarg == NULL) {
 					printf("Error: You must provide output filename.\n\n");
-					exit(-1);
+					return PARSE_ERROR;
 				}
 				app.ofilename = optarg;
 				app.ifilename = optarg;
@@ -221,36 +388,36 @@ void parseparams(int argc, char *argv[]) {
 			case 'd':
 				if (optarg == NULL) {
 					printf("Error: You must provide must device id.\n\n");
-					exit(-1);
+					return PARSE_ERROR;
 				}
 				if (!parse_devid(optarg)) {
 					printf("Error: Incorrect device id.\n\n");
-					exit(-1);
+					return PARSE_ERROR;
 				}
 				break;
 			case 'L':
 				if (optarg == NULL) {
 					printf("Error: You must provide LUN number.\n\n");
-					exit(-1);
+					return PARSE_ERROR;
 				}
 				uint32_t lun = strtoul(optarg, NULL, 0);
 				if (lun > 7) {
 					printf("Error: Incorrect LUN number.\n\n");
-					exit(-1);
+					return PARSE_ERROR;
 				}
 				app.lun = (uint8_t)(lun & 7);
 				break;
 			case 'l':
 				if (optarg == NULL) {
 					printf("Error: You must provide start LBA sector.\n\n");
-					exit(-1);
+					return PARSE_ERROR;
 				}
 				app.lba = strtoul(optarg, NULL, 0);
 				break;
 			case 'c':
 				if (optarg == NULL) {
 					printf("Error: You must provide block count.\n\n");
-					exit(-1);
+					return PARSE_ERROR;
 				}
 				app.bc = strtoul(optarg, NULL, 0);
 				break;
@@ -263,7 +430,7 @@ void parseparams(int argc, char *argv[]) {
 			case 'o':
 				if (optarg == NULL) {
 					printf("Error: You must provide source file offset.\n\n");
-					exit(-1);
+					return PARSE_ERROR;
 				}
 				app.offset = strtoul(optarg, NULL, 0);
 				break;
@@ -276,6 +443,102 @@ void parseparams(int argc, char *argv[]) {
 			case 'a':
 				app.is_alt_fw = true;
 				break;
+			case CMDLINE_RANGELIST:
+				if (optarg == NULL) {
+					printf("Error: You must provide range list file name.\n\n");
+					return PARSE_ERROR;
+				}
+				app.range_filename = optarg;
+				break;
+			case CMDLINE_MAXTRANSFER:
+				if (optarg == NULL) {
+					printf("Error: You must provide max transfer length.\n\n");
+					return PARSE_ERROR;
+				}
+				app.max_transfer = strtoul(optarg, NULL, 0);
+				if ((app.max_transfer == 0) || (app.max_transfer > MAX_TRANSFER_LIMIT)) {
+					printf("Error: Max transfer length should be between 1 and %u.\n\n", MAX_TRANSFER_LIMIT);
+					return PARSE_ERROR;
+				}
+				break;
+			case CMDLINE_MERGEGAP:
+				if (optarg == NULL) {
+					printf("Error: You must provide merge gap length.\n\n");
+					return PARSE_ERROR;
+				}
+				app.merge_gap = strtoul(optarg, NULL, 0);
+				break;
+			case CMDLINE_SKIPERASED:
+				app.is_skip_erased = true;
+				break;
+			case CMDLINE_ERASEBLOCK:
+				if (optarg == NULL) {
+					printf("Error: You must provide erase block size.\n\n");
+					return PARSE_ERROR;
+				}
+				app.erase_block = strtoul(optarg, NULL, 0);
+				if (app.erase_block == 0) {
+					printf("Error: Erase block size must be greater than 0.\n\n");
+					return PARSE_ERROR;
+				}
+				break;
+			case CMDLINE_VERIFYERASED:
+				if (optarg == NULL) {
+					printf("Error: You must provide count of blocks to verify.\n\n");
+					return PARSE_ERROR;
+				}
+				app.verify_erased = strtoul(optarg, NULL, 0);
+				break;
+			case CMDLINE_INTERVAL:
+				if (optarg == NULL) {
+					printf("Error: You must provide sampling interval.\n\n");
+					return PARSE_ERROR;
+				}
+				app.interval = strtoul(optarg, NULL, 0) * 1000;
+				break;
+			case CMDLINE_SAMPLES:
+				if (optarg == NULL) {
+					printf("Error: You must provide count of samples.\n\n");
+					return PARSE_ERROR;
+				}
+				app.samples = strtoul(optarg, NULL, 0);
+				break;
+			case CMDLINE_SNAPSHOT:
+				app.is_snapshot = true;
+				break;
+			case CMDLINE_NOCACHE:
+				app.is_cache = false;
+				break;
+			case CMDLINE_SKIPGAPS:
+				app.is_skip_gaps = true;
+				break;
+			case CMDLINE_BASE:
+				if (optarg == NULL) {
+					printf("Error: You must provide previous dump file name.\n\n");
+					return PARSE_ERROR;
+				}
+				app.base_filename = optarg;
+				app.is_skip_gaps = true;
+				break;
+			case CMDLINE_STORE:
+				if (optarg == NULL) {
+					printf("Error: You must provide store directory.\n\n");
+					return PARSE_ERROR;
+				}
+				app.store_dirname = optarg;
+				break;
+			case CMDLINE_PROGRESS:
+				if (optarg && (strcmp(optarg, "text") == 0)) {
+					app.progress_mode = PROGRESS_TEXT;
+				} else if (optarg && (strcmp(optarg, "quiet") == 0)) {
+					app.progress_mode = PROGRESS_QUIET;
+				} else if (optarg && (strcmp(optarg, "machine") == 0)) {
+					app.progress_mode = PROGRESS_MACHINE;
+				} else {
+					printf("Error: Progress mode must be text, quiet or machine.\n\n");
+					return PARSE_ERROR;
+				}
+				break;
 			case CMDLINE_YESIKNOW:
 				app.is_yesiknow = true;
 				break;
@@ -284,12 +547,20 @@ void parseparams(int argc, char *argv[]) {
 
 	if (app.cmd == APPCMD_NONE) {
 		printf("Error: You must select a command.\n\n");
-		goto help;
+		return PARSE_HELP;
 	}
 
-	return;
+	return PARSE_OK;
+}
 
-help:
-	usage(basename(argv[0]));
-	exit(0);
+void parseparams(int argc, char *argv[]) {
+	switch (parseargs(argc, argv)) {
+		case PARSE_OK:
+			return;
+		case PARSE_ERROR:
+			exit(-1);
+		default:
+			usage(basename(argv[0]));
+			exit(0);
+	}
 }
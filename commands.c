@@ -35,21 +35,27 @@ int check_csw(CBW *cbw, CSW *csw) {
 }
 
 
+// tag is given when command is sent, each device counts its own
 void command_init(CBW *cbw) {
-	static uint32_t tag = 0;
-
 	memset(cbw, 0, sizeof(CBW));
 	memcpy(cbw->dCBWSignature, "USBC", 4);
-	cbw->dCBWTag = ++tag;
 	cbw->bCBWCBLength = 11;				// size of SCSI command
 }
 
 
+// Data phase of long transfer takes its time, so timeout grows with length.
+// Sized for slow full speed devices, 32 MiB read gets about 2 minutes.
+static unsigned int data_timeout(uint32_t length) {
+	return USB_TIMEOUT + (length / USB_MIN_RATE);
+}
+
+
 int command_perform_generic_read(CBW *cbw, USB_BULK_CONTEXT *uctx, unsigned char *data) {
 	enum libusb_error usb_error = 0;
 	CSW csw;
 	int transferred;
 
+	cbw->dCBWTag = ++uctx->tag;
 	dbg_printf("Start command 0x%02hhX - tag: %u\n", cbw->CBWCB[0], cbw->dCBWTag);
 
 	// send CBW
@@ -63,7 +69,7 @@ int command_perform_generic_read(CBW *cbw, USB_BULK_CONTEXT *uctx, unsigned char
 
 	// recieve requested data if present
 	if (cbw->dCBWDataTransferLength > 0) {
-		usb_error = libusb_bulk_transfer(uctx->handle, uctx->endpoint_in, data, cbw->dCBWDataTransferLength, &transferred, USB_TIMEOUT);
+		usb_error = libusb_bulk_transfer(uctx->handle, uctx->endpoint_in, data, cbw->dCBWDataTransferLength, &transferred, data_timeout(cbw->dCBWDataTransferLength));
 		if (usb_error) {
 			dbg_printf("USB error at bulk in (data): %s\n", libusb_strerror(usb_error));
 			return usb_error;
@@ -106,6 +112,7 @@ int command_perform_generic_write(CBW *cbw, USB_BULK_CONTEXT *uctx, unsigned cha
 	CSW csw;
 	int transferred;
 
+	cbw->dCBWTag = ++uctx->tag;
 	dbg_printf("Start command 0x%02hhX - tag: %u\n", cbw->CBWCB[0], cbw->dCBWTag);
 
 	// send CBW
@@ -119,7 +126,7 @@ int command_perform_generic_write(CBW *cbw, USB_BULK_CONTEXT *uctx, unsigned cha
 
 	// send requested data if present
 	if (cbw->dCBWDataTransferLength > 0) {
-		usb_error = libusb_bulk_transfer(uctx->handle, uctx->endpoint_out, data, cbw->dCBWDataTransferLength, &transferred, USB_TIMEOUT);
+		usb_error = libusb_bulk_transfer(uctx->handle, uctx->endpoint_out, data, cbw->dCBWDataTransferLength, &transferred, data_timeout(cbw->dCBWDataTransferLength));
 		if (usb_error) {
 			dbg_printf("USB error at bulk out (data): %s\n", libusb_strerror(usb_error));
 			return usb_error;
@@ -215,13 +222,13 @@ int command_perform_read_capacity(CBW *cbw, USB_BULK_CONTEXT *uctx, SCSI_CAPACIT
 	return 0;
 }
 
-// SCSI READ10 (one sector) command
+// SCSI READ10 command
 
-void command_init_read10one(CBW *cbw, uint8_t lun, uint32_t lba, uint32_t sector_size) {
+void command_init_read10(CBW *cbw, uint8_t lun, uint32_t lba, uint16_t count, uint32_t sector_size) {
 	command_init(cbw);
 	cbw->mCBWFlags = LIBUSB_ENDPOINT_IN;
 	cbw->bCBWLUN = lun;
-	cbw->dCBWDataTransferLength = sector_size;
+	cbw->dCBWDataTransferLength = sector_size * count;
 	cbw->CBWCB[SCSI_PACKET_CMD] = SCSI_CMD_READ10;
 	cbw->CBWCB[SCSI_PACKET_LUN] = ((lun << 5) & 0xFF);
 	// big endian
@@ -229,8 +236,18 @@ void command_init_read10one(CBW *cbw, uint8_t lun, uint32_t lba, uint32_t sector
 	cbw->CBWCB[SCSI_PACKET_LBA + 1] = (lba >> 16) & 0xFF;
 	cbw->CBWCB[SCSI_PACKET_LBA + 2] = (lba >>  8) & 0xFF;
 	cbw->CBWCB[SCSI_PACKET_LBA + 3] = (lba >>  0) & 0xFF;
-	cbw->CBWCB[SCSI_PACKET_LENGTH + 0] = 0;
-	cbw->CBWCB[SCSI_PACKET_LENGTH + 1] = 1;
+	cbw->CBWCB[SCSI_PACKET_LENGTH + 0] = (count >> 8) & 0xFF;
+	cbw->CBWCB[SCSI_PACKET_LENGTH + 1] = (count >> 0) & 0xFF;
+}
+
+int command_perform_read10(CBW *cbw, USB_BULK_CONTEXT *uctx, uint8_t *buf) {
+	return command_perform_generic_read(cbw, uctx, (unsigned char *)buf);
+}
+
+// SCSI READ10 (one sector) command
+
+void command_init_read10one(CBW *cbw, uint8_t lun, uint32_t lba, uint32_t sector_size) {
+	command_init_read10(cbw, lun, lba, 1, sector_size);
 }
 
 int command_perform_read10one(CBW *cbw, USB_BULK_CONTEXT *uctx, uint8_t *buf) {
@@ -304,13 +321,13 @@ int command_perform_act_detach(CBW *cbw, USB_BULK_CONTEXT *uctx) {
 	return command_perform_generic_read(cbw, uctx, NULL);
 }
 
-// ACTIONS READ (one sector) command
+// ACTIONS READ command
 
-void command_init_act_readone(CBW *cbw, uint8_t lun, uint32_t lba, bool is_log) {
+void command_init_act_read(CBW *cbw, uint8_t lun, uint32_t lba, uint16_t count, bool is_log) {
 	command_init(cbw);
 	cbw->mCBWFlags = LIBUSB_ENDPOINT_IN;
 	cbw->bCBWLUN = lun;
-	cbw->dCBWDataTransferLength = SECTOR_SIZE;
+	cbw->dCBWDataTransferLength = SECTOR_SIZE * count;
 	cbw->CBWCB[SCSI_PACKET_CMD] = is_log ? SCSI_CMD_ACTF_NAND_LOG : SCSI_CMD_ACTF_NAND_PHY;
 	// at 'lun' offset place read mark
 	cbw->CBWCB[SCSI_PACKET_LUN] = 0x80;
@@ -320,8 +337,18 @@ void command_init_act_readone(CBW *cbw, uint8_t lun, uint32_t lba, bool is_log)
 	cbw->CBWCB[SCSI_PACKET_LBA + 2] = (lba >> 16) & 0xFF;
 	cbw->CBWCB[SCSI_PACKET_LBA + 3] = (lba >> 24) & 0xFF;
 	// so in transfer length
-	cbw->CBWCB[SCSI_PACKET_LENGTH + 0] = 1;
-	cbw->CBWCB[SCSI_PACKET_LENGTH + 1] = 0;
+	cbw->CBWCB[SCSI_PACKET_LENGTH + 0] = (count >> 0) & 0xFF;
+	cbw->CBWCB[SCSI_PACKET_LENGTH + 1] = (count >> 8) & 0xFF;
+}
+
+int command_perform_act_read(CBW *cbw, USB_BULK_CONTEXT *uctx, uint8_t *buf) {
+	return command_perform_generic_read(cbw, uctx, (unsigned char *)buf);
+}
+
+// ACTIONS READ (one sector) command
+
+void command_init_act_readone(CBW *cbw, uint8_t lun, uint32_t lba, bool is_log) {
+	command_init_act_read(cbw, lun, lba, 1, is_log);
 }
 
 int command_perform_act_readone(CBW *cbw, USB_BULK_CONTEXT *uctx, uint8_t *buf) {
@@ -10,6 +10,7 @@ void zero_bulk_context(USB_BULK_CONTEXT *uctx) {
 	uctx->is_claimed = false;
 	uctx->endpoint_in = 0;
 	uctx->endpoint_out = 0;
+	uctx->tag = 0;
 }
 
 int init_bulk_context(USB_BULK_CONTEXT *uctx, libusb_device *dev) {
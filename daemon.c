@@ -0,0 +1,320 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "usbfw.h"
+
+static SESSION_CONTEXT devices[DAEMON_MAX_DEVICES];
+static uint32_t device_count = 0;
+static volatile sig_atomic_t is_quit = 0;
+
+
+static void daemon_signal(int sig) {
+	is_quit = 1;
+}
+
+// find already open device or open and claim new one
+static SESSION_CONTEXT * daemon_get_device(uint16_t vid, uint16_t pid) {
+	if ((vid == 0) && (pid == 0)) {
+		vid = app.vid;
+		pid = app.pid;
+	}
+
+	for (uint32_t i = 0; i < device_count; i++) {
+		if ((devices[i].vid == vid) && (devices[i].pid == pid)) {
+			return &devices[i];
+		}
+	}
+
+	if (device_count >= DAEMON_MAX_DEVICES) {
+		printf("Error: Too many devices open.\n");
+		return NULL;
+	}
+
+	SESSION_CONTEXT *dev = &devices[device_count];
+	zero_session(dev);
+	dev->max_transfer = app.max_transfer;
+	dev->is_cache = app.is_cache;
+	if (!session_open(dev, vid, pid)) {
+		return NULL;
+	}
+	device_count++;
+
+	printf("Device %04hX:%04hX opened.\n", vid, pid);
+	return dev;
+}
+
+static void daemon_put_device(SESSION_CONTEXT *dev, bool detach) {
+	printf("Device %04hX:%04hX released.\n", dev->vid, dev->pid);
+	session_detach(dev, detach && dev->is_act);
+	session_close(dev);
+
+	// keep table dense
+	device_count--;
+	if (dev != &devices[device_count]) {
+		memcpy(dev, &devices[device_count], sizeof(SESSION_CONTEXT));
+	}
+}
+
+// send response with optional memfd attached
+static bool daemon_respond(int client, DAEMON_STATUS status, int memfd, uint32_t length) {
+	DAEMON_RESPONSE resp;
+	struct msghdr msg;
+	struct iovec iov;
+	union {
+		struct cmsghdr	align;
+		char		buf[CMSG_SPACE(sizeof(int))];
+	} control;
+
+	resp.magic = DAEMON_MAGIC;
+	resp.status = status;
+	resp.length = (memfd >= 0) ? length : 0;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &resp;
+	iov.iov_len = sizeof(resp);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	if (memfd >= 0) {
+		memset(&control, 0, sizeof(control));
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &memfd, sizeof(int));
+	}
+
+	return sendmsg(client, &msg, MSG_NOSIGNAL) == sizeof(resp);
+}
+
+// create memfd of requested size and map it for filling
+static int daemon_memfd(uint32_t length, uint8_t **map) {
+	int memfd = memfd_create("usbfw", MFD_CLOEXEC);
+	if (memfd < 0) {
+		return -1;
+	}
+
+	if (ftruncate(memfd, length)) {
+		close(memfd);
+		return -1;
+	}
+
+	*map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+	if (*map == MAP_FAILED) {
+		close(memfd);
+		return -1;
+	}
+
+	return memfd;
+}
+
+static bool daemon_request(int client, DAEMON_REQUEST *req) {
+	SESSION_CONTEXT *dev;
+	DAEMON_STATUS status = DAEMON_STATUS_OK;
+	uint32_t length = 0;
+	uint8_t *map = NULL;
+	int memfd = -1;
+
+	dbg_printf("Daemon request %u: area %u, LUN %u, LBA 0x%08X, count 0x%08X\n", req->cmd, req->area, req->lun, req->lba, req->count);
+
+	if ((req->magic != DAEMON_MAGIC) || (req->lun > 7)) {
+		return daemon_respond(client, DAEMON_STATUS_BAD_REQUEST, -1, 0);
+	}
+
+	dev = daemon_get_device(req->vendorId, req->productId);
+	if (!dev) {
+		return daemon_respond(client, DAEMON_STATUS_NO_DEVICE, -1, 0);
+	}
+
+	// validate and size request
+	switch (req->cmd) {
+		case DAEMON_CMD_READ:
+			if ((req->count == 0) || (req->count > DAEMON_MAX_SECTORS) || (req->area > AREA_RAM)) {
+				return daemon_respond(client, DAEMON_STATUS_BAD_REQUEST, -1, 0);
+			}
+			if ((uint64_t)req->lba + req->count > UINT32_MAX) {
+				return daemon_respond(client, DAEMON_STATUS_BAD_REQUEST, -1, 0);
+			}
+			if ((req->area == AREA_RAM) && ((req->lba >= RAM_SECTORS) || (req->lba + req->count > RAM_SECTORS))) {
+				return daemon_respond(client, DAEMON_STATUS_BAD_REQUEST, -1, 0);
+			}
+			if ((req->area != AREA_LUN) && !session_init_act(dev)) {
+				return daemon_respond(client, DAEMON_STATUS_IO_ERROR, -1, 0);
+			}
+			length = req->count * SECTOR_SIZE;
+			break;
+		case DAEMON_CMD_HEADER:
+			if (!session_init_act(dev)) {
+				return daemon_respond(client, DAEMON_STATUS_IO_ERROR, -1, 0);
+			}
+			length = sizeof(FW_HEADER);
+			break;
+		case DAEMON_CMD_SYSINFO:
+			if (!session_init_act(dev)) {
+				return daemon_respond(client, DAEMON_STATUS_IO_ERROR, -1, 0);
+			}
+			length = sizeof(FW_SYSINFO);
+			break;
+		case DAEMON_CMD_DETACH:
+			daemon_put_device(dev, true);
+			return daemon_respond(client, DAEMON_STATUS_OK, -1, 0);
+		default:
+			return daemon_respond(client, DAEMON_STATUS_BAD_REQUEST, -1, 0);
+	}
+
+	// data goes directly from USB into shared memory
+	memfd = daemon_memfd(length, &map);
+	if (memfd < 0) {
+		return daemon_respond(client, DAEMON_STATUS_NO_MEMORY, -1, 0);
+	}
+
+	switch (req->cmd) {
+		case DAEMON_CMD_READ:
+			if (!read_area(dev, req->area, req->lun, req->lba, req->count, map)) {
+				status = DAEMON_STATUS_IO_ERROR;
+			}
+			break;
+		case DAEMON_CMD_HEADER: {
+			FW_HEADER *fw_header = session_get_header(dev, req->lun, req->lba);
+			if (fw_header) {
+				memcpy(map, fw_header, sizeof(FW_HEADER));
+			} else {
+				status = DAEMON_STATUS_IO_ERROR;
+			}
+			break;
+		}
+		case DAEMON_CMD_SYSINFO: {
+			FW_SYSINFO *sysinfo = session_get_sysinfo(dev, req->lun);
+			if (sysinfo) {
+				memcpy(map, sysinfo, sizeof(FW_SYSINFO));
+			} else {
+				status = DAEMON_STATUS_IO_ERROR;
+			}
+			break;
+		}
+		default:
+			break;
+	}
+
+	munmap(map, length);
+
+	bool retval = daemon_respond(client, status, (status == DAEMON_STATUS_OK) ? memfd : -1, length);
+	close(memfd);
+	return retval;
+}
+
+bool daemon_run(void) {
+	struct sockaddr_un addr;
+	struct pollfd fds[DAEMON_MAX_CLIENTS + 1];
+	uint32_t nfds = 1;
+	int listener;
+
+	if (strlen(app.socket_path) >= sizeof(addr.sun_path)) {
+		printf("Error: Socket path \"%s\" too long.\n", app.socket_path);
+		return false;
+	}
+
+	listener = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (listener < 0) {
+		printf("Error: Cannot create socket: %s.\n", strerror(errno));
+		return false;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, app.socket_path);
+
+	// remove stale socket and keep it private
+	unlink(app.socket_path);
+	mode_t mask = umask(0077);
+	if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) || listen(listener, DAEMON_MAX_CLIENTS)) {
+		umask(mask);
+		printf("Error: Cannot listen on socket \"%s\": %s.\n", app.socket_path, strerror(errno));
+		close(listener);
+		return false;
+	}
+	umask(mask);
+
+	signal(SIGINT, daemon_signal);
+	signal(SIGTERM, daemon_signal);
+
+	// open default device up front, so first request doesn't pay for it
+	if (app.is_dev) {
+		daemon_get_device(app.vid, app.pid);
+	}
+
+	printf("Daemon listening on \"%s\".\n", app.socket_path);
+
+	fds[0].fd = listener;
+	fds[0].events = POLLIN;
+
+	while (!is_quit) {
+		if (poll(fds, nfds, -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			printf("Error: Poll failed: %s.\n", strerror(errno));
+			break;
+		}
+
+		// serve clients first, new connections later
+		for (uint32_t i = 1; i < nfds; i++) {
+			if (!fds[i].revents) {
+				continue;
+			}
+
+			DAEMON_REQUEST req;
+			ssize_t len = recv(fds[i].fd, &req, sizeof(req), 0);
+			if ((len == sizeof(req)) && daemon_request(fds[i].fd, &req)) {
+				continue;
+			}
+
+			// disconnected or broken client
+			close(fds[i].fd);
+			fds[i--] = fds[--nfds];
+		}
+
+		if (fds[0].revents & POLLIN) {
+			int client = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+			if (client < 0) {
+				continue;
+			}
+			if (nfds > DAEMON_MAX_CLIENTS) {
+				close(client);
+				continue;
+			}
+			fds[nfds].fd = client;
+			fds[nfds].events = POLLIN;
+			fds[nfds].revents = 0;
+			nfds++;
+		}
+	}
+
+	printf("Daemon exiting.\n");
+
+	for (uint32_t i = 1; i < nfds; i++) {
+		close(fds[i].fd);
+	}
+	close(listener);
+	unlink(app.socket_path);
+
+	while (device_count) {
+		daemon_put_device(&devices[device_count - 1], app.is_detach);
+	}
+
+	return true;
+}
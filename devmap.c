@@ -0,0 +1,233 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/userfaultfd.h>
+
+#include "usbfw.h"
+
+// Device area mapped into memory. Pages are missing until touched, then
+// fault thread reads them through block device cache and installs them with
+// UFFDIO_COPY, together with following not yet present pages.
+
+static bool devmap_fill(DEVMAP *map, uint64_t page) {
+	uint32_t sectors_per_page = map->page_size / SECTOR_SIZE;
+	uint64_t pages = map->size / map->page_size;
+	uint32_t run = 0;
+
+	// fault queued before page was filled by prefetch, only wake faulting thread
+	if (map->present[page]) {
+		struct uffdio_range range = {
+			.start = (uintptr_t)map->addr + (page * map->page_size),
+			.len = map->page_size
+		};
+		return !ioctl(map->uffd, UFFDIO_WAKE, &range);
+	}
+
+	// prefetch stops at first page already present
+	while ((run < map->prefetch) && (page + run < pages) && !map->present[page + run]) {
+		run++;
+	}
+
+	// part of last page past area end stays zeroed
+	uint64_t first = page * sectors_per_page;
+	uint64_t count = (uint64_t)run * sectors_per_page;
+	if (first + count > map->count) {
+		count = map->count - first;
+	}
+	memset(map->buf, 0, (size_t)run * map->page_size);
+	if (!blockdev_read(map->dev, map->lba + first, count, map->buf)) {
+		dbg_printf("Mapped area read failed at sector %llu\n", (unsigned long long)(map->lba + first));
+		return false;
+	}
+
+	struct uffdio_copy copy = {
+		.dst = (uintptr_t)map->addr + (page * map->page_size),
+		.src = (uintptr_t)map->buf,
+		.len = (uint64_t)run * map->page_size,
+		.mode = 0
+	};
+	if (ioctl(map->uffd, UFFDIO_COPY, &copy) && (errno != EEXIST)) {
+		dbg_printf("UFFDIO_COPY failed: %s\n", strerror(errno));
+		return false;
+	}
+
+	for (uint32_t i = 0; i < run; i++) {
+		map->present[page + i] = 1;
+	}
+	map->faults++;
+	map->pages += run;
+	return true;
+}
+
+// Unreadable page is filled with zeros, faulting thread can't be told
+// about error any other way and would hang otherwise.
+static bool devmap_zero(DEVMAP *map, uint64_t page) {
+	struct uffdio_zeropage zero = {
+		.range = {
+			.start = (uintptr_t)map->addr + (page * map->page_size),
+			.len = map->page_size
+		},
+		.mode = 0
+	};
+
+	map->present[page] = 1;
+	map->errors++;
+	return !ioctl(map->uffd, UFFDIO_ZEROPAGE, &zero) || (errno == EEXIST);
+}
+
+static void * devmap_thread(void *data) {
+	DEVMAP *map = data;
+	struct pollfd fds[2] = {
+		{ .fd = map->uffd, .events = POLLIN },
+		{ .fd = map->stop[0], .events = POLLIN }
+	};
+
+	while (true) {
+		struct uffd_msg msg;
+
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		if (fds[1].revents) {
+			break;
+		}
+
+		if (read(map->uffd, &msg, sizeof(msg)) != sizeof(msg)) {
+			continue;
+		}
+		if (msg.event != UFFD_EVENT_PAGEFAULT) {
+			continue;
+		}
+
+		uint64_t page = (msg.arg.pagefault.address - (uintptr_t)map->addr) / map->page_size;
+		if (!devmap_fill(map, page)) {
+			devmap_zero(map, page);
+		}
+	}
+
+	return NULL;
+}
+
+static int devmap_userfaultfd(void) {
+	int fd;
+
+	// user mode only faults are allowed for unprivileged users on new kernels
+#ifdef UFFD_USER_MODE_ONLY
+	fd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK | UFFD_USER_MODE_ONLY);
+	if (fd >= 0) {
+		return fd;
+	}
+#endif
+	fd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+	return fd;
+}
+
+static void devmap_free(DEVMAP *map) {
+	if (map->stop[0] >= 0) {
+		close(map->stop[0]);
+		close(map->stop[1]);
+	}
+	if (map->uffd >= 0) {
+		close(map->uffd);
+	}
+	if (map->addr != MAP_FAILED) {
+		munmap(map->addr, map->size);
+	}
+	free(map->present);
+	free(map->buf);
+	map->addr = MAP_FAILED;
+	map->uffd = -1;
+	map->stop[0] = -1;
+	map->stop[1] = -1;
+	map->present = NULL;
+	map->buf = NULL;
+}
+
+// Map 'count' sectors from 'lba' of block device. Up to 'prefetch' pages
+// (0 for default) are read on each fault. Memory is writable, but writes
+// change only local copy.
+bool devmap_open(DEVMAP *map, BLOCKDEV *dev, uint32_t lba, uint32_t count, uint32_t prefetch) {
+	struct uffdio_api api = { .api = UFFD_API, .features = 0 };
+	struct uffdio_register reg;
+
+	map->dev = dev;
+	map->lba = lba;
+	map->count = count;
+	map->prefetch = prefetch ? prefetch : DEVMAP_PREFETCH;
+	map->page_size = sysconf(_SC_PAGESIZE);
+	map->size = (((uint64_t)count * SECTOR_SIZE) + map->page_size - 1) & ~((uint64_t)map->page_size - 1);
+	map->faults = 0;
+	map->pages = 0;
+	map->errors = 0;
+	map->addr = MAP_FAILED;
+	map->uffd = -1;
+	map->stop[0] = -1;
+	map->stop[1] = -1;
+	map->buf = NULL;
+	map->present = NULL;
+
+	if ((count == 0) || (map->page_size % SECTOR_SIZE)) {
+		printf("Error: Cannot map empty area.\n");
+		return false;
+	}
+
+	map->buf = malloc((size_t)map->prefetch * map->page_size);
+	map->present = calloc(map->size / map->page_size, 1);
+	if (!map->buf || !map->present) {
+		printf("Error: Out of memory.\n");
+		goto error;
+	}
+
+	map->addr = mmap(NULL, map->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map->addr == MAP_FAILED) {
+		printf("Error: Cannot reserve memory for mapped area.\n");
+		goto error;
+	}
+
+	map->uffd = devmap_userfaultfd();
+	if ((map->uffd < 0) || ioctl(map->uffd, UFFDIO_API, &api)) {
+		printf("Error: Userfaultfd is not available: %s.\n", strerror(errno));
+		goto error;
+	}
+
+	reg.range.start = (uintptr_t)map->addr;
+	reg.range.len = map->size;
+	reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+	if (ioctl(map->uffd, UFFDIO_REGISTER, &reg)) {
+		printf("Error: Cannot register mapped area: %s.\n", strerror(errno));
+		goto error;
+	}
+
+	if (pipe(map->stop)) {
+		printf("Error: Cannot create pipe.\n");
+		goto error;
+	}
+
+	if (pthread_create(&map->thread, NULL, devmap_thread, map)) {
+		printf("Error: Cannot start fault thread.\n");
+		goto error;
+	}
+
+	return true;
+
+error:
+	devmap_free(map);
+	return false;
+}
+
+// no thread may touch mapped area anymore
+void devmap_close(DEVMAP *map) {
+	if (write(map->stop[1], "", 1) == 1) {
+		pthread_join(map->thread, NULL);
+	}
+	devmap_free(map);
+}
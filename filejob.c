@@ -0,0 +1,236 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glob.h>
+#include <ftw.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "usbfw.h"
+
+// Many files processed by thread pool. Each file is mapped and passed to
+// callback together with its own memory stream for output. Streams are
+// printed in order of files, so output doesn't depend on thread timing.
+
+typedef struct {
+	char			**files;
+	uint32_t		count;
+	FILE_JOB_CALLBACK	callback;
+	void			*data;
+	uint32_t		next;		// next file to process, taken atomically
+	char			**output;	// output of each file, NULL until done
+	size_t			*length;
+	uint32_t		printed;	// files already printed
+	uint32_t		failed;
+	pthread_mutex_t		lock;		// guards output and counters above
+} FILE_JOB;
+
+typedef struct {
+	char			**files;
+	uint32_t		count;
+	uint32_t		size;		// allocated
+} FILE_LIST;
+
+// nftw has no callback argument
+static __thread FILE_LIST *walk_list;
+
+static bool file_list_add(FILE_LIST *list, const char *filename) {
+	if (list->count == list->size) {
+		uint32_t size = list->size ? (list->size * 2) : 256;
+		char **files = realloc(list->files, size * sizeof(char *));
+		if (!files) {
+			return false;
+		}
+		list->files = files;
+		list->size = size;
+	}
+
+	list->files[list->count] = strdup(filename);
+	if (!list->files[list->count]) {
+		return false;
+	}
+	list->count++;
+	return true;
+}
+
+static int file_walk(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+	if ((type == FTW_F) && S_ISREG(st->st_mode)) {
+		return file_list_add(walk_list, path) ? 0 : 1;
+	}
+	return 0;
+}
+
+static int file_compare(const void *a, const void *b) {
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+// Expand 'args' to list of files. Directories are walked recursively and
+// their files sorted, globs are expanded, anything else is taken as is.
+char ** file_job_collect(char **args, uint32_t count, uint32_t *file_count) {
+	FILE_LIST list = { .files = NULL, .count = 0, .size = 0 };
+	struct stat st;
+
+	for (uint32_t i = 0; i < count; i++) {
+		uint32_t first = list.count;
+		bool is_added = true;
+
+		if (!stat(args[i], &st) && S_ISDIR(st.st_mode)) {
+			walk_list = &list;
+			is_added = !nftw(args[i], file_walk, 32, FTW_PHYS);
+			qsort(list.files + first, list.count - first, sizeof(char *), file_compare);
+		} else {
+			glob_t g;
+			if (glob(args[i], GLOB_NOCHECK, NULL, &g) == 0) {
+				for (size_t j = 0; is_added && (j < g.gl_pathc); j++) {
+					is_added = file_list_add(&list, g.gl_pathv[j]);
+				}
+				globfree(&g);
+			} else {
+				is_added = file_list_add(&list, args[i]);
+			}
+		}
+
+		if (!is_added) {
+			printf("Error: Cannot list files of \"%s\".\n", args[i]);
+			file_job_free(list.files, list.count);
+			return NULL;
+		}
+	}
+
+	*file_count = list.count;
+	return list.files ? list.files : calloc(1, sizeof(char *));
+}
+
+void file_job_free(char **files, uint32_t count) {
+	for (uint32_t i = 0; files && (i < count); i++) {
+		free(files[i]);
+	}
+	free(files);
+}
+
+static bool file_job_one(FILE_JOB *job, char *filename, FILE *out) {
+	uint8_t *data = NULL;
+	struct stat st;
+	bool retval;
+
+	int fd = open(filename, O_RDONLY);
+	if ((fd < 0) || fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+		fprintf(stderr, "Error: Cannot open file \"%s\".\n", filename);
+		if (fd >= 0) {
+			close(fd);
+		}
+		return false;
+	}
+
+	if (st.st_size) {
+		data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			fprintf(stderr, "Error: Cannot map file \"%s\".\n", filename);
+			close(fd);
+			return false;
+		}
+		madvise(data, st.st_size, MADV_WILLNEED);
+	}
+
+	retval = job->callback(filename, data, st.st_size, out, job->data);
+
+	if (data) {
+		munmap(data, st.st_size);
+	}
+	close(fd);
+	return retval;
+}
+
+static void * file_job_thread(void *data) {
+	FILE_JOB *job = data;
+
+	while (true) {
+		uint32_t i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+		if (i >= job->count) {
+			break;
+		}
+
+		char *buf = NULL;
+		size_t len = 0;
+		FILE *out = open_memstream(&buf, &len);
+		bool is_ok = out && file_job_one(job, job->files[i], out);
+		if (out) {
+			fclose(out);
+		}
+
+		pthread_mutex_lock(&job->lock);
+		job->output[i] = buf ? buf : strdup("");
+		job->length[i] = buf ? len : 0;
+		if (!is_ok) {
+			job->failed++;
+		}
+		while ((job->printed < job->count) && job->output[job->printed]) {
+			fwrite(job->output[job->printed], 1, job->length[job->printed], stdout);
+			free(job->output[job->printed]);
+			job->output[job->printed] = "";
+			job->printed++;
+		}
+		pthread_mutex_unlock(&job->lock);
+	}
+
+	return NULL;
+}
+
+// Run 'callback' for each of 'files' in up to 'threads' threads (0 - one
+// per CPU). Returns false when any file couldn't be read or callback failed.
+bool file_job_run(char **files, uint32_t count, uint32_t threads, FILE_JOB_CALLBACK callback, void *data) {
+	pthread_t thread[FILE_JOB_MAX_THREADS];
+	uint32_t started;
+	FILE_JOB job = {
+		.files = files,
+		.count = count,
+		.callback = callback,
+		.data = data,
+		.next = 0,
+		.printed = 0,
+		.failed = 0
+	};
+
+	job.output = calloc(count ? count : 1, sizeof(char *));
+	job.length = calloc(count ? count : 1, sizeof(size_t));
+	if (!job.output || !job.length) {
+		printf("Error: Out of memory.\n");
+		free(job.output);
+		free(job.length);
+		return false;
+	}
+
+	if (threads == 0) {
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if ((threads < 1) || (threads > FILE_JOB_MAX_THREADS)) {
+		threads = FILE_JOB_MAX_THREADS;
+	}
+	if (threads > count) {
+		threads = count;
+	}
+
+	fflush(stdout);
+	pthread_mutex_init(&job.lock, NULL);
+	for (started = 0; started < threads; started++) {
+		if (pthread_create(&thread[started], NULL, file_job_thread, &job)) {
+			break;
+		}
+	}
+	if ((started == 0) && count) {
+		file_job_thread(&job);
+	}
+	for (uint32_t i = 0; i < started; i++) {
+		pthread_join(thread[i], NULL);
+	}
+	pthread_mutex_destroy(&job.lock);
+	fflush(stdout);
+
+	free(job.output);
+	free(job.length);
+	return job.failed == 0;
+}
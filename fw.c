@@ -1,4 +1,6 @@
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "usbfw.h"
 
@@ -27,44 +29,137 @@ bool init_act(USB_BULK_CONTEXT *uctx) {
 	return true;
 }
 
-uint32_t search_alternate_fw(USB_BULK_CONTEXT *uctx, uint8_t lun, uint32_t max_lba) {
-	FW_HEADER fw_header;
-	CBW cbw;
+// check whether sector at lba starts firmware header
+static bool is_fw_header_at(SESSION_CONTEXT *session, uint8_t lun, uint32_t lba) {
+	uint8_t buf[SECTOR_SIZE];
+	uint32_t magic;
+
+	if (!read_area(session, AREA_FW_LOG, lun, lba, 1, buf)) {
+		return false;
+	}
+
+	memcpy(&magic, buf, sizeof(magic));
+	return magic == FW_HEADER_MAGIC;
+}
+
+// Alternate firmware usually starts just after main one, aligned to some
+// power of two. Return such candidates in ascending order.
+static uint32_t alt_fw_candidates(uint32_t main_size, uint32_t max_lba, uint32_t *candidates) {
+	uint32_t count = 0;
+
+	for (uint32_t align = ALT_FW_MIN_ALIGN; align <= ALT_FW_MAX_ALIGN; align <<= 1) {
+		uint32_t lba = (main_size + align - 1) & ~(align - 1);
 
-	printf("Searching for alternate header...      ");
-	for (uint32_t i = 8; i < max_lba; i++) {
-		command_init_act_readone(&cbw, lun, i, true);
-		if (command_perform_act_readone(&cbw, uctx, (uint8_t *)&fw_header)) {
+		if ((lba < 8) || (lba >= max_lba)) {
+			continue;
+		}
+		if (count && (candidates[count - 1] == lba)) {
+			continue;
+		}
+		candidates[count++] = lba;
+	}
+
+	return count;
+}
+
+uint32_t search_alternate_fw(SESSION_CONTEXT *session, uint8_t lun, uint32_t max_lba) {
+	uint32_t candidates[ALT_FW_MAX_CANDIDATES];
+	char item[CACHE_MAX_NAME];
+	uint32_t lba = 0;
+	uint8_t *buf;
+
+	if (session->is_alt && (session->alt_lun == lun) && (session->alt_lba < max_lba)) {
+		return session->alt_lba;
+	}
+
+	printf("Searching for alternate header... ");
+
+	// main firmware gives size to probe after
+	FW_HEADER *main_header = session_get_header(session, lun, 0);
+	if (!main_header) {
+		printf("\nError: Searching alternate header failed at main header.\n");
+		return 0xFFFFFFFF;
+	}
+
+	snprintf(item, sizeof(item), "altfw-%u", lun);
+	if (cache_load(session, item, &lba, sizeof(lba))) {
+		if ((lba >= 8) && (lba < max_lba) && is_fw_header_at(session, lun, lba)) {
+			goto found;
+		}
+	}
+
+	uint32_t count = alt_fw_candidates(get_fw_size(main_header), max_lba, candidates);
+	for (uint32_t i = 0; i < count; i++) {
+		if (is_fw_header_at(session, lun, candidates[i])) {
+			lba = candidates[i];
+			goto found;
+		}
+	}
+
+	// no luck, scan whole area after main header in long reads
+	if (max_lba <= 8) {
+		printf("not found.\n\n");
+		return 0;
+	}
+	// library callers fill session themselves, 0 would never advance
+	uint32_t step = session->max_transfer ? session->max_transfer : 1;
+	buf = malloc((size_t)step * SECTOR_SIZE);
+	if (!buf) {
+		printf("\nError: Out of memory.\n");
+		return 0xFFFFFFFF;
+	}
+
+	progress_start(&session->progress, session->progress_mode, "search", max_lba - 8, SECTOR_SIZE);
+	for (uint32_t i = 8, len; i < max_lba; i += len) {
+		len = ((max_lba - i) < step) ? (max_lba - i) : step;
+
+		if (!read_area(session, AREA_FW_LOG, lun, i, len, buf)) {
+			progress_stop(&session->progress);
 			printf("\nError: Searching alternate header failed at sector %i\n", i);
+			free(buf);
 			return 0xFFFFFFFF;
 		}
-		// header found
-		if (fw_header.magic == 0x0FF0AA55) {
-			printf("\b\b\b\b\bfound at sector 0x%08X\n\n", i);
-			return i;
-		}
 
-		if ((i & 0xF) == 0) {
-			display_percent_spinner(i, max_lba);
+		for (uint32_t j = 0; j < len; j++) {
+			uint32_t magic;
+			memcpy(&magic, buf + (j * SECTOR_SIZE), sizeof(magic));
+			if (magic == FW_HEADER_MAGIC) {
+				lba = i + j;
+				free(buf);
+				goto found;
+			}
 		}
+
+		progress_add(&session->progress, len);
 	}
 
-	printf("\b\b\b\b\bnot found.\n\n");
+	free(buf);
+	progress_stop(&session->progress);
+	printf("not found.\n\n");
 	return 0;
+
+found:
+	progress_stop(&session->progress);
+	printf("found at sector 0x%08X\n\n", lba);
+	session->is_alt = true;
+	session->alt_lun = lun;
+	session->alt_lba = lba;
+	cache_store(session, item, &lba, sizeof(lba));
+	return lba;
 }
 
 bool get_fw_header(USB_BULK_CONTEXT *uctx, FW_HEADER *fw_header, uint8_t lun, uint32_t start_lba) {
 	CBW cbw;
 
 	for (uint32_t i = 0; i < 16; i++) {
-		command_init_act_readone(&cbw, app.lun, start_lba + i, true);
+		command_init_act_readone(&cbw, lun, start_lba + i, true);
 		if (command_perform_act_readone(&cbw, uctx, ((uint8_t *)fw_header) + (i * SECTOR_SIZE))) {
 			printf("Error: Reading header failed at sector %i\n", i);
 			return false;
 		}
 	}
 
-	if (fw_header->magic != 0x0FF0AA55) {
+	if (fw_header->magic != FW_HEADER_MAGIC) {
 		printf("Error: Readed data is isn't proper actions firmware header.\n");
 		return false;
 	}
@@ -72,18 +167,13 @@ bool get_fw_header(USB_BULK_CONTEXT *uctx, FW_HEADER *fw_header, uint8_t lun, ui
 	return true;
 }
 
-uint32_t get_fw_size(USB_BULK_CONTEXT *uctx, uint8_t lun, uint32_t start_lba) {
-	FW_HEADER fw_header;
+uint32_t get_fw_size(FW_HEADER *fw_header) {
 	uint32_t file_start = 0;
 	uint32_t file_len = 0;
 
-	if (!get_fw_header(uctx, &fw_header, app.lun, start_lba)) {
-		return 0;
-	}
-
 	// find position of last file in firmware ...
 	for (uint32_t i = 0; i < 240; i++) {
-		FW_DIR_ENTRY *entry = &fw_header.diritem[i];
+		FW_DIR_ENTRY *entry = &fw_header->diritem[i];
 		if (entry->filename[0] != 0) {
 			if (entry->offset > file_start) {
 				file_start = entry->offset;
@@ -96,6 +186,288 @@ uint32_t get_fw_size(USB_BULK_CONTEXT *uctx, uint8_t lun, uint32_t start_lba) {
 	return file_start + ((file_len + SECTOR_SIZE - 1) / SECTOR_SIZE);
 }
 
+// Find main firmware image in RAW or AFI dump and load its header. In AFI
+// image is 'I' type entry, RAW is image itself.
+bool load_fw_image_header(int fd, off_t *base, FW_HEADER *fw_header) {
+	FW_AFI_HEADER afi;
+
+	*base = 0;
+	if (pread(fd, &afi, sizeof(FW_AFI_HEADER), 0) != sizeof(FW_AFI_HEADER)) {
+		return false;
+	}
+
+	if (memcmp(afi.magic, "AFI", 3) == 0) {
+		uint32_t i;
+		for (i = 0; i < 126; i++) {
+			if ((afi.diritem[i].filename[0] != 0) && (afi.diritem[i].type == 'I')) {
+				*base = afi.diritem[i].offset;
+				break;
+			}
+		}
+		if (i == 126) {
+			return false;
+		}
+	}
+
+	if (pread(fd, fw_header, sizeof(FW_HEADER), *base) != sizeof(FW_HEADER)) {
+		return false;
+	}
+
+	return fw_header->magic == FW_HEADER_MAGIC;
+}
+
+static void fw_image_file(FW_IMAGE_FILE *file, char filename[11], uint8_t *data, size_t size, uint64_t offset, uint32_t length) {
+	char *name = make_filename(filename);
+	int32_t i;
+
+	for (i = strlen(name) - 1; (i >= 0) && ((name[i] == ' ') || (name[i] == '.')); i--) {
+		name[i] = 0;
+	}
+	strcpy(file->name, name);
+
+	if (offset > size) {
+		offset = size;
+	}
+	file->data = data + offset;
+	file->is_truncated = (offset + length > size);
+	file->length = file->is_truncated ? (size - offset) : length;
+}
+
+static int32_t fw_image_dir_files(uint8_t *data, size_t size, uint64_t base, FW_IMAGE_FILE *files, int32_t count) {
+	FW_HEADER *fw_header = (FW_HEADER *)(data + base);
+
+	if ((base + sizeof(FW_HEADER) > size) || (fw_header->magic != FW_HEADER_MAGIC)) {
+		return count;
+	}
+	for (uint32_t i = 0; i < 240; i++) {
+		if (fw_header->diritem[i].filename[0] != 0) {
+			FW_DIR_ENTRY *entry = &fw_header->diritem[i];
+			fw_image_file(&files[count++], entry->filename, data, size, base + ((uint64_t)entry->offset * SECTOR_SIZE), entry->length);
+		}
+	}
+	return count;
+}
+
+// Directory files of RAW or AFI image mapped at 'data', found in place. AFI
+// entries are listed followed by directory files of main firmware image in
+// 'I' entry. Returns count of files or -1 when data isn't such image.
+int32_t fw_image_files(uint8_t *data, size_t size, FW_IMAGE_FILE *files) {
+	int32_t count = 0;
+
+	if ((size >= sizeof(FW_AFI_HEADER)) && (memcmp(data, "AFI", 3) == 0)) {
+		FW_AFI_HEADER *afi = (FW_AFI_HEADER *)data;
+		int64_t image = -1;
+
+		for (uint32_t i = 0; i < 126; i++) {
+			if (afi->diritem[i].filename[0] != 0) {
+				fw_image_file(&files[count++], afi->diritem[i].filename, data, size, afi->diritem[i].offset, afi->diritem[i].length);
+				if ((afi->diritem[i].type == 'I') && (image < 0)) {
+					image = afi->diritem[i].offset;
+				}
+			}
+		}
+		return (image < 0) ? count : fw_image_dir_files(data, size, image, files, count);
+	}
+
+	if ((size >= sizeof(FW_HEADER)) && (((FW_HEADER *)data)->magic == FW_HEADER_MAGIC)) {
+		return fw_image_dir_files(data, size, 0, files, 0);
+	}
+	return -1;
+}
+
+// Structure checks return NULL for proper structure, reason otherwise.
+
+char * check_fw_header(FW_HEADER *fw_header) {
+	if (fw_header->magic != FW_HEADER_MAGIC) {
+		return "bad magic";
+	}
+	if (checksum16(fw_header, 510) != fw_header->headerChecksum) {
+		return "bad header checksum";
+	}
+	if (checksum32(fw_header->diritem, sizeof(FW_DIR_ENTRY) * 240) != fw_header->dirCheckSum) {
+		return "bad directory checksum";
+	}
+	return NULL;
+}
+
+char * check_afi_header(FW_AFI_HEADER *afi) {
+	if (memcmp(afi->magic, "AFI", 3)) {
+		return "bad magic";
+	}
+	if (checksum32(afi, sizeof(FW_AFI_HEADER) - sizeof(uint32_t)) != afi->checksum) {
+		return "bad header checksum";
+	}
+	return NULL;
+}
+
+// bootrecord checksum algorithm is unknown, type has to be printable as it
+// names BREC????.BIN file
+char * check_brec(FW_BREC *brec) {
+	if (memcmp(brec->magic, "BREC", 4)) {
+		return "bad magic";
+	}
+	for (uint32_t i = 0; i < 4; i++) {
+		if ((brec->type[i] < 0x20) || (brec->type[i] > 0x7E)) {
+			return "bad type";
+		}
+	}
+	return NULL;
+}
+
+// concatenated sysinfo magic and hwscan frame type
+char * check_sysinfo(FW_SYSINFO *sysinfo) {
+	if (memcmp(sysinfo, "SYS INFOHW", 10)) {
+		return "bad magic";
+	}
+	return NULL;
+}
+
+// Copy header from application data (zero padded when data is short) and
+// check it.
+char * check_ap_header(uint8_t *data, size_t size, AP_FULLHEAD *ap_header) {
+	memset(ap_header, 0, sizeof(AP_FULLHEAD));
+	memcpy(ap_header, data, (size < sizeof(AP_FULLHEAD)) ? size : sizeof(AP_FULLHEAD));
+
+	if (size < sizeof(AP_HEAD)) {
+		return "short file";
+	}
+	if ((ap_header->head.file_type != 'P') || memcmp(ap_header->head.magic, AP_MAGIC, 4)) {
+		return "bad magic";
+	}
+	if (((uint64_t)ap_header->head.text_offset + ap_header->head.text_length > size) ||
+	    ((uint64_t)ap_header->head.data_offset + ap_header->head.data_length > size)) {
+		return "segment outside file";
+	}
+	for (uint32_t i = 0; i < 252; i++) {
+		if (ap_header->bank[i].offset && ((uint64_t)ap_header->bank[i].offset + ap_header->bank[i].length > size)) {
+			return "bank outside file";
+		}
+	}
+	return NULL;
+}
+
+// Ranges to read for firmware image of 'size' sectors. Whole image is single
+// range, with is_files_only only header and directory files are read (each
+// range data points to its entry) and gaps between them are left out.
+READ_RANGE * get_fw_extents(FW_HEADER *fw_header, uint32_t first_sector, uint32_t size, bool is_files_only, uint32_t *count) {
+	READ_RANGE *ranges = malloc(241 * sizeof(READ_RANGE));
+	uint32_t header_size = sizeof(FW_HEADER) / SECTOR_SIZE;
+
+	*count = 0;
+	if (!ranges) {
+		printf("Error: Out of memory.\n");
+		return NULL;
+	}
+
+	ranges[(*count)++] = (READ_RANGE){
+		.lba = first_sector,
+		.count = (is_files_only && (size > header_size)) ? header_size : size,
+		.filename = NULL,
+		.fd = -1,
+		.offset = 0,
+		.data = NULL
+	};
+
+	for (uint32_t i = 0; is_files_only && (i < 240); i++) {
+		FW_DIR_ENTRY *entry = &fw_header->diritem[i];
+		uint32_t length = (entry->length + SECTOR_SIZE - 1) / SECTOR_SIZE;
+
+		if ((entry->filename[0] == 0) || (length == 0) || (entry->offset >= size)) {
+			continue;
+		}
+		if (entry->offset + length > size) {
+			length = size - entry->offset;
+		}
+
+		ranges[(*count)++] = (READ_RANGE){
+			.lba = first_sector + entry->offset,
+			.count = length,
+			.filename = NULL,
+			.fd = -1,
+			.offset = 0,
+			.data = entry
+		};
+	}
+
+	return ranges;
+}
+
+void fw_verify_init(FW_VERIFY *verify, FW_HEADER *fw_header, uint32_t first_sector, PROGRESS *progress) {
+	memset(verify, 0, sizeof(FW_VERIFY));
+	for (uint32_t i = 0; i < 240; i++) {
+		checksum32_init(&verify->checksum[i]);
+	}
+	verify->header = fw_header;
+	verify->first_sector = first_sector;
+	verify->progress = progress;
+}
+
+// Read callback adding request data to checksums of every file it overlaps.
+// File checksum covers its length rounded up to 4 bytes, sectors are 4 byte
+// aligned, so parts can be summed in any order.
+bool fw_verify_request(READ_REQUEST *req, uint8_t *buf, void *data) {
+	FW_VERIFY *verify = data;
+	uint64_t req_start = (uint64_t)(req->lba - verify->first_sector) * SECTOR_SIZE;
+	uint64_t req_end = req_start + (uint64_t)req->count * SECTOR_SIZE;
+
+	for (uint32_t i = 0; i < 240; i++) {
+		FW_DIR_ENTRY *entry = &verify->header->diritem[i];
+		if (entry->filename[0] == 0) {
+			continue;
+		}
+
+		uint64_t start = (uint64_t)entry->offset * SECTOR_SIZE;
+		uint64_t end = start + ((entry->length + 3) & ~3);
+		uint64_t from = (start > req_start) ? start : req_start;
+		uint64_t to = (end < req_end) ? end : req_end;
+		if (from >= to) {
+			continue;
+		}
+
+		checksum32_update(&verify->checksum[i], buf + (from - req_start), to - from);
+		verify->seen[i] += to - from;
+
+		// whole file summed, mismatch is counted as soon as it is known
+		if ((verify->seen[i] == end - start) && (checksum32_final(&verify->checksum[i]) != entry->checksum) && verify->progress) {
+			progress_error(verify->progress);
+		}
+	}
+
+	return true;
+}
+
+// print pass/fail of every directory file, files not streamed (copied from
+// previous dump or out of image) are only listed
+bool fw_verify_report(FW_VERIFY *verify) {
+	uint32_t passed = 0;
+	uint32_t failed = 0;
+
+	printf("    Filename:       Length:       Checksum:\n\n");
+	for (uint32_t i = 0; i < 240; i++) {
+		FW_DIR_ENTRY *entry = &verify->header->diritem[i];
+		char *status;
+
+		if (entry->filename[0] == 0) {
+			continue;
+		}
+
+		if (verify->seen[i] != ((entry->length + 3) & ~3)) {
+			status = "Not read";
+		} else if (checksum32_final(&verify->checksum[i]) == entry->checksum) {
+			status = "OK";
+			passed++;
+		} else {
+			status = COLOR_RED"Error"COLOR_DEFAULT;
+			failed++;
+		}
+
+		printf("    %s    0x%08X    %s\n", make_filename(entry->filename), entry->length, status);
+	}
+	printf("\n%u file(s) verified, %u failed.\n\n", passed + failed, failed);
+
+	return failed == 0;
+}
+
 bool test_ram_access(USB_BULK_CONTEXT *uctx) {
 	CBW cbw;
 	uint8_t buf[SYSINFO_SIZE];
@@ -118,22 +490,23 @@ bool test_ram_access(USB_BULK_CONTEXT *uctx) {
 bool get_fw_sysinfo(USB_BULK_CONTEXT *uctx, FW_SYSINFO *sysinfo) {
 	CBW cbw;
 
-	for (uint32_t i = 0; i < 16; i++) {
-		// Sysinfo is probably at sector 4. Set this on in case whole RAM is available to read
+	// Sysinfo is probably at sector 4. Set this on in case whole RAM is available to read.
+	// Device not always returns it at first read, so retry until it is there.
+	for (uint32_t i = 0; i < SYSINFO_RETRIES; i++) {
 		command_init_act_read_ram(&cbw, 4, SYSINFO_SIZE);
 		if (command_perform_act_read_ram(&cbw, uctx, (uint8_t *)sysinfo)) {
 			printf("Error: Reading sysinfo\n");
 			return false;
 		}
-	}
 
-	// check for concatenated sysinfo magic and hwscan frame type
-	if (memcmp(sysinfo, "SYS INFOHW", 10) != 0) {
-		printf("Error: Readed data is isn't proper actions sysinfo.\n");
-		return false;
+		// check for concatenated sysinfo magic and hwscan frame type
+		if (memcmp(sysinfo, "SYS INFOHW", 10) == 0) {
+			return true;
+		}
 	}
 
-	return true;
+	printf("Error: Readed data is isn't proper actions sysinfo.\n");
+	return false;
 }
 
 void detach_device(USB_BULK_CONTEXT *uctx, bool detach) {
@@ -0,0 +1,47 @@
+#include <string.h>
+
+#include "usbfw.h"
+
+// read 'count' sectors from selected device area into buf, using transfers
+// not longer than session max_transfer sectors
+bool read_area(SESSION_CONTEXT *session, DEVICE_AREA area, uint8_t lun, uint32_t lba, uint32_t count, uint8_t *buf) {
+	uint32_t max_transfer = session->max_transfer ? session->max_transfer : 1;
+	CBW cbw;
+	int err;
+
+	// RAM command can't transfer more than one sector
+	if ((area == AREA_RAM) || (max_transfer > MAX_TRANSFER_LIMIT)) {
+		max_transfer = (area == AREA_RAM) ? 1 : MAX_TRANSFER_LIMIT;
+	}
+
+	for (uint32_t i = 0; i < count; i += max_transfer) {
+		uint32_t len = ((count - i) < max_transfer) ? (count - i) : max_transfer;
+		uint8_t *ptr = buf + (i * SECTOR_SIZE);
+
+		switch (area) {
+			case AREA_LUN:
+				command_init_read10(&cbw, lun, lba + i, len, SECTOR_SIZE);
+				err = command_perform_read10(&cbw, &session->uctx, ptr);
+				break;
+			case AREA_FW_LOG:
+			case AREA_FW_PHY:
+				command_init_act_read(&cbw, lun, lba + i, len, area == AREA_FW_LOG);
+				err = command_perform_act_read(&cbw, &session->uctx, ptr);
+				break;
+			case AREA_RAM:
+				command_init_act_read_ram(&cbw, lba + i, SECTOR_SIZE);
+				err = command_perform_act_read_ram(&cbw, &session->uctx, ptr);
+				break;
+			default:
+				dbg_printf("Unknown device area %u\n", area);
+				return false;
+		}
+
+		if (err) {
+			dbg_printf("Reading area %u failed at sector %u\n", area, lba + i);
+			return false;
+		}
+	}
+
+	return true;
+}
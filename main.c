@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
@@ -5,6 +7,9 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <stddef.h>
+#include <fnmatch.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 
 #include "usbfw.h"
 
@@ -25,13 +30,33 @@ APP_CONTEXT app = {	.cmd		= APPCMD_NONE,
 			.is_detach	= false,
 			.is_alt_fw	= false,
 			.is_yesiknow	= false,
-			.entry_param	= 0
+			.entry_param	= 0,
+			.socket_path	= NULL,
+			.batch_filename	= NULL,
+			.range_filename	= NULL,
+			.max_transfer	= MAX_TRANSFER_SECTORS,
+			.merge_gap	= DEFAULT_MERGE_GAP,
+			.is_cache	= true,
+			.extract_pattern	= NULL,
+			.is_skip_gaps	= false,
+			.base_filename	= NULL,
+			.is_skip_erased	= false,
+			.erase_block	= DEFAULT_ERASE_BLOCK,
+			.verify_erased	= 0,
+			.watch_regions	= NULL,
+			.interval	= 0,
+			.samples	= 0,
+			.watch_log	= NULL,
+			.is_snapshot	= false,
+			.store_dirname	= NULL,
+			.progress_mode	= PROGRESS_TEXT
 };
 
-USB_BULK_CONTEXT uctx;
+SESSION_CONTEXT session;
 CBW cbw;
 
 bool enumerate_devices(void) {
+	USB_BULK_CONTEXT uctx;
 	libusb_device **list;
 	enum libusb_error usb_error;
 	ssize_t cnt;
@@ -86,7 +111,7 @@ bool enumerate_devices(void) {
 }
 
 bool scsi_inquiry(void) {
-	if (!open_and_claim(&uctx, app.vid, app.pid)) {
+	if (!session_open(&session, app.vid, app.pid)) {
 		return false;
 	}
 
@@ -96,7 +121,7 @@ bool scsi_inquiry(void) {
 
 	SCSI_INQUIRY inquiry;
 	command_init_inquiry(&cbw, app.lun);
-	if (command_perform_inquiry(&cbw, &uctx, &inquiry)) {
+	if (command_perform_inquiry(&cbw, &session.uctx, &inquiry)) {
 		printf("Error: Inquiry command fail.\n");
 		return false;
 	}
@@ -117,7 +142,7 @@ bool scsi_inquiry(void) {
 }
 
 bool scsi_read_fcapacity(void) {
-	if (!open_and_claim(&uctx, app.vid, app.pid)) {
+	if (!session_open(&session, app.vid, app.pid)) {
 		return false;
 	}
 
@@ -127,7 +152,7 @@ bool scsi_read_fcapacity(void) {
 
 	SCSI_FORMAT_CAPACITY fcapacity;
 	command_init_read_fcapacity(&cbw, app.lun);
-	if (command_perform_read_fcapacity(&cbw, &uctx, &fcapacity)) {
+	if (command_perform_read_fcapacity(&cbw, &session.uctx, &fcapacity)) {
 		printf("Error: Format capacity command fail.\n");
 		return false;
 	}
@@ -152,7 +177,7 @@ bool scsi_read_fcapacity(void) {
 }
 
 bool scsi_read_capacity(void) {
-	if (!open_and_claim(&uctx, app.vid, app.pid)) {
+	if (!session_open(&session, app.vid, app.pid)) {
 		return false;
 	}
 
@@ -160,114 +185,118 @@ bool scsi_read_capacity(void) {
 
 	printf("\nSending SCSI READ CAPACITY command to the device %04X:%04X LUN:%i\n\n", app.vid, app.pid, app.lun);
 
-	SCSI_CAPACITY capacity;
-	command_init_read_capacity(&cbw, app.lun);
-	if (command_perform_read_capacity(&cbw, &uctx, &capacity)) {
+	SCSI_CAPACITY *capacity = session_get_capacity(&session, app.lun);
+	if (!capacity) {
 		printf("Error: Read capacity command fail.\n");
 		return false;
 	}
 
-	printf("Reported capacity is %u blocks of size %u bytes (%s).\n\n", capacity.lastLBA, capacity.blockSize, humanize_size((uint64_t)capacity.lastLBA * (uint64_t)capacity.blockSize));
+	printf("Reported capacity is %u blocks of size %u bytes (%s).\n\n", capacity->lastLBA, capacity->blockSize, humanize_size((uint64_t)capacity->lastLBA * (uint64_t)capacity->blockSize));
 
 	return true;
 }
 
+// ranges to read - either from range list or single one from command line
+READ_RANGE * get_read_ranges(uint32_t *count) {
+	if (app.range_filename) {
+		return load_range_list(app.range_filename, app.ofilename, count);
+	}
+
+	if (app.bc == 0) {
+		printf("Error: Block count should be greater than 0.\n");
+		return NULL;
+	}
+
+	*count = 1;
+	return make_range(app.lba, app.bc, app.ofilename);
+}
+
 bool scsi_read10(void) {
 	bool retval = false;
+	READ_RANGE *ranges = NULL;
+	uint32_t count = 0;
 
-	if (!open_and_claim(&uctx, app.vid, app.pid)) {
+	if (!session_open(&session, app.vid, app.pid)) {
 		return false;
 	}
 
 	// We inted to use standard SCSI command, so there is no need to check for actions device
 
 	// read capacity first to know drive geometry and sector size
-	SCSI_CAPACITY capacity;
-	command_init_read_capacity(&cbw, app.lun);
-	if (command_perform_read_capacity(&cbw, &uctx, &capacity)) {
+	SCSI_CAPACITY *capacity = session_get_capacity(&session, app.lun);
+	if (!capacity) {
 		printf("Error: Read capacity command fail.\n");
 		return false;
 	}
 
-	if (capacity.blockSize > SECTOR_SIZE) {
-		printf("Error: Sector size %u grater than max supported %u.\n", capacity.blockSize, SECTOR_SIZE);
+	if (capacity->blockSize != SECTOR_SIZE) {
+		printf("Error: Sector size %u other than supported %u.\n", capacity->blockSize, SECTOR_SIZE);
 		return false;
 	}
 
-	if (app.lba >= capacity.lastLBA) {
-		printf("Error: LBA should be less than (%u) 0x%08X.\n", capacity.lastLBA, capacity.lastLBA);
+	ranges = get_read_ranges(&count);
+	if (!ranges) {
 		return false;
 	}
 
-	if (app.lba + app.bc > capacity.lastLBA) {
-		printf("Error: LBA + block count should be less or equal (%u) 0x%08X.\n", capacity.lastLBA, capacity.lastLBA);
-		return false;
+	for (uint32_t i = 0; i < count; i++) {
+		if (ranges[i].lba >= capacity->lastLBA) {
+			printf("Error: LBA should be less than (%u) 0x%08X.\n", capacity->lastLBA, capacity->lastLBA);
+			goto exit;
+		}
+
+		if ((uint64_t)ranges[i].lba + ranges[i].count > capacity->lastLBA) {
+			printf("Error: LBA + block count should be less or equal (%u) 0x%08X.\n", capacity->lastLBA, capacity->lastLBA);
+			goto exit;
+		}
 	}
 
-	printf("\nReading from mass storage SCSI device %04X:%04X LUN:%i to file \"%s\",\n", app.vid, app.pid, app.lun, app.ofilename);
-	printf("starting at sector 0x%08X and ending at sector 0x%08X (0x%08X sectors total).\n\n", app.lba , app.lba + app.bc - 1, app.bc);
+	if (app.range_filename) {
+		printf("\nReading from mass storage SCSI device %04X:%04X LUN:%i ranges listed in \"%s\".\n\n", app.vid, app.pid, app.lun, app.range_filename);
+	} else {
+		printf("\nReading from mass storage SCSI device %04X:%04X LUN:%i to file \"%s\",\n", app.vid, app.pid, app.lun, app.ofilename);
+		printf("starting at sector 0x%08X and ending at sector 0x%08X (0x%08X sectors total).\n\n", app.lba , app.lba + app.bc - 1, app.bc);
+	}
 
-	app.ofile = fopen(app.ofilename, "w");
-	if (!app.ofile) {
-		printf("Error: Cannot open output file \"%s\".", app.ofilename);
-		retval = false;
+	if (!open_ranges(ranges, count)) {
 		goto exit;
 	}
 
-	printf("Reading mass storage ...       ");
-	uint8_t dumpbuffer[SECTOR_SIZE];
-	for (uint32_t i = app.lba; i < app.lba + app.bc; i++) {
-		command_init_read10one(&cbw, app.lun, i, capacity.blockSize);
-		if (command_perform_read10one(&cbw, &uctx, (uint8_t *)&dumpbuffer)) {
-			printf("Error: Reading mass storage failed at sector %i\n", i);
-			retval = false;
-			goto exit;
-		}
-		fwrite(dumpbuffer, SECTOR_SIZE, 1, app.ofile);
-
-		if ((i & 0xF) == 0) {
-			display_percent_spinner(i - app.lba, app.bc);
-		}
-	}
-	printf("\b\b\b\b\bdone.\n\n");
+	retval = read_ranges(&session, AREA_LUN, app.lun, ranges, count, app.merge_gap, NULL, NULL);
 
 exit:
-	if (app.ofile) {
-		fclose(app.ofile);
-		app.ofile = NULL;
-	}
+	free_ranges(ranges, count);
 	return retval;
 }
 
 bool scsi_write10(void) {
 	bool retval = false;
 
-	if (!open_and_claim(&uctx, app.vid, app.pid)) {
+	if (!session_open(&session, app.vid, app.pid)) {
 		return false;
 	}
 
 	// We inted to use standard SCSI command, so there is no need to check for actions device
 
 	// read capacity first to know drive geometry and sector size
-	SCSI_CAPACITY capacity;
-	command_init_read_capacity(&cbw, app.lun);
-	if (command_perform_read_capacity(&cbw, &uctx, &capacity)) {
+	SCSI_CAPACITY *capacity = session_get_capacity(&session, app.lun);
+	if (!capacity) {
 		printf("Error: Read capacity command fail.\n");
 		return false;
 	}
 
-	if (capacity.blockSize > SECTOR_SIZE) {
-		printf("Error: Sector size %u grater than max supported %u.\n", capacity.blockSize, SECTOR_SIZE);
+	if (capacity->blockSize > SECTOR_SIZE) {
+		printf("Error: Sector size %u grater than max supported %u.\n", capacity->blockSize, SECTOR_SIZE);
 		return false;
 	}
 
-	if (app.lba >= capacity.lastLBA) {
-		printf("Error: LBA should be less than (%u) 0x%08X.\n", capacity.lastLBA, capacity.lastLBA);
+	if (app.lba >= capacity->lastLBA) {
+		printf("Error: LBA should be less than (%u) 0x%08X.\n", capacity->lastLBA, capacity->lastLBA);
 		return false;
 	}
 
-	if (app.lba + app.bc > capacity.lastLBA) {
-		printf("Error: LBA + block count should be less or equal (%u) 0x%08X.\n", capacity.lastLBA, capacity.lastLBA);
+	if (app.lba + app.bc > capacity->lastLBA) {
+		printf("Error: LBA + block count should be less or equal (%u) 0x%08X.\n", capacity->lastLBA, capacity->lastLBA);
 		return false;
 	}
 
@@ -288,7 +317,7 @@ bool scsi_write10(void) {
 	}
 	fseek(app.ifile, app.offset, SEEK_SET);
 
-	if ((oflen - app.offset) < (app.bc * capacity.blockSize)) {
+	if ((oflen - app.offset) < (app.bc * capacity->blockSize)) {
 		printf("Error: Not enough data in input file.");
 		retval = false;
 		goto exit;
@@ -297,22 +326,23 @@ bool scsi_write10(void) {
 	printf("\nWriting to mass storage SCSI device %04X:%04X LUN:%i from file \"%s\",\n", app.vid, app.pid, app.lun, app.ofilename);
 	printf("starting at sector 0x%08X and ending at sector 0x%08X (0x%08X sectors total).\n\n", app.lba , app.lba + app.bc - 1, app.bc);
 
-	printf("Writing mass storage ...       ");
+	printf("Writing mass storage ... ");
 	uint8_t inbuffer[SECTOR_SIZE];
+	progress_start(&session.progress, session.progress_mode, "write", app.bc, SECTOR_SIZE);
 	for (uint32_t i = app.lba; i < app.lba + app.bc; i++) {
 		fread(inbuffer, SECTOR_SIZE, 1, app.ifile);
-		command_init_write10one(&cbw, app.lun, i, capacity.blockSize);
-		if (command_perform_write10one(&cbw, &uctx, (uint8_t *)&inbuffer)) {
+		command_init_write10one(&cbw, app.lun, i, capacity->blockSize);
+		if (command_perform_write10one(&cbw, &session.uctx, (uint8_t *)&inbuffer)) {
+			progress_stop(&session.progress);
 			printf("Error: Writing mass storage failed at sector %i\n", i);
 			retval = false;
 			goto exit;
 		}
-
-		if ((i & 0xF) == 0) {
-			display_percent_spinner(i - app.lba, app.bc);
-		}
+		progress_add(&session.progress, 1);
 	}
-	printf("\b\b\b\b\bdone.\n\n");
+	progress_stop(&session.progress);
+	printf("done.\n\n");
+	retval = true;
 
 exit:
 	if (app.ifile) {
@@ -326,11 +356,11 @@ bool action_headinfo(void) {
 	bool retval = false;
 	uint32_t first_sector = 0;
 
-	if (!open_and_claim(&uctx, app.vid, app.pid)) {
+	if (!session_open(&session, app.vid, app.pid)) {
 		return false;
 	}
 
-	if (!init_act(&uctx)) {
+	if (!session_init_act(&session)) {
 		retval = false;
 		goto exit;
 	}
@@ -338,81 +368,81 @@ bool action_headinfo(void) {
 	printf("\nReading ACTIONS firmware header (%s) from device %04X:%04X LUN:%i\n\n", app.is_alt_fw ? "alternate" : "main", app.vid, app.pid, app.lun);
 
 	if (app.is_alt_fw) {
-		first_sector = search_alternate_fw(&uctx, app.lun, MAX_SEARCH_LBA);
+		first_sector = search_alternate_fw(&session, app.lun, MAX_SEARCH_LBA);
 		// exit if error or not found
-		if ((first_sector == 0xFFFFFFFF) || (first_sector == 0xFFFFFFFF)) {
+		if ((first_sector == 0xFFFFFFFF) || (first_sector == 0)) {
 			retval = false;
 			goto exit;
 		}
 	}
 
-	FW_HEADER fw_header;
-	if (!get_fw_header(&uctx, &fw_header, app.lun, first_sector)) {
+	FW_HEADER *fw_header = session_get_header(&session, app.lun, first_sector);
+	if (!fw_header) {
 		retval = false;
 		goto exit;
 	}
 
 	printf("Recieved information:\n\n");
 	printf("               Version : %01hhX.%01hhX.%02hhX.%02hhX%02hhX\n",
-		fw_header.version[0] >> 4,
-		fw_header.version[0] & 0xF,
-		fw_header.version[1],
-		fw_header.version[2],
-		fw_header.version[3]);
+		fw_header->version[0] >> 4,
+		fw_header->version[0] & 0xF,
+		fw_header->version[1],
+		fw_header->version[2],
+		fw_header->version[3]);
 	printf("                  Date : %02hhX%02hhX.%02hhX.%02hhX\n",
-		fw_header.date[0],
-		fw_header.date[1],
-		fw_header.date[2],
-		fw_header.date[3]);
-	printf("             Vendor ID : 0x%04hX\n", fw_header.vendorId);
-	printf("            Product ID : 0x%04hX\n", fw_header.productId);
-	printf("    Directory Checksum : 0x%08X - %s\n", fw_header.dirCheckSum, (checksum32((uint32_t *) fw_header.diritem, sizeof(FW_DIR_ENTRY) * 240, true) == fw_header.dirCheckSum) ? "OK" : "Error");
-	printf("   Firmware Descriptor : %.44s\n", fw_header.fwDescriptor);
-	printf("              Producer : %.32s\n", fw_header.producer);
-	printf("           Device Name : %.32s\n", fw_header.deviceName);
-	printf("         USB Attribute : %.8s\n", fw_header.usbAttri);
-	printf("    USB Identification : %.16s\n", fw_header.usbIdentification);
-	printf("   USB Product Version : %.4s\n", fw_header.usbProductVer);
-	printf("              USB Name : %.46s\n", covert_usb_string_descriptor(fw_header.bString, 46));
-	printf(" MTP Manufacturer Info : %.32s\n", fw_header.mtpManufacturerInfo);
-	printf("      MTP Product Info : %.32s\n", fw_header.mtpProductInfo);
-	printf("   MTP Product Version : %.32s\n", fw_header.mtpProductVersion);
-	printf("        MTP Product SN : %.32s\n", convert_mtp_serial(fw_header.mtpProductSerialNumber));
-	printf("         MTP Vendor ID : 0x%04hX\n", fw_header.mtpVendorId);
-	printf("        MTP Product ID : 0x%04hX\n", fw_header.mtpProductId);
-	printf("       Header Checksum : 0x%04hX - %s\n", fw_header.headerChecksum, (checksum16((uint16_t *)&fw_header, 510, true) == fw_header.headerChecksum) ? "OK" : "Error");
+		fw_header->date[0],
+		fw_header->date[1],
+		fw_header->date[2],
+		fw_header->date[3]);
+	printf("             Vendor ID : 0x%04hX\n", fw_header->vendorId);
+	printf("            Product ID : 0x%04hX\n", fw_header->productId);
+	printf("    Directory Checksum : 0x%08X - %s\n", fw_header->dirCheckSum, (checksum32(fw_header->diritem, sizeof(FW_DIR_ENTRY) * 240) == fw_header->dirCheckSum) ? "OK" : "Error");
+	printf("   Firmware Descriptor : %.44s\n", fw_header->fwDescriptor);
+	printf("              Producer : %.32s\n", fw_header->producer);
+	printf("           Device Name : %.32s\n", fw_header->deviceName);
+	printf("         USB Attribute : %.8s\n", fw_header->usbAttri);
+	printf("    USB Identification : %.16s\n", fw_header->usbIdentification);
+	printf("   USB Product Version : %.4s\n", fw_header->usbProductVer);
+	printf("              USB Name : %.46s\n", covert_usb_string_descriptor(fw_header->bString, 46));
+	printf(" MTP Manufacturer Info : %.32s\n", fw_header->mtpManufacturerInfo);
+	printf("      MTP Product Info : %.32s\n", fw_header->mtpProductInfo);
+	printf("   MTP Product Version : %.32s\n", fw_header->mtpProductVersion);
+	printf("        MTP Product SN : %.32s\n", convert_mtp_serial(fw_header->mtpProductSerialNumber));
+	printf("         MTP Vendor ID : 0x%04hX\n", fw_header->mtpVendorId);
+	printf("        MTP Product ID : 0x%04hX\n", fw_header->mtpProductId);
+	printf("       Header Checksum : 0x%04hX - %s\n", fw_header->headerChecksum, (checksum16(fw_header, 510) == fw_header->headerChecksum) ? "OK" : "Error");
 	printf("\nCommon Values:\n\n");
-	printf("                 Magic : 0x%04hX - %s\n", fw_header.defaultInf.magic, fw_header.defaultInf.magic == 0xDEAD ? "OK" : "Error");
-	printf(" System Time (in 0.5s) : 0x%08X (%s)\n", fw_header.defaultInf.systemtime,  make_date(fw_header.defaultInf.systemtime));
-	printf("              RTC Rate : 0x%04hX\n", fw_header.defaultInf.RTCRate);
-	printf("      Display Contrast : %hu\n", fw_header.defaultInf.displayContrast);
-	printf("            Light Time : %hu\n", fw_header.defaultInf.lightTime);
-	printf("          Standby Time : 0x%hu\n", fw_header.defaultInf.standbyTime);
-	printf("            Sleep Time : 0x%hu\n", fw_header.defaultInf.sleepTime);
-	printf("           Language ID : %hhu - %s\n", fw_header.defaultInf.langid, decode_langid(fw_header.defaultInf.langid));
-	printf("           Replay Mode : %hu\n", fw_header.defaultInf.replayMode);
-	printf("           Online Mode : %hu\n", fw_header.defaultInf.onlineMode);
-	printf("          Battery Type : %hhu - %s\n", fw_header.defaultInf.batteryType, decode_battery(fw_header.defaultInf.batteryType));
-	printf("           FM Build in : %hhu - %s\n", fw_header.defaultInf.fmBuildIn, fw_header.defaultInf.fmBuildIn ? "YES" : "NO");
-	printf("           Record Type : %hhu - %s\n", fw_header.defaultInf.recordType, decode_record(fw_header.defaultInf.recordType));
-	printf("       Backlight Color : %hhu\n", fw_header.defaultInf.backlightColor);
-	printf("         Online Device : %hhu\n", fw_header.defaultInf.onlineDev);
-	printf("            Light Mode : %hhu - %s\n", fw_header.defaultInf.lightMode, decode_lightmode(fw_header.defaultInf.lightMode));
-	printf("        Card Selection : %hhu - %s\n", fw_header.defaultInf.cardSel, fw_header.defaultInf.cardSel ? "Supported" : "Not Supported");
-	printf("       MTP Format Type : %hhu - %s\n", fw_header.defaultInf.mtpFormatType, decode_mtpformat(fw_header.defaultInf.mtpFormatType));
-	printf("                    FM : %hhu - %s\n", fw_header.defaultInf.fmFlag, fw_header.defaultInf.fmFlag ? "Supported" : "Not Supported");
-	printf("        Ear Protection : %hhu - %s\n", fw_header.defaultInf.earProtectionFlag, fw_header.defaultInf.earProtectionFlag ? "Supported" : "Not Supported");
-	printf(" Ear Protection Thres. : %hhu\n", fw_header.defaultInf.earProtectionThreshold);
-	printf("           Attenuation : %hhu - %s\n", fw_header.defaultInf.attenuationFlag, fw_header.defaultInf.attenuationFlag ? "Supported" : "Not Supported");
-	printf("  Auto Switch Off Time : %hu\n", fw_header.defaultInf.autoSwitchoffTime);
-	printf("              Key Tone : %hhu - %s\n", fw_header.defaultInf.keyTone, fw_header.defaultInf.keyTone ? "YES" : "NO");
+	printf("                 Magic : 0x%04hX - %s\n", fw_header->defaultInf.magic, fw_header->defaultInf.magic == 0xDEAD ? "OK" : "Error");
+	printf(" System Time (in 0.5s) : 0x%08X (%s)\n", fw_header->defaultInf.systemtime,  make_date(fw_header->defaultInf.systemtime));
+	printf("              RTC Rate : 0x%04hX\n", fw_header->defaultInf.RTCRate);
+	printf("      Display Contrast : %hu\n", fw_header->defaultInf.displayContrast);
+	printf("            Light Time : %hu\n", fw_header->defaultInf.lightTime);
+	printf("          Standby Time : 0x%hu\n", fw_header->defaultInf.standbyTime);
+	printf("            Sleep Time : 0x%hu\n", fw_header->defaultInf.sleepTime);
+	printf("           Language ID : %hhu - %s\n", fw_header->defaultInf.langid, decode_langid(fw_header->defaultInf.langid));
+	printf("           Replay Mode : %hu\n", fw_header->defaultInf.replayMode);
+	printf("           Online Mode : %hu\n", fw_header->defaultInf.onlineMode);
+	printf("          Battery Type : %hhu - %s\n", fw_header->defaultInf.batteryType, decode_battery(fw_header->defaultInf.batteryType));
+	printf("           FM Build in : %hhu - %s\n", fw_header->defaultInf.fmBuildIn, fw_header->defaultInf.fmBuildIn ? "YES" : "NO");
+	printf("           Record Type : %hhu - %s\n", fw_header->defaultInf.recordType, decode_record(fw_header->defaultInf.recordType));
+	printf("       Backlight Color : %hhu\n", fw_header->defaultInf.backlightColor);
+	printf("         Online Device : %hhu\n", fw_header->defaultInf.onlineDev);
+	printf("            Light Mode : %hhu - %s\n", fw_header->defaultInf.lightMode, decode_lightmode(fw_header->defaultInf.lightMode));
+	printf("        Card Selection : %hhu - %s\n", fw_header->defaultInf.cardSel, fw_header->defaultInf.cardSel ? "Supported" : "Not Supported");
+	printf("       MTP Format Type : %hhu - %s\n", fw_header->defaultInf.mtpFormatType, decode_mtpformat(fw_header->defaultInf.mtpFormatType));
+	printf("                    FM : %hhu - %s\n", fw_header->defaultInf.fmFlag, fw_header->defaultInf.fmFlag ? "Supported" : "Not Supported");
+	printf("        Ear Protection : %hhu - %s\n", fw_header->defaultInf.earProtectionFlag, fw_header->defaultInf.earProtectionFlag ? "Supported" : "Not Supported");
+	printf(" Ear Protection Thres. : %hhu\n", fw_header->defaultInf.earProtectionThreshold);
+	printf("           Attenuation : %hhu - %s\n", fw_header->defaultInf.attenuationFlag, fw_header->defaultInf.attenuationFlag ? "Supported" : "Not Supported");
+	printf("  Auto Switch Off Time : %hu\n", fw_header->defaultInf.autoSwitchoffTime);
+	printf("              Key Tone : %hhu - %s\n", fw_header->defaultInf.keyTone, fw_header->defaultInf.keyTone ? "YES" : "NO");
 
 	if (app.is_showdir) {
 		printf("\nFiles:\n\n");
 
 		printf("    Filename:       Checksum:    Attributes:  Version:  Offset in sectors:  Length in bytes:\n\n");
 		for (uint32_t i = 0; i < 240; i++) {
-			FW_DIR_ENTRY *entry = &fw_header.diritem[i];
+			FW_DIR_ENTRY *entry = &fw_header->diritem[i];
 			//skip empty entries
 			if (entry->filename[0] != 0) {
 				printf("    %s    0x%08X   0x%02hhX         0x%04hX    0x%08X          0x%08X (%s)\n", 
@@ -431,7 +461,7 @@ bool action_headinfo(void) {
 	retval = true;
 
 exit:
-	detach_device(&uctx, app.is_detach);
+	session_detach(&session, app.is_detach);
 	return retval;
 }
 
@@ -439,57 +469,57 @@ exit:
 bool action_sysinfo(void) {
 	bool retval = false;
 
-	if (!open_and_claim(&uctx, app.vid, app.pid)) {
+	if (!session_open(&session, app.vid, app.pid)) {
 		return false;
 	}
 
-	if (!init_act(&uctx)) {
+	if (!session_init_act(&session)) {
 		retval = false;
 		goto exit;
 	}
 
 	printf("\nReading ACTIONS firmware sysinfo structure from device %04X:%04X\n\n", app.vid, app.pid);
 
-	FW_SYSINFO sysinfo;
-	if (!get_fw_sysinfo(&uctx, &sysinfo)) {
+	FW_SYSINFO *sysinfo = session_get_sysinfo(&session, app.lun);
+	if (!sysinfo) {
 		retval = false;
 		goto exit;
 	}
 
 	printf("Recieved information:\n\n");
-	printf("            IC Version : %04hX\n", sysinfo.hwScan.icVersion);
-	printf("            SubVersion : %c%c\n", sysinfo.hwScan.subversion[0], sysinfo.hwScan.subversion[1]);
+	printf("            IC Version : %04hX\n", sysinfo->hwScan.icVersion);
+	printf("            SubVersion : %c%c\n", sysinfo->hwScan.subversion[0], sysinfo->hwScan.subversion[1]);
 	printf("          BROM Version : %01hhX.%01hhX.%02hhX.%02hhX%02hhX\n",
-		sysinfo.hwScan.bromVersion[0] >> 4,
-		sysinfo.hwScan.bromVersion[0] & 0xF,
-		sysinfo.hwScan.bromVersion[1],
-		sysinfo.hwScan.bromVersion[2],
-		sysinfo.hwScan.bromVersion[3]);
+		sysinfo->hwScan.bromVersion[0] >> 4,
+		sysinfo->hwScan.bromVersion[0] & 0xF,
+		sysinfo->hwScan.bromVersion[1],
+		sysinfo->hwScan.bromVersion[2],
+		sysinfo->hwScan.bromVersion[3]);
 	printf("             BROM Date : %02hhX%02hhX.%02hhX.%02hhX\n",
-		sysinfo.hwScan.bromDate[0],
-		sysinfo.hwScan.bromDate[1],
-		sysinfo.hwScan.bromDate[2],
-		sysinfo.hwScan.bromDate[3]);
-	printf("        Boot Disk Type : %.4s\n", sysinfo.hwScan.bootDiskType);
+		sysinfo->hwScan.bromDate[0],
+		sysinfo->hwScan.bromDate[1],
+		sysinfo->hwScan.bromDate[2],
+		sysinfo->hwScan.bromDate[3]);
+	printf("        Boot Disk Type : %.4s\n", sysinfo->hwScan.bootDiskType);
 	printf("     Storage Conn Info : 0x%04hX 0x%04hX 0x%04hX 0x%04hX\n",
-		sysinfo.hwScan.stgInfo.connInfo[0],
-		sysinfo.hwScan.stgInfo.connInfo[1],
-		sysinfo.hwScan.stgInfo.connInfo[2],
-		sysinfo.hwScan.stgInfo.connInfo[3]);
+		sysinfo->hwScan.stgInfo.connInfo[0],
+		sysinfo->hwScan.stgInfo.connInfo[1],
+		sysinfo->hwScan.stgInfo.connInfo[2],
+		sysinfo->hwScan.stgInfo.connInfo[3]);
 	printf("  Storage Capabilities : 0x%04hX 0x%04hX 0x%04hX 0x%04hX 0x%04hX 0x%04hX 0x%04hX 0x%04hX\n",
-		sysinfo.hwScan.stgInfo.caps[0],
-		sysinfo.hwScan.stgInfo.caps[1],
-		sysinfo.hwScan.stgInfo.caps[2],
-		sysinfo.hwScan.stgInfo.caps[3],
-		sysinfo.hwScan.stgInfo.caps[4],
-		sysinfo.hwScan.stgInfo.caps[5],
-		sysinfo.hwScan.stgInfo.caps[6],
-		sysinfo.hwScan.stgInfo.caps[7]);
-	printf("             Vendor ID : %04hX\n", sysinfo.fwScan.vendorId);
-	printf("            Product ID : %04hX\n", sysinfo.fwScan.productId);
-	printf("      Firmware Version : %04hX\n", sysinfo.fwScan.firmwareVersion);
-	printf("              Producer : %.32s\n", sysinfo.fwScan.producer);
-	printf("           Device Name : %.32s\n", sysinfo.fwScan.deviceName);
+		sysinfo->hwScan.stgInfo.caps[0],
+		sysinfo->hwScan.stgInfo.caps[1],
+		sysinfo->hwScan.stgInfo.caps[2],
+		sysinfo->hwScan.stgInfo.caps[3],
+		sysinfo->hwScan.stgInfo.caps[4],
+		sysinfo->hwScan.stgInfo.caps[5],
+		sysinfo->hwScan.stgInfo.caps[6],
+		sysinfo->hwScan.stgInfo.caps[7]);
+	printf("             Vendor ID : %04hX\n", sysinfo->fwScan.vendorId);
+	printf("            Product ID : %04hX\n", sysinfo->fwScan.productId);
+	printf("      Firmware Version : %04hX\n", sysinfo->fwScan.firmwareVersion);
+	printf("              Producer : %.32s\n", sysinfo->fwScan.producer);
+	printf("           Device Name : %.32s\n", sysinfo->fwScan.deviceName);
 
 
 	printf("\n");
@@ -497,77 +527,232 @@ bool action_sysinfo(void) {
 	retval = true;
 
 exit:
-	detach_device(&uctx, app.is_detach);
+	session_detach(&session, app.is_detach);
 	return retval;
 }
 
 
 bool action_readfw(void) {
 	bool retval = false;
+	READ_RANGE *ranges = NULL;
+	uint32_t count = 0;
 
-	if (!open_and_claim(&uctx, app.vid, app.pid)) {
+	if (!session_open(&session, app.vid, app.pid)) {
 		return false;
 	}
 
-	if (!init_act(&uctx)) {
+	if (!session_init_act(&session)) {
 		retval = false;
 		goto exit;
 	}
 
-	printf("\nReading ACTIONS firmware %s area from device %04X:%04X LUN:%i to file \"%s\",\n", app.is_logical ? "logical" : "physical", app.vid, app.pid, app.lun, app.ofilename);
-	printf("starting at sector 0x%08X and ending at sector 0x%08X (0x%08X sectors total).\n\n", app.lba , app.lba + app.bc - 1, app.bc);
+	if (app.is_skip_erased && app.range_filename) {
+		printf("Error: Erased blocks can't be skipped with range list.\n");
+		retval = false;
+		goto exit;
+	}
 
-	app.ofile = fopen(app.ofilename, "w");
-	if (!app.ofile) {
-		printf("Error: Cannot open output file \"%s\".", app.ofilename);
+	ranges = get_read_ranges(&count);
+	if (!ranges) {
 		retval = false;
 		goto exit;
 	}
 
-	printf("Reading firmware ...      ");
-	uint8_t dumpbuffer[SECTOR_SIZE];
-	for (uint32_t i = app.lba; i < app.lba + app.bc; i++) {
-		command_init_act_readone(&cbw, app.lun, i, app.is_logical);
-		if (command_perform_act_readone(&cbw, &uctx, (uint8_t *)&dumpbuffer)) {
-			printf("Error: Reading firmware failed at sector %i\n", i);
+	if (app.range_filename) {
+		printf("\nReading ACTIONS firmware %s area from device %04X:%04X LUN:%i ranges listed in \"%s\".\n\n", app.is_logical ? "logical" : "physical", app.vid, app.pid, app.lun, app.range_filename);
+	} else {
+		printf("\nReading ACTIONS firmware %s area from device %04X:%04X LUN:%i to file \"%s\",\n", app.is_logical ? "logical" : "physical", app.vid, app.pid, app.lun, app.ofilename);
+		printf("starting at sector 0x%08X and ending at sector 0x%08X (0x%08X sectors total).\n\n", app.lba , app.lba + app.bc - 1, app.bc);
+	}
+
+	if (!open_ranges(ranges, count)) {
+		retval = false;
+		goto exit;
+	}
+
+	if (app.is_skip_erased) {
+		char map_filename[strlen(app.ofilename) + 5];
+		sprintf(map_filename, "%s.map", app.ofilename);
+
+		if (ftruncate(ranges[0].fd, (off_t)app.bc * SECTOR_SIZE)) {
+			printf("Error: Cannot resize output file \"%s\".\n", app.ofilename);
 			retval = false;
 			goto exit;
 		}
-		fwrite(dumpbuffer, SECTOR_SIZE, 1, app.ofile);
+		retval = read_skip_erased(&session, app.is_logical ? AREA_FW_LOG : AREA_FW_PHY, app.lun, app.lba, app.bc, app.erase_block, app.verify_erased, ranges[0].fd, map_filename);
+	} else {
+		retval = read_ranges(&session, app.is_logical ? AREA_FW_LOG : AREA_FW_PHY, app.lun, ranges, count, app.merge_gap, NULL, NULL);
+	}
+
+exit:
+	free_ranges(ranges, count);
+	session_detach(&session, app.is_detach);
+	return retval;
+}
+
+// 8.3 directory name without padding, usable as output file name
+static char * extract_name(FW_DIR_ENTRY *entry) {
+	char *name = make_filename(entry->filename);
 
-		if ((i & 0xF) == 0) {
-			display_percent_spinner(i - app.lba, app.bc);
+	for (int32_t i = strlen(name) - 1; (i >= 0) && ((name[i] == ' ') || (name[i] == '.')); i--) {
+		name[i] = 0;
+	}
+	for (char *c = name; *c; c++) {
+		if (*c == '/') {
+			*c = '_';
 		}
 	}
-	printf("\b\b\b\b\bdone.\n\n");
 
+	return name;
+}
 
-exit:
-	if (app.ofile) {
-		fclose(app.ofile);
-		app.ofile = NULL;
+// checksum covers file length rounded up to 4 bytes, which are still in
+// output as it has whole sectors, so cut it only after
+static bool extract_verify(READ_RANGE *range) {
+	FW_DIR_ENTRY *entry = range->data;
+	uint32_t length = (entry->length + 3) & ~3;
+	bool is_ok = false;
+
+	uint8_t *buf = malloc(length ? length : 1);
+	if (!buf) {
+		printf("Error: Out of memory.\n");
+		return false;
 	}
 
-	detach_device(&uctx, app.is_detach);
+	if (pread(range->fd, buf, length, 0) == length) {
+		is_ok = (checksum32(buf, length) == entry->checksum);
+	}
+	free(buf);
+
+	if (ftruncate(range->fd, entry->length)) {
+		printf("Error: Cannot truncate \"%s\".\n", range->filename);
+		return false;
+	}
+
+	printf("    %-12s    0x%08X    %s\n", range->filename, entry->length, is_ok ? "OK" : COLOR_RED"Checksum error"COLOR_DEFAULT);
+	return is_ok;
+}
+
+bool action_extract(void) {
+	bool retval = false;
+	READ_RANGE *ranges = NULL;
+	uint32_t count = 0;
+	uint32_t first_sector = 0;
+
+	if (!session_open(&session, app.vid, app.pid)) {
+		return false;
+	}
+
+	if (!session_init_act(&session)) {
+		retval = false;
+		goto exit;
+	}
+
+	printf("\nExtracting ACTIONS firmware (%s) files matching \"%s\" from device %04X:%04X LUN:%i.\n\n", app.is_alt_fw ? "alternate" : "main", app.extract_pattern, app.vid, app.pid, app.lun);
+
+	if (app.is_alt_fw) {
+		first_sector = search_alternate_fw(&session, app.lun, MAX_SEARCH_LBA);
+		// exit if error or not found
+		if ((first_sector == 0xFFFFFFFF) || (first_sector == 0)) {
+			retval = false;
+			goto exit;
+		}
+	}
+
+	FW_HEADER *fw_header = session_get_header(&session, app.lun, first_sector);
+	if (!fw_header) {
+		retval = false;
+		goto exit;
+	}
+
+	ranges = malloc(240 * sizeof(READ_RANGE));
+	if (!ranges) {
+		printf("Error: Out of memory.\n");
+		retval = false;
+		goto exit;
+	}
+
+	// one range per matching file, offsets are relative to header
+	for (uint32_t i = 0; i < 240; i++) {
+		FW_DIR_ENTRY *entry = &fw_header->diritem[i];
+		if ((entry->filename[0] == 0) || fnmatch(app.extract_pattern, extract_name(entry), FNM_CASEFOLD)) {
+			continue;
+		}
+
+		READ_RANGE *range = &ranges[count];
+		range->lba = first_sector + entry->offset;
+		range->count = (entry->length + SECTOR_SIZE - 1) / SECTOR_SIZE;
+		range->filename = strdup(extract_name(entry));
+		range->fd = -1;
+		range->offset = 0;
+		range->data = entry;
+		count++;
+
+		if (!range->filename) {
+			printf("Error: Out of memory.\n");
+			retval = false;
+			goto exit;
+		}
+	}
+
+	if (count == 0) {
+		printf("Error: No files match \"%s\".\n", app.extract_pattern);
+		retval = false;
+		goto exit;
+	}
+
+	if (!open_ranges(ranges, count)) {
+		retval = false;
+		goto exit;
+	}
+
+	// empty files need no reading, keep them out of plan
+	uint32_t nonempty = 0;
+	for (uint32_t i = 0; i < count; i++) {
+		if (ranges[i].count) {
+			READ_RANGE tmp = ranges[nonempty];
+			ranges[nonempty++] = ranges[i];
+			ranges[i] = tmp;
+		}
+	}
+
+	if (nonempty && !read_ranges(&session, AREA_FW_LOG, app.lun, ranges, nonempty, app.merge_gap, NULL, NULL)) {
+		retval = false;
+		goto exit;
+	}
+
+	printf("    Filename:       Length:       Checksum:\n\n");
+	retval = true;
+	for (uint32_t i = 0; i < count; i++) {
+		if (!extract_verify(&ranges[i])) {
+			retval = false;
+		}
+	}
+	printf("\n%u file(s) extracted.\n\n", count);
+
+exit:
+	free_ranges(ranges, count);
+	session_detach(&session, app.is_detach);
 	return retval;
 }
 
 bool action_test_ramacc(void) {
 	bool retval = false;
 
-	if (!open_and_claim(&uctx, app.vid, app.pid)) {
+	if (!session_open(&session, app.vid, app.pid)) {
 		return false;
 	}
 
-	if (!init_act(&uctx)) {
+	if (!session_init_act(&session)) {
 		retval = false;
 		goto exit;
 	}
 
-	printf("\nGeneral RAM access is %s.\n\n", test_ram_access(&uctx) ? "possible" : "impossible");
+	printf("\nGeneral RAM access is %s.\n\n", test_ram_access(&session.uctx) ? "possible" : "impossible");
+	retval = true;
 
 exit:
-	detach_device(&uctx, app.is_detach);
+	session_detach(&session, app.is_detach);
 	return retval;
 }
 
@@ -584,11 +769,11 @@ bool action_readram(void) {
 		return false;
 	}
 
-	if (!open_and_claim(&uctx, app.vid, app.pid)) {
+	if (!session_open(&session, app.vid, app.pid)) {
 		return false;
 	}
 
-	if (!init_act(&uctx)) {
+	if (!session_init_act(&session)) {
 		retval = false;
 		goto exit;
 	}
@@ -596,7 +781,7 @@ bool action_readram(void) {
 	printf("\nReading ACTIONS device %04X:%04X RAM to file \"%s\",\n", app.vid, app.pid, app.ofilename);
 	printf("starting at sector 0x%08X and ending at sector 0x%08X (0x%08X sectors total).\n\n", app.lba, app.lba + app.bc - 1, app.bc);
 
-	if (!test_ram_access(&uctx)) {
+	if (!test_ram_access(&session.uctx)) {
 		printf("Warning: Your device probably doesn't support this feature. Expect garbage output.\n\n");
 	}
 
@@ -607,22 +792,42 @@ bool action_readram(void) {
 		goto exit;
 	}
 
-	printf("Reading RAM ...  ");
+	if (app.is_snapshot) {
+		char map_filename[strlen(app.ofilename) + 5];
+		sprintf(map_filename, "%s.map", app.ofilename);
+
+		uint8_t *snapshot = malloc((size_t)app.bc * SECTOR_SIZE);
+		if (!snapshot) {
+			printf("Error: Out of memory.\n");
+			retval = false;
+			goto exit;
+		}
+		retval = ram_snapshot(&session, app.lba, app.bc, snapshot, map_filename);
+		if (retval && (fwrite(snapshot, SECTOR_SIZE, app.bc, app.ofile) != app.bc)) {
+			printf("Error: Cannot write to output file \"%s\".\n", app.ofilename);
+			retval = false;
+		}
+		free(snapshot);
+		goto exit;
+	}
+
+	printf("Reading RAM ... ");
 	uint8_t dumpbuffer[SECTOR_SIZE];
+	progress_start(&session.progress, session.progress_mode, "ram", app.bc, SECTOR_SIZE);
 	for (uint32_t i = app.lba; i < app.lba + app.bc; i++) {
 		command_init_act_read_ram(&cbw, i, SECTOR_SIZE);
-		if (command_perform_act_read_ram(&cbw, &uctx, (uint8_t *)&dumpbuffer)) {
+		if (command_perform_act_read_ram(&cbw, &session.uctx, (uint8_t *)&dumpbuffer)) {
+			progress_stop(&session.progress);
 			printf("Error: Reading RAM failed at sector %i\n", i);
 			retval = false;
 			goto exit;
 		}
 		fwrite(dumpbuffer, SECTOR_SIZE, 1, app.ofile);
-
-		if ((i & 0xF) == 0) {
-			display_spinner();
-		}
+		progress_add(&session.progress, 1);
 	}
-	printf("\bdone.\n\n");
+	progress_stop(&session.progress);
+	printf("done.\n\n");
+	retval = true;
 
 
 exit:
@@ -631,7 +836,269 @@ exit:
 		app.ofile = NULL;
 	}
 
-	detach_device(&uctx, app.is_detach);
+	session_detach(&session, app.is_detach);
+	return retval;
+}
+
+// Image checksum is summed while data passes by. Data read through gaps
+// isn't written out, so only parts of requests inside ranges count, each
+// sector once. Requests come in order and ranges are sorted by then.
+typedef struct {
+	FW_VERIFY			*verify;
+	READ_RANGE			*ranges;
+	uint32_t			count;
+	uint32_t			next;		// first range not summed whole
+	uint64_t			summed;		// sectors below are summed
+	CHECKSUM32			checksum;
+} DUMP_STREAM;
+
+static bool dump_stream_request(READ_REQUEST *req, uint8_t *buf, void *data) {
+	DUMP_STREAM *stream = data;
+	uint64_t req_end = (uint64_t)req->lba + req->count;
+
+	for (uint32_t i = stream->next; i < stream->count; i++) {
+		READ_RANGE *range = &stream->ranges[i];
+		uint64_t end = (uint64_t)range->lba + range->count;
+
+		if (range->lba >= req_end) {
+			break;
+		}
+		if (end <= stream->summed) {
+			if (i == stream->next) {
+				stream->next++;
+			}
+			continue;
+		}
+
+		uint64_t from = (range->lba > stream->summed) ? range->lba : stream->summed;
+		uint64_t to = (end < req_end) ? end : req_end;
+		if (from < req->lba) {
+			from = req->lba;
+		}
+		if (from < to) {
+			checksum32_update(&stream->checksum, buf + (from - req->lba) * SECTOR_SIZE, (to - from) * SECTOR_SIZE);
+			stream->summed = to;
+		}
+	}
+
+	return fw_verify_request(req, buf, stream->verify);
+}
+
+// Copied data of 'range' at 'off' of previous dump goes through the same
+// checks as read one, so corrupt previous dump is caught too.
+static bool dump_stream_copied(int fd, off_t off, READ_RANGE *range, DUMP_STREAM *stream) {
+	uint8_t buf[0x10000];
+	READ_REQUEST req = { .lba = range->lba };
+	uint32_t left = range->count;
+
+	while (left) {
+		req.count = (left < sizeof(buf) / SECTOR_SIZE) ? left : (sizeof(buf) / SECTOR_SIZE);
+		size_t len = (size_t)req.count * SECTOR_SIZE;
+		if (pread(fd, buf, len, off) != (ssize_t)len) {
+			return false;
+		}
+		checksum32_update(&stream->checksum, buf, len);
+		fw_verify_request(&req, buf, stream->verify);
+		off += len;
+		req.lba += req.count;
+		left -= req.count;
+	}
+
+	return true;
+}
+
+// Copy files unchanged since previous dump from it and leave in ranges only
+// those which must be read. Header (without entry) is always read, so are
+// files sharing sectors with other ranges, each sector then comes to stream
+// once. Copied data is added to stream.
+static bool dump_copy_base(READ_RANGE *ranges, uint32_t *count, int fd, off_t base, DUMP_STREAM *stream) {
+	FW_HEADER *old_header;
+	off_t old_base;
+	bool is_shared[*count];
+	uint32_t copied = 0;
+	uint32_t left = 0;
+	bool retval = false;
+
+	for (uint32_t i = 0; i < *count; i++) {
+		is_shared[i] = false;
+		for (uint32_t j = 0; j < *count; j++) {
+			if ((i != j) && (ranges[i].lba < (uint64_t)ranges[j].lba + ranges[j].count) && (ranges[j].lba < (uint64_t)ranges[i].lba + ranges[i].count)) {
+				is_shared[i] = true;
+				break;
+			}
+		}
+	}
+
+	int old_fd = open(app.base_filename, O_RDONLY);
+	if (old_fd < 0) {
+		printf("Error: Cannot open previous dump \"%s\".\n", app.base_filename);
+		return false;
+	}
+
+	old_header = malloc(sizeof(FW_HEADER));
+	if (!old_header) {
+		printf("Error: Out of memory.\n");
+		goto exit;
+	}
+
+	if (!load_fw_image_header(old_fd, &old_base, old_header)) {
+		printf("Error: No firmware image found in \"%s\".\n", app.base_filename);
+		goto exit;
+	}
+
+	for (uint32_t i = 0; i < *count; i++) {
+		FW_DIR_ENTRY *entry = ranges[i].data;
+		FW_DIR_ENTRY *old = NULL;
+
+		for (uint32_t j = 0; entry && !is_shared[i] && (j < 240); j++) {
+			FW_DIR_ENTRY *candidate = &old_header->diritem[j];
+			if ((memcmp(candidate->filename, entry->filename, 11) == 0) && (candidate->length == entry->length) && (candidate->checksum == entry->checksum)) {
+				old = candidate;
+				break;
+			}
+		}
+
+		off_t old_offset = old ? (old_base + (off_t)old->offset * SECTOR_SIZE) : 0;
+		uint64_t len = (uint64_t)ranges[i].count * SECTOR_SIZE;
+		if (old && copy_file_part(old_fd, old_offset, fd, ranges[i].offset, len)) {
+			if (!dump_stream_copied(old_fd, old_offset, &ranges[i], stream)) {
+				printf("Error: Cannot read previous dump \"%s\".\n", app.base_filename);
+				goto exit;
+			}
+			copied++;
+		} else {
+			ranges[left++] = ranges[i];
+		}
+	}
+
+	printf("%u unchanged file(s) copied from \"%s\", %u range(s) left to read.\n", copied, app.base_filename, left);
+	*count = left;
+	retval = true;
+
+exit:
+	free(old_header);
+	close(old_fd);
+	return retval;
+}
+
+// Read main firmware image of 'size' sectors into file at base offset, in
+// long merged reads. With --skip-gaps unused sectors are not read at all and
+// stay zero filled. Optional checksum gets sum of whole image. Mismatching
+// directory files don't stop the dump, image is complete anyway and
+// is_valid only tells whether all of them passed.
+static bool dump_fw_image(FW_HEADER *fw_header, uint32_t first_sector, uint32_t size, FILE *file, off_t base, uint32_t *checksum, bool *is_valid) {
+	READ_RANGE *ranges;
+	uint32_t count;
+	int fd = fileno(file);
+	bool retval;
+
+	ranges = get_fw_extents(fw_header, first_sector, size, app.is_skip_gaps, &count);
+	if (!ranges) {
+		return false;
+	}
+
+	// all ranges share output, placed as on device
+	for (uint32_t i = 0; i < count; i++) {
+		ranges[i].fd = fd;
+		ranges[i].offset = base + (off_t)(ranges[i].lba - first_sector) * SECTOR_SIZE;
+	}
+
+	// stdio buffer must be empty before writing under it
+	fflush(file);
+	if (ftruncate(fd, base + (off_t)size * SECTOR_SIZE)) {
+		printf("Error: Cannot resize output file \"%s\".\n", app.ofilename);
+		free(ranges);
+		return false;
+	}
+
+	// directory files are verified while data passes by
+	DUMP_STREAM stream = { .ranges = ranges, .next = 0, .summed = 0 };
+	stream.verify = malloc(sizeof(FW_VERIFY));
+	if (!stream.verify) {
+		printf("Error: Out of memory.\n");
+		free(ranges);
+		return false;
+	}
+	fw_verify_init(stream.verify, fw_header, first_sector, &session.progress);
+	checksum32_init(&stream.checksum);
+
+	retval = true;
+	if (app.base_filename) {
+		retval = dump_copy_base(ranges, &count, fd, base, &stream);
+	} else if (app.is_skip_gaps) {
+		printf("Reading header and %u directory file(s) only.\n", count - 1);
+	}
+
+	if (retval) {
+		stream.count = count;
+		retval = read_ranges(&session, AREA_FW_LOG, app.lun, ranges, count, app.merge_gap, dump_stream_request, &stream);
+	}
+	free(ranges);
+
+	if (retval) {
+		*is_valid = fw_verify_report(stream.verify);
+	}
+	if (retval && checksum) {
+		*checksum = checksum32_final(&stream.checksum);
+	}
+
+	free(stream.verify);
+	return retval;
+}
+
+// With --store dump is built in memory file, which is put to store when
+// complete, so only chunks not already there are written to disk.
+static int dump_store_fd = -1;
+
+static FILE * dump_open(void) {
+	FILE *file;
+	int fd;
+
+	if (!app.store_dirname) {
+		return fopen(app.ofilename, "w");
+	}
+
+	fd = memfd_create("usbfw-dump", MFD_CLOEXEC);
+	if (fd < 0) {
+		return NULL;
+	}
+	dump_store_fd = dup(fd);
+	file = (dump_store_fd >= 0) ? fdopen(fd, "w+") : NULL;
+	if (!file) {
+		close(fd);
+		if (dump_store_fd >= 0) {
+			close(dump_store_fd);
+		}
+		dump_store_fd = -1;
+	}
+	return file;
+}
+
+// called with dump result after output file is closed
+static bool dump_finish(bool retval) {
+	STORE store;
+	STORE_STATS stats;
+	char *name;
+
+	if (dump_store_fd < 0) {
+		return retval;
+	}
+
+	name = strrchr(app.ofilename, '/');
+	name = name ? (name + 1) : app.ofilename;
+	if (retval && store_open(&store, app.store_dirname)) {
+		retval = store_add(&store, name, dump_store_fd, &stats);
+		store_close(&store);
+		if (retval) {
+			printf("Image stored as \"%s\" in \"%s\", %llu of %llu chunk(s) new, ", name, app.store_dirname, (unsigned long long)stats.added, (unsigned long long)stats.chunks);
+			printf("%s written.\n\n", humanize_size(stats.written));
+		}
+	} else {
+		retval = false;
+	}
+
+	close(dump_store_fd);
+	dump_store_fd = -1;
 	return retval;
 }
 
@@ -639,17 +1106,19 @@ bool action_dumpraw(void) {
 	bool retval = false;
 	uint32_t first_sector = 0;
 	uint32_t size = 0;
+	FW_HEADER *fw_header = NULL;
+	bool is_valid = true;
 
-	if (!open_and_claim(&uctx, app.vid, app.pid)) {
+	if (!session_open(&session, app.vid, app.pid)) {
 		return false;
 	}
 
-	if (!init_act(&uctx)) {
+	if (!session_init_act(&session)) {
 		retval = false;
 		goto exit;
 	}
 
-	app.ofile = fopen(app.ofilename, "w");
+	app.ofile = dump_open();
 	if (!app.ofile) {
 		printf("Error: Cannot open output file \"%s\".", app.ofilename);
 		retval = false;
@@ -662,15 +1131,20 @@ bool action_dumpraw(void) {
 		printf("\nDumping ACTIONS main firmware (%s) from device %04X:%04X LUN:%i to file \"%s\".\n\n", app.is_alt_fw ? "alternate" : "main", app.vid, app.pid, app.lun, app.ofilename);
 
 		if (app.is_alt_fw) {
-			first_sector = search_alternate_fw(&uctx, app.lun, MAX_SEARCH_LBA);
+			first_sector = search_alternate_fw(&session, app.lun, MAX_SEARCH_LBA);
 			// exit if error or not found
-			if ((first_sector == 0xFFFFFFFF) || (first_sector == 0xFFFFFFFF)) {
+			if ((first_sector == 0xFFFFFFFF) || (first_sector == 0)) {
 				retval = false;
 				goto exit;
 			}
 		}
 
-		size = get_fw_size(&uctx, 0, first_sector);
+		fw_header = session_get_header(&session, app.lun, first_sector);
+		if (!fw_header) {
+			retval = false;
+			goto exit;
+		}
+		size = get_fw_size(fw_header);
 
 	} else {
 		//bootrecord firmware
@@ -679,33 +1153,32 @@ bool action_dumpraw(void) {
 		if (app.is_alt_fw) {
 			first_sector = 0x200; // alternate begins at 0x40000
 		}
-		size = 0x20; // botrecord has 0x4000 bytes
-	}
 
-	printf("Reading firmware ...      ");
-	uint8_t dumpbuffer[SECTOR_SIZE];
-	for (uint32_t i = first_sector; i < first_sector + size; i++) {
-		command_init_act_readone(&cbw, app.lun, i, app.is_logical);
-		if (command_perform_act_readone(&cbw, &uctx, (uint8_t *)&dumpbuffer)) {
-			printf("Error: Reading firmware failed at sector %i.\n", i);
+		FW_BREC *fw_brec = session_get_brec(&session, app.lun, first_sector);
+		if (!fw_brec) {
 			retval = false;
 			goto exit;
 		}
-		fwrite(dumpbuffer, SECTOR_SIZE, 1, app.ofile);
-
-		if ((i & 0xF) == 0) {
-			display_percent_spinner(i - first_sector, size);
+		if (fwrite(fw_brec, sizeof(FW_BREC), 1, app.ofile) != 1) {
+			printf("Error: Cannot write to output file \"%s\".\n", app.ofilename);
+			retval = false;
+			goto exit;
 		}
+		printf("Bootrecord firmware written.\n\n");
+		retval = true;
+		goto exit;
 	}
-	printf("\b\b\b\b\bdone.\n\n");
+
+	retval = dump_fw_image(fw_header, first_sector, size, app.ofile, 0, NULL, &is_valid);
 
 exit:
 	if (app.ofile) {
 		fclose(app.ofile);
 		app.ofile = NULL;
 	}
+	retval = dump_finish(retval) && is_valid;
 
-	detach_device(&uctx, app.is_detach);
+	session_detach(&session, app.is_detach);
 	return retval;
 }
 
@@ -713,18 +1186,20 @@ bool action_dumpafi(void) {
 	bool retval = false;
 	uint32_t first_sector = 0;
 	uint32_t size = 0;
+	AFI_CONTEXT afi = { .file = NULL };
+	bool is_valid = true;
 
-	if (!open_and_claim(&uctx, app.vid, app.pid)) {
+	if (!session_open(&session, app.vid, app.pid)) {
 		return false;
 	}
 
-	if (!init_act(&uctx)) {
+	if (!session_init_act(&session)) {
 		retval = false;
 		goto exit;
 	}
 
-	app.ofile = afi_new_file(app.ofilename);
-	if (!app.ofile) {
+	FILE *file = dump_open();
+	if (!file || !afi_new_stream(&afi, file, app.vid, app.pid)) {
 		printf("Error: Cannot open output file \"%s\".", app.ofilename);
 		retval = false;
 		goto exit;
@@ -738,69 +1213,61 @@ bool action_dumpafi(void) {
 	} else {
 		first_sector = 0; // alternate begins at 0x40000
 	}
-	size = 0x20; // botrecord has 0x4000 bytes
 
-	printf("Reading bootrecord firmware ...      ");
-	FW_BREC fw_brec;
-	for (uint32_t i = first_sector; i < first_sector + size; i++) {
-		command_init_act_readone(&cbw, app.lun, i, false);
-		if (command_perform_act_readone(&cbw, &uctx, (uint8_t *)&fw_brec + ((i - first_sector) * SECTOR_SIZE))) {
-			printf("Error: Reading firmware failed at sector %i.\n", i);
-			retval = false;
-			goto exit;
-		}
-
-		if ((i & 0xF) == 0) {
-			display_percent_spinner(i - first_sector, size);
-		}
+	printf("Reading bootrecord firmware ... ");
+	FW_BREC *fw_brec = session_get_brec(&session, app.lun, first_sector);
+	if (!fw_brec) {
+		retval = false;
+		goto exit;
 	}
-	printf("\b\b\b\b\bdone.\n\n");
+	printf("done.\n\n");
 
 	// put bootrecord in afi container as whole file
 	FW_AFI_DIR_ENTRY dir_entry;
 	memset(&dir_entry, 0, sizeof(FW_AFI_DIR_ENTRY));
 	memcpy(dir_entry.filename, "BREC    BIN", 11);
-	memcpy(&dir_entry.filename[4], fw_brec.type, 4);
+	memcpy(&dir_entry.filename[4], fw_brec->type, 4);
 	dir_entry.type = 'B';
 	dir_entry.downloadAddr = AFI_DADDR_B;
 	dir_entry.length = sizeof(FW_BREC);
-	afi_add_whole(app.ofile, &dir_entry, (uint8_t *)&fw_brec);
+	if (!afi_add_whole(&afi, &dir_entry, (uint8_t *)fw_brec)) {
+		printf("Error: Cannot write to output file \"%s\".\n", app.ofilename);
+		retval = false;
+		goto exit;
+	}
 
 	//main firmware
 	if (app.is_alt_fw) {
-		first_sector = search_alternate_fw(&uctx, app.lun, MAX_SEARCH_LBA);
+		first_sector = search_alternate_fw(&session, app.lun, MAX_SEARCH_LBA);
 		// exit if error or not found
-		if ((first_sector == 0xFFFFFFFF) || (first_sector == 0xFFFFFFFF)) {
+		if ((first_sector == 0xFFFFFFFF) || (first_sector == 0)) {
 			retval = false;
 			goto exit;
 		}
 	} else {
 		first_sector = 0;
 	}
-	size = get_fw_size(&uctx, 0, first_sector);
+	FW_HEADER *fw_header = session_get_header(&session, app.lun, first_sector);
+	if (!fw_header) {
+		retval = false;
+		goto exit;
+	}
+	size = get_fw_size(fw_header);
 
 
-	// prepare out file for data
-	fseek(app.ofile, 0, SEEK_END);
+	// main firmware goes right after already written part of container
+	off_t base = afi_append_base(&afi);
 	uint32_t checksum = 0;
+	if (base < 0) {
+		printf("Error: Cannot write to output file \"%s\".\n", app.ofilename);
+		retval = false;
+		goto exit;
+	}
 
-	printf("Reading main firmware ...      ");
-	uint8_t dumpbuffer[SECTOR_SIZE];
-	for (uint32_t i = first_sector; i < first_sector + size; i++) {
-		command_init_act_readone(&cbw, app.lun, i, true);
-		if (command_perform_act_readone(&cbw, &uctx, (uint8_t *)&dumpbuffer)) {
-			printf("Error: Reading firmware failed at sector %i.\n", i);
-			retval = false;
-			goto exit;
-		}
-		fwrite(dumpbuffer, SECTOR_SIZE, 1, app.ofile);
-		checksum += checksum32((uint32_t *)dumpbuffer, SECTOR_SIZE, true);
-
-		if ((i & 0xF) == 0) {
-			display_percent_spinner(i - first_sector, size);
-		}
+	if (!dump_fw_image(fw_header, first_sector, size, afi.file, base, &checksum, &is_valid)) {
+		retval = false;
+		goto exit;
 	}
-	printf("\b\b\b\b\bdone.\n\n");
 
 	// put main firmware in afi container as previusly appended
 	memset(&dir_entry, 0, sizeof(FW_AFI_DIR_ENTRY));
@@ -809,12 +1276,16 @@ bool action_dumpafi(void) {
 	dir_entry.downloadAddr = AFI_DADDR_I;
 	dir_entry.length = size * SECTOR_SIZE;
 	dir_entry.checksum = checksum;
-	afi_add_appended(app.ofile, &dir_entry);
+	if (!afi_add_appended(&afi, &dir_entry)) {
+		printf("Error: Cannot write to output file \"%s\".\n", app.ofilename);
+		retval = false;
+		goto exit;
+	}
 
 	// sysinfo
 
-	FW_SYSINFO sysinfo;
-	if (!get_fw_sysinfo(&uctx, &sysinfo)) {
+	FW_SYSINFO *sysinfo = session_get_sysinfo(&session, app.lun);
+	if (!sysinfo) {
 		retval = false;
 		goto exit;
 	}
@@ -824,28 +1295,47 @@ bool action_dumpafi(void) {
 	memcpy(dir_entry.filename, "SYSINFO BIN", 11);
 	dir_entry.type = ' ';
 	dir_entry.length = sizeof(FW_SYSINFO);
-	afi_add_whole(app.ofile, &dir_entry, (uint8_t *)&sysinfo);
+	if (!afi_add_whole(&afi, &dir_entry, (uint8_t *)sysinfo)) {
+		printf("Error: Cannot write to output file \"%s\".\n", app.ofilename);
+		retval = false;
+		goto exit;
+	}
+
+	// directory is written only now
+	if (!afi_close(&afi)) {
+		printf("Error: Cannot write to output file \"%s\".\n", app.ofilename);
+		retval = false;
+		goto exit;
+	}
 
 	printf("AFI file ready.\n\n");
+	retval = true;
 
 exit:
-	if (app.ofile) {
-		fclose(app.ofile);
-		app.ofile = NULL;
-	}
+	afi_close(&afi);
+	retval = dump_finish(retval) && is_valid;
 
-	detach_device(&uctx, app.is_detach);
+	session_detach(&session, app.is_detach);
 	return retval;
 }
 
+bool confirm(void) {
+	if (!app.is_yesiknow) {
+		printf("You have run "COLOR_RED"DANGEROUS"COLOR_DEFAULT" command!\nYou must confirm you action with adding param \"--yes-i-know-what-im-doing\".\n");
+		return false;
+	}
+
+	return true;
+}
+
 bool action_entry(void) {
 	bool retval = false;
 
-	if (!open_and_claim(&uctx, app.vid, app.pid)) {
+	if (!session_open(&session, app.vid, app.pid)) {
 		return false;
 	}
 
-	if (!init_act(&uctx)) {
+	if (!session_init_act(&session)) {
 		retval = false;
 		goto exit;
 	}
@@ -857,80 +1347,86 @@ bool action_entry(void) {
 	printf("\nRunning ACTIONS firmware entry command with param 0x%04hX to device %04X:%04X\n\n", app.entry_param, app.vid, app.pid);
 
 	command_init_act_entry(&cbw, app.entry_param);
-	if (command_perform_act_entry(&cbw, &uctx)) {
+	if (command_perform_act_entry(&cbw, &session.uctx)) {
 		printf("Error: Running entry command.\n");
 		retval = false;
 		goto exit;
 	}
-
+	retval = true;
 
 exit:
-	detach_device(&uctx, app.is_detach);
+	session_detach(&session, app.is_detach);
 	return retval;
 }
 
 
 
-int main (int argc, char *argv[]) {
-	enum libusb_error usb_error = 0;
-	int retval;
-
-	parseparams(argc, argv);
-
-	usb_error = libusb_init(NULL);
-	if (usb_error) {
-		printf("Error: libusb int: %s.\n", libusb_strerror(usb_error));
-		return -1;
-	}
-
+bool run_command(void) {
+	session.max_transfer = app.max_transfer;
+	session.is_cache = app.is_cache;
+	session.progress_mode = app.progress_mode;
 
 	switch (app.cmd) {
 		case APPCMD_ENUMERATE:
-			retval = enumerate_devices() ? 0 : 1;
-			break;
+			return enumerate_devices();
 		case APPCMD_INQUIRY:
-			retval = scsi_inquiry() ? 0 : 1;
-			break;
+			return scsi_inquiry();
 		case APPCMD_FCAPACITY:
-			retval = scsi_read_fcapacity() ? 0 : 1;
-			break;
+			return scsi_read_fcapacity();
 		case APPCMD_CAPACITY:
-			retval = scsi_read_capacity() ? 0 : 1;
-			break;
+			return scsi_read_capacity();
 		case APPCMD_READ:
-			retval = scsi_read10() ? 0 : 1;
-			break;
+			return scsi_read10();
 		case APPCMD_WRITE:
-			retval = scsi_write10() ? 0 : 1;
-			break;
+			return scsi_write10();
 		case APPCMD_HEADINFO:
-			retval = action_headinfo() ? 0 : 1;
-			break;
+			return action_headinfo();
 		case APPCMD_SYSINFO:
-			retval = action_sysinfo() ? 0 : 1;
-			break;
+			return action_sysinfo();
 		case APPCMD_READ_FW:
-			retval = action_readfw() ? 0 : 1;
-			break;
+			return action_readfw();
 		case APPCMD_TEST_RAMACC:
-			retval = action_test_ramacc() ? 0 : 1;
-			break;
+			return action_test_ramacc();
 		case APPCMD_READ_RAM:
-			retval = action_readram() ? 0 : 1;
-			break;
+			return action_readram();
 		case APPCMD_DUMP_RAW:
-			retval = action_dumpraw() ? 0 : 1;
-			break;
+			return action_dumpraw();
 		case APPCMD_DUMP_AFI:
-			retval = action_dumpafi() ? 0 : 1;
-			break;
+			return action_dumpafi();
 		case APPCMD_ENTRY:
-			retval = action_entry() ? 0 : 1;
-			break;
+			return action_entry();
+		case APPCMD_DAEMON:
+			return daemon_run();
+		case APPCMD_BATCH:
+			return batch_run();
+		case APPCMD_EXTRACT:
+			return action_extract();
+		case APPCMD_WATCH:
+			return watch_run();
+		case APPCMD_WATCH_CSV:
+			return watch_export_csv();
 		default:
 			printf("Error: Unknown command.\n");
-			retval = -1;
+			return false;
 	}
+}
+
+
+int main (int argc, char *argv[]) {
+	enum libusb_error usb_error = 0;
+	int retval;
+
+	parseparams(argc, argv);
+
+	usb_error = libusb_init(NULL);
+	if (usb_error) {
+		printf("Error: libusb int: %s.\n", libusb_strerror(usb_error));
+		return -1;
+	}
+
+	zero_session(&session);
+	retval = run_command() ? 0 : 1;
+	session_close(&session);
 
 	libusb_exit(NULL);
 	return retval;
@@ -0,0 +1,306 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "usbfw.h"
+
+// range list line: LBA COUNT [FILE], '#' starts comment
+READ_RANGE * load_range_list(char *filename, char *default_prefix, uint32_t *count) {
+	READ_RANGE *ranges = NULL;
+	uint32_t allocated = 0;
+	uint32_t line_no = 0;
+	char line[RANGE_MAX_LINE];
+	FILE *list;
+
+	*count = 0;
+
+	list = fopen(filename, "r");
+	if (!list) {
+		printf("Error: Cannot open range list \"%s\".\n", filename);
+		return NULL;
+	}
+
+	while (fgets(line, sizeof(line), list)) {
+		char *lba, *bc, *name, *end;
+		line_no++;
+
+		char *comment = strchr(line, '#');
+		if (comment) {
+			*comment = 0;
+		}
+
+		lba = strtok(line, " \t\r\n");
+		if (!lba) {
+			continue;
+		}
+		bc = strtok(NULL, " \t\r\n");
+		name = strtok(NULL, " \t\r\n");
+
+		if (*count >= allocated) {
+			allocated = allocated ? allocated * 2 : 64;
+			READ_RANGE *tmp = realloc(ranges, allocated * sizeof(READ_RANGE));
+			if (!tmp) {
+				printf("Error: Out of memory.\n");
+				goto error;
+			}
+			ranges = tmp;
+		}
+
+		READ_RANGE *range = &ranges[*count];
+		range->lba = strtoul(lba, &end, 0);
+		if (*end || !bc) {
+			printf("Error: Wrong range in line %u of \"%s\".\n", line_no, filename);
+			goto error;
+		}
+		range->count = strtoul(bc, &end, 0);
+		if (*end || (range->count == 0)) {
+			printf("Error: Wrong block count in line %u of \"%s\".\n", line_no, filename);
+			goto error;
+		}
+
+		if (name) {
+			range->filename = strdup(name);
+		} else {
+			range->filename = malloc(strlen(default_prefix) + 10);
+			if (range->filename) {
+				sprintf(range->filename, "%s.%08X", default_prefix, range->lba);
+			}
+		}
+		range->fd = -1;
+		range->offset = 0;
+		range->data = NULL;
+		(*count)++;
+
+		if (!range->filename) {
+			printf("Error: Out of memory.\n");
+			goto error;
+		}
+	}
+
+	fclose(list);
+
+	if (*count == 0) {
+		printf("Error: Range list \"%s\" is empty.\n", filename);
+		free(ranges);
+		return NULL;
+	}
+
+	return ranges;
+
+error:
+	fclose(list);
+	free_ranges(ranges, *count);
+	*count = 0;
+	return NULL;
+}
+
+// single range, e.g. from command line
+READ_RANGE * make_range(uint32_t lba, uint32_t count, char *filename) {
+	READ_RANGE *range = malloc(sizeof(READ_RANGE));
+	if (!range) {
+		printf("Error: Out of memory.\n");
+		return NULL;
+	}
+
+	range->lba = lba;
+	range->count = count;
+	range->filename = strdup(filename);
+	range->fd = -1;
+	range->offset = 0;
+	range->data = NULL;
+
+	if (!range->filename) {
+		printf("Error: Out of memory.\n");
+		free(range);
+		return NULL;
+	}
+
+	return range;
+}
+
+bool open_ranges(READ_RANGE *ranges, uint32_t count) {
+	for (uint32_t i = 0; i < count; i++) {
+		ranges[i].fd = open(ranges[i].filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (ranges[i].fd < 0) {
+			printf("Error: Cannot open output file \"%s\".\n", ranges[i].filename);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void free_ranges(READ_RANGE *ranges, uint32_t count) {
+	if (!ranges) {
+		return;
+	}
+
+	for (uint32_t i = 0; i < count; i++) {
+		if (ranges[i].fd >= 0) {
+			close(ranges[i].fd);
+		}
+		free(ranges[i].filename);
+	}
+	free(ranges);
+}
+
+static int range_compare(const void *a, const void *b) {
+	const READ_RANGE *ra = a;
+	const READ_RANGE *rb = b;
+
+	if (ra->lba != rb->lba) {
+		return (ra->lba < rb->lba) ? -1 : 1;
+	}
+	if (ra->count != rb->count) {
+		return (ra->count < rb->count) ? -1 : 1;
+	}
+	return 0;
+}
+
+// Sort ranges by LBA, merge overlapping and adjacent ones, read through gaps
+// not longer than merge_gap and split result at max_transfer. Returns number
+// of requests, ranges are left sorted.
+uint32_t plan_reads(READ_RANGE *ranges, uint32_t count, uint32_t merge_gap, uint32_t max_transfer, READ_REQUEST **requests) {
+	uint32_t allocated = 0;
+	uint32_t planned = 0;
+
+	*requests = NULL;
+	if (count == 0) {
+		return 0;
+	}
+	if (max_transfer == 0) {
+		max_transfer = 1;
+	}
+
+	qsort(ranges, count, sizeof(READ_RANGE), range_compare);
+
+	uint32_t i = 0;
+	while (i < count) {
+		// one continuous span [start, end)
+		uint64_t start = ranges[i].lba;
+		uint64_t end = start + ranges[i].count;
+
+		for (i++; i < count; i++) {
+			if ((uint64_t)ranges[i].lba > end + merge_gap) {
+				break;
+			}
+			if ((uint64_t)ranges[i].lba + ranges[i].count > end) {
+				end = (uint64_t)ranges[i].lba + ranges[i].count;
+			}
+		}
+
+		// split span into device transfers
+		for (uint64_t lba = start; lba < end; lba += max_transfer) {
+			if (planned >= allocated) {
+				allocated = allocated ? allocated * 2 : 64;
+				READ_REQUEST *tmp = realloc(*requests, allocated * sizeof(READ_REQUEST));
+				if (!tmp) {
+					free(*requests);
+					*requests = NULL;
+					return 0;
+				}
+				*requests = tmp;
+			}
+
+			(*requests)[planned].lba = (uint32_t)lba;
+			(*requests)[planned].count = ((end - lba) < max_transfer) ? (uint32_t)(end - lba) : max_transfer;
+			planned++;
+		}
+	}
+
+	return planned;
+}
+
+// write part of just read request into every range it overlaps
+static bool distribute_request(READ_REQUEST *req, uint8_t *buf, READ_RANGE *ranges, uint32_t count, uint32_t *first) {
+	uint64_t req_end = (uint64_t)req->lba + req->count;
+
+	// ranges are sorted by start, so skip those entirely behind request
+	while ((*first < count) && ((uint64_t)ranges[*first].lba + ranges[*first].count <= req->lba)) {
+		(*first)++;
+	}
+
+	for (uint32_t i = *first; (i < count) && (ranges[i].lba < req_end); i++) {
+		uint64_t range_end = (uint64_t)ranges[i].lba + ranges[i].count;
+		if (range_end <= req->lba) {
+			continue;
+		}
+
+		uint32_t from = (ranges[i].lba > req->lba) ? ranges[i].lba : req->lba;
+		uint32_t to = (range_end < req_end) ? (uint32_t)range_end : (uint32_t)req_end;
+		size_t len = (size_t)(to - from) * SECTOR_SIZE;
+		off_t pos = ranges[i].offset + (off_t)(from - ranges[i].lba) * SECTOR_SIZE;
+
+		if (pwrite(ranges[i].fd, buf + (size_t)(from - req->lba) * SECTOR_SIZE, len, pos) != (ssize_t)len) {
+			printf("Error: Cannot write to \"%s\": %s.\n", ranges[i].filename ? ranges[i].filename : "output", strerror(errno));
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Read all ranges into their output files (fd must be already open) in as few
+// device commands as possible, optional callback sees data of every request.
+// Requests are issued one by one: Bulk-only transport allows single command
+// in flight per device, so there is nothing to pipeline on the wire. Long
+// requests (--max-transfer) are what keeps per command overhead low.
+bool read_ranges(SESSION_CONTEXT *session, DEVICE_AREA area, uint8_t lun, READ_RANGE *ranges, uint32_t count, uint32_t merge_gap, READ_CALLBACK callback, void *data) {
+	READ_REQUEST *requests;
+	uint32_t planned;
+	uint32_t first = 0;
+	uint64_t total = 0;
+	bool retval = false;
+
+	planned = plan_reads(ranges, count, merge_gap, session->max_transfer, &requests);
+	if (!planned) {
+		printf("Error: Cannot plan reads.\n");
+		return false;
+	}
+
+	uint32_t longest = 0;
+	for (uint32_t i = 0; i < planned; i++) {
+		total += requests[i].count;
+		if (requests[i].count > longest) {
+			longest = requests[i].count;
+		}
+	}
+
+	uint8_t *buf = malloc((size_t)longest * SECTOR_SIZE);
+	if (!buf) {
+		printf("Error: Out of memory.\n");
+		free(requests);
+		return false;
+	}
+
+	printf("Reading %u range(s), 0x%08X sectors in %u command(s) ... ", count, (uint32_t)total, planned);
+	progress_start(&session->progress, session->progress_mode, "read", total, SECTOR_SIZE);
+	for (uint32_t i = 0; i < planned; i++) {
+		if (!read_area(session, area, lun, requests[i].lba, requests[i].count, buf)) {
+			progress_stop(&session->progress);
+			printf("\nError: Reading failed at sector 0x%08X.\n", requests[i].lba);
+			goto exit;
+		}
+
+		progress_add(&session->progress, requests[i].count);
+		if (!distribute_request(&requests[i], buf, ranges, count, &first)) {
+			goto exit;
+		}
+
+		if (callback && !callback(&requests[i], buf, data)) {
+			goto exit;
+		}
+	}
+	progress_stop(&session->progress);
+	printf("done.\n\n");
+	retval = true;
+
+exit:
+	progress_stop(&session->progress);
+	free(buf);
+	free(requests);
+	return retval;
+}
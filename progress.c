@@ -0,0 +1,168 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "usbfw.h"
+
+// Transfer loops only add to atomic counters, status is drawn by separate
+// thread waking every PROGRESS_INTERVAL, so it costs loops nothing however
+// fast they run.
+
+static double progress_time(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1000000000.0;
+}
+
+static void progress_render(PROGRESS *progress, bool is_final) {
+	uint64_t done = __atomic_load_n(&progress->done, __ATOMIC_RELAXED);
+	uint32_t errors = __atomic_load_n(&progress->errors, __ATOMIC_RELAXED);
+	double elapsed = progress_time() - progress->start;
+	double rate = (elapsed > 0) ? (done / elapsed) : 0;	// units per second
+	double eta = ((rate > 0) && (progress->total > done)) ? ((progress->total - done) / rate) : 0;
+	uint32_t percent = 100;
+	char status[80];
+	int len;
+
+	if (done < progress->total) {
+		percent = done * 100 / progress->total;
+	}
+
+	// key=value line for station controllers, rate is in units per second
+	if (progress->mode == PROGRESS_MACHINE) {
+		fprintf(stderr, "progress task=%s done=%" PRIu64 " total=%" PRIu64 " unit=%u rate=%.0f eta=%.1f errors=%u state=%s\n",
+			progress->name, done, progress->total, progress->unit, rate, eta, errors, is_final ? "finished" : "running");
+		fflush(stderr);
+		return;
+	}
+
+	if (progress->unit) {
+		len = snprintf(status, sizeof(status), "%3u%% %.2f MiB/s", percent, rate * progress->unit / (1024.0 * 1024.0));
+	} else {
+		len = snprintf(status, sizeof(status), "%3u%% %.0f/s", percent, rate);
+	}
+	if (rate > 0) {
+		len += snprintf(status + len, sizeof(status) - len, " ETA %u:%02u", (uint32_t)eta / 60, (uint32_t)eta % 60);
+	}
+	if (errors) {
+		len += snprintf(status + len, sizeof(status) - len, " %u error(s)", errors);
+	}
+
+	// redraw in place, leftovers of longer previous status are blanked
+	flockfile(stdout);
+	for (uint32_t i = 0; i < progress->shown; i++) {
+		putchar('\b');
+	}
+	fputs(status, stdout);
+	for (int32_t i = len; i < (int32_t)progress->shown; i++) {
+		putchar(' ');
+	}
+	for (int32_t i = len; i < (int32_t)progress->shown; i++) {
+		putchar('\b');
+	}
+	fflush(stdout);
+	funlockfile(stdout);
+	progress->shown = len;
+}
+
+static void * progress_thread(void *data) {
+	PROGRESS *progress = data;
+	struct timespec next;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	pthread_mutex_lock(&progress->lock);
+	while (!progress->is_stopping) {
+		next.tv_nsec += PROGRESS_INTERVAL;
+		if (next.tv_nsec >= 1000000000L) {
+			next.tv_sec++;
+			next.tv_nsec -= 1000000000L;
+		}
+		if (pthread_cond_timedwait(&progress->cond, &progress->lock, &next) == ETIMEDOUT) {
+			progress_render(progress, false);
+		}
+	}
+	pthread_mutex_unlock(&progress->lock);
+
+	return NULL;
+}
+
+// 'total' units of 'unit' bytes each (0 - units aren't data), 'name' is task
+// name in machine readable lines
+void progress_start(PROGRESS *progress, PROGRESS_MODE mode, const char *name, uint64_t total, uint32_t unit) {
+	pthread_condattr_t attr;
+
+	progress->mode = mode;
+	progress->name = name;
+	progress->total = total;
+	progress->unit = unit;
+	progress->done = 0;
+	progress->errors = 0;
+	progress->start = progress_time();
+	progress->shown = 0;
+	progress->is_stopping = false;
+	progress->is_running = false;
+
+	if (mode == PROGRESS_QUIET) {
+		return;
+	}
+
+	pthread_mutex_init(&progress->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&progress->cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	// without renderer work goes on, just isn't shown
+	if (pthread_create(&progress->thread, NULL, progress_thread, progress) == 0) {
+		progress->is_running = true;
+	} else {
+		pthread_cond_destroy(&progress->cond);
+		pthread_mutex_destroy(&progress->lock);
+	}
+}
+
+void progress_add(PROGRESS *progress, uint64_t count) {
+	__atomic_fetch_add(&progress->done, count, __ATOMIC_RELAXED);
+}
+
+// non fatal error, like checksum mismatch, work goes on
+void progress_error(PROGRESS *progress) {
+	__atomic_fetch_add(&progress->errors, 1, __ATOMIC_RELAXED);
+}
+
+// Stop renderer and erase text status, so caller continues the same line.
+// May be called more times, e.g. before error message and again at exit.
+void progress_stop(PROGRESS *progress) {
+	if (!progress->is_running) {
+		return;
+	}
+
+	pthread_mutex_lock(&progress->lock);
+	progress->is_stopping = true;
+	pthread_cond_signal(&progress->cond);
+	pthread_mutex_unlock(&progress->lock);
+	pthread_join(progress->thread, NULL);
+	pthread_cond_destroy(&progress->cond);
+	pthread_mutex_destroy(&progress->lock);
+	progress->is_running = false;
+
+	if (progress->mode == PROGRESS_MACHINE) {
+		progress_render(progress, true);
+		return;
+	}
+
+	for (uint32_t i = 0; i < progress->shown; i++) {
+		putchar('\b');
+	}
+	for (uint32_t i = 0; i < progress->shown; i++) {
+		putchar(' ');
+	}
+	for (uint32_t i = 0; i < progress->shown; i++) {
+		putchar('\b');
+	}
+	fflush(stdout);
+	progress->shown = 0;
+}
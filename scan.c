@@ -0,0 +1,207 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "usbfw.h"
+
+static bool is_erased(uint8_t *buf, size_t size) {
+	for (size_t i = 0; i < size; i++) {
+		if (buf[i] != 0xFF) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static int block_compare(const void *a, const void *b) {
+	const READ_RANGE *ra = a;
+	const READ_RANGE *rb = b;
+
+	return (ra->lba < rb->lba) ? -1 : (ra->lba > rb->lba);
+}
+
+// erased blocks are not read, but output must look like they were
+static bool fill_erased(int fd, off_t pos, uint64_t size) {
+	uint8_t buf[0x10000];
+
+	memset(buf, 0xFF, sizeof(buf));
+	while (size) {
+		size_t len = (size < sizeof(buf)) ? size : sizeof(buf);
+		if (pwrite(fd, buf, len, pos) != (ssize_t)len) {
+			return false;
+		}
+		pos += len;
+		size -= len;
+	}
+	return true;
+}
+
+// Read 'count' sectors from lba into fd. Each erase block (aligned to
+// block_size sectors) with erased first and last sector is taken as erased
+// and isn't read. 'verify' skipped blocks are fully read anyway to check the
+// guess, wrong guesses are kept in output. Skipped blocks are listed in map
+// file as range list lines.
+bool read_skip_erased(SESSION_CONTEXT *session, DEVICE_AREA area, uint8_t lun, uint32_t lba, uint32_t count, uint32_t block_size, uint32_t verify, int fd, char *map_filename) {
+	uint8_t sector[SECTOR_SIZE];
+	READ_RANGE *ranges = NULL;
+	READ_RANGE *skipped = NULL;
+	uint32_t ranges_count = 0;
+	uint32_t skipped_count = 0;
+	uint32_t blocks = 0;
+	uint8_t *buf = NULL;
+	bool retval = false;
+	FILE *map = NULL;
+
+	// blocks are aligned on device, so first and last may be partial; block
+	// after last one may start at 2^32, so positions are 64 bit
+	uint64_t end = (uint64_t)lba + count;
+	for (uint64_t start = lba; start < end; start = (start / block_size + 1) * block_size) {
+		blocks++;
+	}
+
+	ranges = malloc(blocks * sizeof(READ_RANGE));
+	skipped = malloc(blocks * sizeof(READ_RANGE));
+	buf = malloc((size_t)block_size * SECTOR_SIZE);
+	if (!ranges || !skipped || !buf) {
+		printf("Error: Out of memory.\n");
+		goto exit;
+	}
+
+	printf("Sampling %u erase block(s) of 0x%X sectors ... ", blocks, block_size);
+	progress_start(&session->progress, session->progress_mode, "sample", blocks, 0);
+	for (uint64_t start = lba; start < end; start = (start / block_size + 1) * block_size) {
+		uint64_t next = (start / block_size + 1) * block_size;
+		uint32_t len = ((next < end) ? next : end) - start;
+		bool erased;
+
+		READ_RANGE range = {
+			.lba = start,
+			.count = len,
+			.filename = NULL,
+			.fd = fd,
+			.offset = (off_t)(start - lba) * SECTOR_SIZE,
+			.data = NULL
+		};
+
+		if (!read_area(session, area, lun, start, 1, sector)) {
+			progress_stop(&session->progress);
+			printf("\nError: Reading failed at sector 0x%08X.\n", (uint32_t)start);
+			goto exit;
+		}
+		erased = is_erased(sector, SECTOR_SIZE);
+		if (erased && (len > 1)) {
+			if (!read_area(session, area, lun, start + len - 1, 1, sector)) {
+				progress_stop(&session->progress);
+				printf("\nError: Reading failed at sector 0x%08X.\n", (uint32_t)(start + len - 1));
+				goto exit;
+			}
+			erased = is_erased(sector, SECTOR_SIZE);
+		}
+
+		if (erased) {
+			skipped[skipped_count++] = range;
+		} else {
+			ranges[ranges_count++] = range;
+		}
+
+		progress_add(&session->progress, 1);
+	}
+	progress_stop(&session->progress);
+	printf("done.\n\n");
+	printf("%u block(s) look erased and are skipped, %u block(s) to read.\n", skipped_count, ranges_count);
+
+	// check random sample of skipped blocks, wrong guesses are read normally
+	if (verify && skipped_count) {
+		uint32_t wrong = 0;
+		unsigned int seed = time(NULL);
+
+		if (verify > skipped_count) {
+			verify = skipped_count;
+		}
+
+		printf("Verifying %u skipped block(s) ... ", verify);
+		progress_start(&session->progress, session->progress_mode, "verify", verify, 0);
+		for (uint32_t i = 0; i < verify; i++) {
+			// partial Fisher-Yates, so no block is checked twice
+			uint32_t j = i + rand_r(&seed) % (skipped_count - i);
+			READ_RANGE tmp = skipped[i];
+			skipped[i] = skipped[j];
+			skipped[j] = tmp;
+
+			if (!read_area(session, area, lun, skipped[i].lba, skipped[i].count, buf)) {
+				progress_stop(&session->progress);
+				printf("\nError: Reading failed at sector 0x%08X.\n", skipped[i].lba);
+				goto exit;
+			}
+			// data is already here, so write it and forget the block
+			size_t len = (size_t)skipped[i].count * SECTOR_SIZE;
+			if (!is_erased(buf, len)) {
+				if (pwrite(fd, buf, len, skipped[i].offset) != (ssize_t)len) {
+					progress_stop(&session->progress);
+					printf("\nError: Cannot write to output file.\n");
+					goto exit;
+				}
+				skipped[i].count = 0;
+				wrong++;
+				progress_error(&session->progress);
+			}
+
+			progress_add(&session->progress, 1);
+		}
+		progress_stop(&session->progress);
+		printf("done.\n");
+
+		// drop wrong guesses from skipped
+		uint32_t left = 0;
+		for (uint32_t i = 0; i < skipped_count; i++) {
+			if (skipped[i].count) {
+				skipped[left++] = skipped[i];
+			}
+		}
+		skipped_count = left;
+
+		if (wrong) {
+			printf(COLOR_RED"Warning"COLOR_DEFAULT": %u sampled block(s) weren't erased, consider smaller erase block.\n", wrong);
+		}
+	}
+	printf("\n");
+
+	for (uint32_t i = 0; i < skipped_count; i++) {
+		if (!fill_erased(fd, skipped[i].offset, (uint64_t)skipped[i].count * SECTOR_SIZE)) {
+			printf("Error: Cannot write to output file.\n");
+			goto exit;
+		}
+	}
+
+	if (ranges_count && !read_ranges(session, area, lun, ranges, ranges_count, 0, NULL, NULL)) {
+		goto exit;
+	}
+
+	// map lists skipped blocks sorted, ready for use as --range-list
+	map = fopen(map_filename, "w");
+	if (!map) {
+		printf("Error: Cannot open map file \"%s\".\n", map_filename);
+		goto exit;
+	}
+	qsort(skipped, skipped_count, sizeof(READ_RANGE), block_compare);
+	fprintf(map, "# erased blocks skipped in dump, block size 0x%X sectors\n", block_size);
+	for (uint32_t i = 0; i < skipped_count; i++) {
+		fprintf(map, "0x%08X 0x%X\n", skipped[i].lba, skipped[i].count);
+	}
+	if (fclose(map)) {
+		printf("Error: Cannot write map file \"%s\".\n", map_filename);
+		goto exit;
+	}
+	printf("Map of %u skipped block(s) written to \"%s\".\n\n", skipped_count, map_filename);
+
+	retval = true;
+
+exit:
+	free(buf);
+	free(skipped);
+	free(ranges);
+	return retval;
+}
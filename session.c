@@ -0,0 +1,243 @@
+#include <string.h>
+
+#include "usbfw.h"
+
+static void reset_session(SESSION_CONTEXT *session) {
+	zero_bulk_context(&session->uctx);
+	session->vid = 0;
+	session->pid = 0;
+	session->serial[0] = 0;
+	session->is_open = false;
+	session->is_act = false;
+	session->is_key = false;
+	session->key_lun = 0;
+	session->key_checksum = 0;
+	for (uint32_t i = 0; i < 2; i++) {
+		session->header[i].is_valid = false;
+	}
+	session->is_sysinfo = false;
+	session->is_brec = false;
+	session->capacity_mask = 0;
+	session->is_alt = false;
+	session->alt_lun = 0;
+	session->alt_lba = 0;
+}
+
+void zero_session(SESSION_CONTEXT *session) {
+	reset_session(session);
+	session->max_transfer = MAX_TRANSFER_SECTORS;
+	session->is_cache = true;
+	session->progress_mode = PROGRESS_TEXT;
+	session->progress.is_running = false;
+}
+
+// USB serial number distinguishes same model devices in disk cache
+static void session_get_serial(SESSION_CONTEXT *session) {
+	uint8_t idx = session->uctx.dev_descr.iSerialNumber;
+	int len = 0;
+
+	if (idx) {
+		len = libusb_get_string_descriptor_ascii(session->uctx.handle, idx, (unsigned char *)session->serial, SESSION_MAX_SERIAL - 1);
+	}
+	if (len <= 0) {
+		strcpy(session->serial, "noserial");
+		return;
+	}
+
+	session->serial[len] = 0;
+	for (int i = 0; i < len; i++) {
+		char c = session->serial[i];
+		if (!(((c >= '0') && (c <= '9')) || ((c >= 'A') && (c <= 'Z')) || ((c >= 'a') && (c <= 'z')))) {
+			session->serial[i] = '_';
+		}
+	}
+}
+
+// open and claim device only if it isn't already open in this session
+bool session_open(SESSION_CONTEXT *session, uint16_t vid, uint16_t pid) {
+	if (session->is_open) {
+		if ((session->vid == vid) && (session->pid == pid)) {
+			return true;
+		}
+		session_close(session);
+	}
+
+	if (!open_and_claim(&session->uctx, vid, pid)) {
+		return false;
+	}
+
+	session->vid = vid;
+	session->pid = pid;
+	session->is_open = true;
+	session_get_serial(session);
+	return true;
+}
+
+bool session_init_act(SESSION_CONTEXT *session) {
+	if (!session->is_act) {
+		session->is_act = init_act(&session->uctx);
+	}
+	return session->is_act;
+}
+
+// Disk cache key is main firmware directory checksum, so single read of main
+// header first sector tells whether anything cached is still valid.
+bool session_get_key(SESSION_CONTEXT *session, uint8_t lun) {
+	FW_HEADER *fw_header = (FW_HEADER *)session->key_sector;
+
+	if (session->is_key && (session->key_lun == lun)) {
+		return true;
+	}
+
+	session->is_key = false;
+	if (!read_area(session, AREA_FW_LOG, lun, 0, 1, session->key_sector)) {
+		printf("Error: Reading header failed at sector 0\n");
+		return false;
+	}
+	if (fw_header->magic != FW_HEADER_MAGIC) {
+		return false;
+	}
+
+	session->is_key = true;
+	session->key_lun = lun;
+	session->key_checksum = fw_header->dirCheckSum;
+	return true;
+}
+
+// cached item name with location, e.g. "hdr-0-00004000"
+static void session_item(char *item, size_t size, char *type, uint8_t lun, uint32_t lba) {
+	snprintf(item, size, "%s-%u-%08X", type, lun, lba);
+}
+
+// fetch firmware header once per session and location, main and one other
+// are kept
+FW_HEADER * session_get_header(SESSION_CONTEXT *session, uint8_t lun, uint32_t lba) {
+	SESSION_HEADER *slot = &session->header[lba ? 1 : 0];
+	uint8_t first[SECTOR_SIZE];
+	char item[CACHE_MAX_NAME];
+
+	if (slot->is_valid && (slot->lun == lun) && (slot->lba == lba)) {
+		return &slot->header;
+	}
+
+	slot->is_valid = false;
+	slot->lun = lun;
+	slot->lba = lba;
+
+	// cached header is good only if its first sector is still on device
+	session_item(item, sizeof(item), "hdr", lun, lba);
+	if (session->is_cache && session_get_key(session, lun)) {
+		if (lba == 0) {
+			memcpy(first, session->key_sector, SECTOR_SIZE);
+		} else if (!read_area(session, AREA_FW_LOG, lun, lba, 1, first)) {
+			memset(first, 0, SECTOR_SIZE);
+		}
+
+		if (cache_load(session, item, &slot->header, sizeof(FW_HEADER)) && (memcmp(first, &slot->header, SECTOR_SIZE) == 0)) {
+			slot->is_valid = true;
+			return &slot->header;
+		}
+	}
+
+	if (!get_fw_header(&session->uctx, &slot->header, lun, lba)) {
+		return NULL;
+	}
+
+	slot->is_valid = true;
+	cache_store(session, item, &slot->header, sizeof(FW_HEADER));
+	return &slot->header;
+}
+
+// sysinfo lives in RAM, but it changes only with firmware
+FW_SYSINFO * session_get_sysinfo(SESSION_CONTEXT *session, uint8_t lun) {
+	if (session->is_sysinfo) {
+		return &session->sysinfo;
+	}
+
+	if (session->is_cache && session_get_key(session, lun)) {
+		if (cache_load(session, "sysinfo", &session->sysinfo, sizeof(FW_SYSINFO)) && (memcmp(&session->sysinfo, "SYS INFOHW", 10) == 0)) {
+			session->is_sysinfo = true;
+			return &session->sysinfo;
+		}
+	}
+
+	if (!get_fw_sysinfo(&session->uctx, &session->sysinfo)) {
+		return NULL;
+	}
+
+	session->is_sysinfo = true;
+	cache_store(session, "sysinfo", &session->sysinfo, sizeof(FW_SYSINFO));
+	return &session->sysinfo;
+}
+
+// bootrecord from physical area, validated by its first sector like header
+FW_BREC * session_get_brec(SESSION_CONTEXT *session, uint8_t lun, uint32_t lba) {
+	uint8_t first[SECTOR_SIZE];
+	char item[CACHE_MAX_NAME];
+
+	if (session->is_brec && (session->brec_lun == lun) && (session->brec_lba == lba)) {
+		return &session->brec;
+	}
+
+	session->is_brec = false;
+	session->brec_lun = lun;
+	session->brec_lba = lba;
+
+	session_item(item, sizeof(item), "brec", lun, lba);
+	if (session->is_cache && session_get_key(session, lun)) {
+		if (!read_area(session, AREA_FW_PHY, lun, lba, 1, first)) {
+			printf("Error: Reading bootrecord failed at sector %i.\n", lba);
+			return NULL;
+		}
+
+		if (cache_load(session, item, &session->brec, sizeof(FW_BREC)) && (memcmp(first, &session->brec, SECTOR_SIZE) == 0)) {
+			session->is_brec = true;
+			return &session->brec;
+		}
+	}
+
+	if (!read_area(session, AREA_FW_PHY, lun, lba, sizeof(FW_BREC) / SECTOR_SIZE, (uint8_t *)&session->brec)) {
+		printf("Error: Reading bootrecord failed at sector %i.\n", lba);
+		return NULL;
+	}
+
+	session->is_brec = true;
+	cache_store(session, item, &session->brec, sizeof(FW_BREC));
+	return &session->brec;
+}
+
+// fetch LUN capacity once per session
+SCSI_CAPACITY * session_get_capacity(SESSION_CONTEXT *session, uint8_t lun) {
+	CBW cbw;
+
+	lun &= 7;
+	if (session->capacity_mask & (1 << lun)) {
+		return &session->capacity[lun];
+	}
+
+	command_init_read_capacity(&cbw, lun);
+	if (command_perform_read_capacity(&cbw, &session->uctx, &session->capacity[lun])) {
+		return NULL;
+	}
+
+	session->capacity_mask |= (1 << lun);
+	return &session->capacity[lun];
+}
+
+// detached device restarts, so nothing from session is valid anymore
+void session_detach(SESSION_CONTEXT *session, bool detach) {
+	if (!detach || !session->is_open) {
+		return;
+	}
+
+	detach_device(&session->uctx, true);
+	session_close(session);
+}
+
+void session_close(SESSION_CONTEXT *session) {
+	if (session->is_open) {
+		free_bulk_context(&session->uctx);
+	}
+	// keep settings, only state is gone
+	reset_session(session);
+}
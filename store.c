@@ -0,0 +1,782 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "usbfw.h"
+
+// Content addressed store of dumps. Images are cut to STORE_CHUNK_SIZE chunks
+// kept once in append only pool file, found through open addressing hash
+// table in mapped index file. Each image has only manifest with hashes of its
+// chunks. Pool space is allocated in whole chunks, so chunks stay block
+// aligned and restore may share them with reflinks.
+//
+// Directory layout: "index", "pool.GENERATION", "lock" and "manifests/NAME".
+// Index header poolSize is updated only after pool data are synced, slots
+// past it are dropped when store is opened after crash.
+
+typedef struct {
+	STORE			*store;
+	uint8_t			*data;		// mapped image
+	uint64_t		size;
+	uint64_t		(*hashes)[2];	// manifest hash of each chunk
+	uint64_t		count;		// chunks
+	uint64_t		next;		// next chunk to hash, taken atomically
+	uint64_t		added;		// chunks put to pool
+	uint64_t		written;	// bytes written to pool
+	bool			is_error;
+} STORE_JOB;
+
+static uint64_t rotl64(uint64_t x, int r) {
+	return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t fmix64(uint64_t k) {
+	k ^= k >> 33;
+	k *= 0xFF51AFD7ED558CCDULL;
+	k ^= k >> 33;
+	k *= 0xC4CEB9FE1A85EC53ULL;
+	k ^= k >> 33;
+	return k;
+}
+
+// MurmurHash3 x64 128 bit variant, seed 0
+void store_hash(const void *data, size_t size, uint64_t hash[2]) {
+	const uint8_t *bytes = data;
+	const uint64_t c1 = 0x87C37B91114253D5ULL;
+	const uint64_t c2 = 0x4CF5AD432745937FULL;
+	uint64_t h1 = 0, h2 = 0;
+	uint64_t k1, k2;
+	size_t i;
+
+	for (i = 0; i + 16 <= size; i += 16) {
+		memcpy(&k1, bytes + i, 8);
+		memcpy(&k2, bytes + i + 8, 8);
+
+		k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+		h1 = rotl64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52DCE729;
+		k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+		h2 = rotl64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495AB5;
+	}
+
+	// tail, in the same byte order as reference implementation
+	k1 = 0;
+	k2 = 0;
+	for (size_t j = size - i; j > 8; j--) {
+		k2 ^= (uint64_t)bytes[i + j - 1] << ((j - 9) * 8);
+	}
+	for (size_t j = ((size - i) > 8) ? 8 : (size - i); j > 0; j--) {
+		k1 ^= (uint64_t)bytes[i + j - 1] << ((j - 1) * 8);
+	}
+	if (size - i > 8) {
+		k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+	}
+	if (size - i > 0) {
+		k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+	}
+
+	h1 ^= size;
+	h2 ^= size;
+	h1 += h2;
+	h2 += h1;
+	h1 = fmix64(h1);
+	h2 = fmix64(h2);
+	h1 += h2;
+	h2 += h1;
+
+	hash[0] = h1;
+	hash[1] = h2;
+}
+
+static bool store_path(STORE *store, char *path, const char *format, ...) {
+	va_list args;
+	int len = snprintf(path, STORE_MAX_PATH, "%s/", store->dirname);
+
+	if ((len < 0) || (len >= STORE_MAX_PATH)) {
+		return false;
+	}
+	va_start(args, format);
+	int name_len = vsnprintf(path + len, STORE_MAX_PATH - len, format, args);
+	va_end(args);
+	return (name_len >= 0) && (name_len < STORE_MAX_PATH - len);
+}
+
+static STORE_SLOT * index_slots(STORE_INDEX_HEADER *index) {
+	return (STORE_SLOT *)(index + 1);
+}
+
+// slot with hash, or empty one where it would be inserted
+static STORE_SLOT * index_find(STORE_INDEX_HEADER *index, const uint64_t hash[2]) {
+	STORE_SLOT *slots = index_slots(index);
+	uint32_t i = hash[0] & (index->slotCount - 1);
+
+	while ((slots[i].length != 0) && ((slots[i].hash[0] != hash[0]) || (slots[i].hash[1] != hash[1]))) {
+		i = (i + 1) & (index->slotCount - 1);
+	}
+	return &slots[i];
+}
+
+static size_t index_size(uint32_t slot_count) {
+	return sizeof(STORE_INDEX_HEADER) + ((size_t)slot_count * sizeof(STORE_SLOT));
+}
+
+// create empty index file of 'slot_count' slots and map it
+static STORE_INDEX_HEADER * index_create(char *path, uint32_t slot_count, uint32_t generation) {
+	STORE_INDEX_HEADER *index;
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+	if (fd < 0) {
+		return NULL;
+	}
+	if (ftruncate(fd, index_size(slot_count))) {
+		close(fd);
+		return NULL;
+	}
+	index = mmap(NULL, index_size(slot_count), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (index == MAP_FAILED) {
+		return NULL;
+	}
+
+	index->magic = STORE_MAGIC;
+	index->version = STORE_VERSION;
+	index->chunkSize = STORE_CHUNK_SIZE;
+	index->generation = generation;
+	index->slotCount = slot_count;
+	index->used = 0;
+	index->poolSize = 0;
+	return index;
+}
+
+static STORE_INDEX_HEADER * index_load(char *path) {
+	STORE_INDEX_HEADER *index;
+	struct stat st;
+	int fd = open(path, O_RDWR | O_CLOEXEC);
+
+	if (fd < 0) {
+		return NULL;
+	}
+	if (fstat(fd, &st) || (st.st_size < sizeof(STORE_INDEX_HEADER))) {
+		close(fd);
+		return NULL;
+	}
+	index = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (index == MAP_FAILED) {
+		return NULL;
+	}
+
+	if ((index->magic != STORE_MAGIC) || (index->version != STORE_VERSION) || (index->chunkSize != STORE_CHUNK_SIZE) ||
+	    (index->slotCount == 0) || (index->slotCount & (index->slotCount - 1)) || (index_size(index->slotCount) != st.st_size)) {
+		munmap(index, st.st_size);
+		return NULL;
+	}
+	return index;
+}
+
+// make new index replacing current one atomically, with slots of chunks
+// placed before 'limit' only
+static bool store_rehash(STORE *store, uint32_t slot_count, uint64_t limit) {
+	char tmp_path[STORE_MAX_PATH];
+	char path[STORE_MAX_PATH];
+	STORE_INDEX_HEADER *index;
+	STORE_SLOT *slots = index_slots(store->index);
+
+	if (!store_path(store, tmp_path, "index.tmp") || !store_path(store, path, "index")) {
+		return false;
+	}
+	index = index_create(tmp_path, slot_count, store->index->generation);
+	if (!index) {
+		return false;
+	}
+
+	for (uint32_t i = 0; i < store->index->slotCount; i++) {
+		if ((slots[i].length != 0) && (slots[i].offset < limit)) {
+			*index_find(index, slots[i].hash) = slots[i];
+			index->used++;
+		}
+	}
+	index->poolSize = store->index->poolSize;
+
+	if (msync(index, index_size(slot_count), MS_SYNC) || rename(tmp_path, path)) {
+		munmap(index, index_size(slot_count));
+		unlink(tmp_path);
+		return false;
+	}
+
+	munmap(store->index, index_size(store->index->slotCount));
+	store->index = index;
+	return true;
+}
+
+// Open store in 'dirname', creating it if needed. Store is locked for other
+// processes until closed.
+bool store_open(STORE *store, char *dirname) {
+	char path[STORE_MAX_PATH];
+
+	store->lock_fd = -1;
+	store->pool_fd = -1;
+	store->index = NULL;
+	if (strlen(dirname) >= sizeof(store->dirname) - 32) {
+		printf("Error: Store path \"%s\" is too long.\n", dirname);
+		return false;
+	}
+	strcpy(store->dirname, dirname);
+
+	if ((mkdir(dirname, 0755) && (errno != EEXIST)) || !store_path(store, path, "manifests") || (mkdir(path, 0755) && (errno != EEXIST))) {
+		printf("Error: Cannot create store \"%s\".\n", dirname);
+		return false;
+	}
+
+	store_path(store, path, "lock");
+	store->lock_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if ((store->lock_fd < 0) || flock(store->lock_fd, LOCK_EX)) {
+		printf("Error: Cannot lock store \"%s\".\n", dirname);
+		goto error;
+	}
+
+	store_path(store, path, "index");
+	if (access(path, F_OK) == 0) {
+		store->index = index_load(path);
+	} else {
+		store->index = index_create(path, STORE_INITIAL_SLOTS, 0);
+	}
+	if (!store->index) {
+		printf("Error: Store \"%s\" index is broken.\n", dirname);
+		goto error;
+	}
+
+	store_path(store, path, "pool.%u", store->index->generation);
+	store->pool_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (store->pool_fd < 0) {
+		printf("Error: Cannot open store pool \"%s\".\n", path);
+		goto error;
+	}
+
+	// chunks of interrupted add are forgotten
+	STORE_SLOT *slots = index_slots(store->index);
+	for (uint32_t i = 0; i < store->index->slotCount; i++) {
+		if ((slots[i].length != 0) && (slots[i].offset >= store->index->poolSize)) {
+			if (!store_rehash(store, store->index->slotCount, store->index->poolSize)) {
+				printf("Error: Cannot write store \"%s\" index.\n", dirname);
+				goto error;
+			}
+			break;
+		}
+	}
+	if (ftruncate(store->pool_fd, store->index->poolSize)) {
+		printf("Error: Cannot write store pool \"%s\".\n", path);
+		goto error;
+	}
+	store->pool_end = store->index->poolSize;
+
+	// pool left by garbage collection interrupted after index switch
+	if (store->index->generation > 0) {
+		store_path(store, path, "pool.%u", store->index->generation - 1);
+		unlink(path);
+	}
+
+	pthread_mutex_init(&store->lock, NULL);
+	return true;
+
+error:
+	if (store->index) {
+		munmap(store->index, index_size(store->index->slotCount));
+	}
+	if (store->pool_fd >= 0) {
+		close(store->pool_fd);
+	}
+	if (store->lock_fd >= 0) {
+		close(store->lock_fd);
+	}
+	return false;
+}
+
+void store_close(STORE *store) {
+	pthread_mutex_destroy(&store->lock);
+	msync(store->index, index_size(store->index->slotCount), MS_SYNC);
+	munmap(store->index, index_size(store->index->slotCount));
+	close(store->pool_fd);
+	close(store->lock_fd);
+	store->index = NULL;
+}
+
+static void * store_add_thread(void *data) {
+	STORE_JOB *job = data;
+	STORE *store = job->store;
+
+	while (!__atomic_load_n(&job->is_error, __ATOMIC_RELAXED)) {
+		uint64_t i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+		if (i >= job->count) {
+			break;
+		}
+
+		uint8_t *chunk = job->data + (i * STORE_CHUNK_SIZE);
+		uint32_t length = ((job->size - (i * STORE_CHUNK_SIZE)) < STORE_CHUNK_SIZE) ? (job->size - (i * STORE_CHUNK_SIZE)) : STORE_CHUNK_SIZE;
+		store_hash(chunk, length, job->hashes[i]);
+
+		pthread_mutex_lock(&store->lock);
+		STORE_SLOT *slot = index_find(store->index, job->hashes[i]);
+		if (slot->length != 0) {
+			pthread_mutex_unlock(&store->lock);
+			continue;
+		}
+
+		// keep table at most 3/4 full
+		if ((store->index->used + 1) * 4 > (uint64_t)store->index->slotCount * 3) {
+			if ((store->index->slotCount >= 0x80000000) || !store_rehash(store, store->index->slotCount * 2, UINT64_MAX)) {
+				pthread_mutex_unlock(&store->lock);
+				__atomic_store_n(&job->is_error, true, __ATOMIC_RELAXED);
+				break;
+			}
+			slot = index_find(store->index, job->hashes[i]);
+		}
+
+		uint64_t offset = store->pool_end;
+		store->pool_end += STORE_CHUNK_SIZE;
+		slot->hash[0] = job->hashes[i][0];
+		slot->hash[1] = job->hashes[i][1];
+		slot->offset = offset;
+		slot->length = length;
+		store->index->used++;
+		pthread_mutex_unlock(&store->lock);
+
+		// other threads may find slot before data are written, but nobody
+		// reads pool during add
+		if (pwrite(store->pool_fd, chunk, length, offset) != length) {
+			__atomic_store_n(&job->is_error, true, __ATOMIC_RELAXED);
+			break;
+		}
+		__atomic_fetch_add(&job->added, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&job->written, length, __ATOMIC_RELAXED);
+	}
+
+	return NULL;
+}
+
+// forget chunks claimed by failed add, like store_open does after
+// interrupted one
+static void store_rollback(STORE *store) {
+	if (store->pool_end == store->index->poolSize) {
+		return;
+	}
+	if (!store_rehash(store, store->index->slotCount, store->index->poolSize) || ftruncate(store->pool_fd, store->index->poolSize)) {
+		printf("Error: Cannot write store \"%s\" index.\n", store->dirname);
+		return;
+	}
+	store->pool_end = store->index->poolSize;
+}
+
+static bool store_write_manifest(STORE *store, char *name, STORE_MANIFEST_HEADER *header, uint64_t (*hashes)[2]) {
+	char tmp_path[STORE_MAX_PATH];
+	char path[STORE_MAX_PATH];
+	bool retval;
+	FILE *file;
+
+	if (!store_path(store, tmp_path, "manifests/.%s.tmp", name) || !store_path(store, path, "manifests/%s", name)) {
+		return false;
+	}
+	file = fopen(tmp_path, "w");
+	if (!file) {
+		return false;
+	}
+
+	retval = (fwrite(header, sizeof(STORE_MANIFEST_HEADER), 1, file) == 1);
+	if (retval && header->chunkCount) {
+		retval = (fwrite(hashes, sizeof(uint64_t) * 2, header->chunkCount, file) == header->chunkCount);
+	}
+	retval = !fflush(file) && !fdatasync(fileno(file)) && retval;
+	retval = !fclose(file) && retval;
+	if (!retval || rename(tmp_path, path)) {
+		unlink(tmp_path);
+		return false;
+	}
+	return true;
+}
+
+static bool store_name_valid(char *name) {
+	return *name && (*name != '.') && !strchr(name, '/') && (strlen(name) < CACHE_MAX_NAME);
+}
+
+// Put whole content of 'fd' to store as image 'name', replacing image of the
+// same name. Chunks are hashed and written by many threads, only chunks not
+// yet in store are written.
+bool store_add(STORE *store, char *name, int fd, STORE_STATS *stats) {
+	pthread_t thread[STORE_MAX_THREADS];
+	STORE_MANIFEST_HEADER header;
+	STORE_JOB job;
+	struct stat st;
+	uint32_t threads, started;
+	bool retval = false;
+
+	if (!store_name_valid(name)) {
+		printf("Error: Invalid store image name \"%s\".\n", name);
+		return false;
+	}
+	if (fstat(fd, &st)) {
+		printf("Error: Cannot read image \"%s\".\n", name);
+		return false;
+	}
+
+	memset(&job, 0, sizeof(job));
+	job.store = store;
+	job.size = st.st_size;
+	job.count = (job.size + STORE_CHUNK_SIZE - 1) / STORE_CHUNK_SIZE;
+	job.data = MAP_FAILED;
+	if (job.size) {
+		job.data = mmap(NULL, job.size, PROT_READ, MAP_SHARED, fd, 0);
+		if (job.data == MAP_FAILED) {
+			printf("Error: Cannot map image \"%s\".\n", name);
+			return false;
+		}
+		madvise(job.data, job.size, MADV_SEQUENTIAL);
+		madvise(job.data, job.size, MADV_WILLNEED);
+	}
+	job.hashes = malloc((job.count ? job.count : 1) * sizeof(uint64_t) * 2);
+	if (!job.hashes) {
+		printf("Error: Out of memory.\n");
+		goto exit;
+	}
+
+	threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if ((threads < 1) || (threads > STORE_MAX_THREADS)) {
+		threads = STORE_MAX_THREADS;
+	}
+	if (threads > job.count) {
+		threads = job.count;
+	}
+	for (started = 0; started < threads; started++) {
+		if (pthread_create(&thread[started], NULL, store_add_thread, &job)) {
+			break;
+		}
+	}
+	// without any thread started, work is done in this one
+	if (started == 0) {
+		store_add_thread(&job);
+	}
+	for (uint32_t i = 0; i < started; i++) {
+		pthread_join(thread[i], NULL);
+	}
+
+	if (job.is_error) {
+		printf("Error: Cannot write to store \"%s\".\n", store->dirname);
+		goto exit;
+	}
+
+	// data first, then index telling they are there, then manifest using
+	// them; pool is kept whole chunks long even after shorter last chunk
+	if (ftruncate(store->pool_fd, store->pool_end) || fdatasync(store->pool_fd)) {
+		printf("Error: Cannot write to store \"%s\".\n", store->dirname);
+		goto exit;
+	}
+	store->index->poolSize = store->pool_end;
+	if (msync(store->index, index_size(store->index->slotCount), MS_SYNC)) {
+		printf("Error: Cannot write to store \"%s\".\n", store->dirname);
+		goto exit;
+	}
+
+	memset(&header, 0, sizeof(header));
+	header.magic = STORE_MANIFEST_MAGIC;
+	header.version = STORE_VERSION;
+	header.chunkSize = STORE_CHUNK_SIZE;
+	header.size = job.size;
+	header.chunkCount = job.count;
+	header.checksum = job.size ? checksum32(job.data, job.size) : 0;
+	if (!store_write_manifest(store, name, &header, job.hashes)) {
+		printf("Error: Cannot write manifest of image \"%s\".\n", name);
+		goto exit;
+	}
+
+	if (stats) {
+		memset(stats, 0, sizeof(STORE_STATS));
+		stats->chunks = job.count;
+		stats->added = job.added;
+		stats->written = job.written;
+	}
+	retval = true;
+
+exit:
+	if (!retval) {
+		store_rollback(store);
+	}
+	free(job.hashes);
+	if (job.data != MAP_FAILED) {
+		munmap(job.data, job.size);
+	}
+	return retval;
+}
+
+// Load manifest of image 'name', hashes are allocated and must be freed.
+bool store_load_manifest(STORE *store, char *name, STORE_MANIFEST_HEADER *header, uint64_t (**hashes)[2]) {
+	char path[STORE_MAX_PATH];
+	FILE *file;
+
+	*hashes = NULL;
+	if (!store_name_valid(name) || !store_path(store, path, "manifests/%s", name)) {
+		return false;
+	}
+	file = fopen(path, "r");
+	if (!file) {
+		return false;
+	}
+
+	if ((fread(header, sizeof(STORE_MANIFEST_HEADER), 1, file) != 1) || (header->magic != STORE_MANIFEST_MAGIC) ||
+	    (header->version != STORE_VERSION) || (header->chunkSize != STORE_CHUNK_SIZE) ||
+	    (header->chunkCount != (header->size + STORE_CHUNK_SIZE - 1) / STORE_CHUNK_SIZE)) {
+		fclose(file);
+		return false;
+	}
+
+	*hashes = malloc((header->chunkCount ? header->chunkCount : 1) * sizeof(uint64_t) * 2);
+	if (!*hashes || (header->chunkCount && (fread(*hashes, sizeof(uint64_t) * 2, header->chunkCount, file) != header->chunkCount))) {
+		free(*hashes);
+		*hashes = NULL;
+		fclose(file);
+		return false;
+	}
+
+	fclose(file);
+	return true;
+}
+
+// Write image 'name' to 'fd' from offset 0. Chunks following each other in
+// pool are copied at once, in kernel.
+bool store_restore(STORE *store, char *name, int fd) {
+	STORE_MANIFEST_HEADER header;
+	uint64_t (*hashes)[2];
+	bool retval = false;
+
+	if (!store_load_manifest(store, name, &header, &hashes)) {
+		printf("Error: No image \"%s\" in store \"%s\".\n", name, store->dirname);
+		return false;
+	}
+
+	if (ftruncate(fd, 0)) {
+		goto write_error;
+	}
+	for (uint64_t i = 0; i < header.chunkCount;) {
+		STORE_SLOT *slot = index_find(store->index, hashes[i]);
+		uint64_t offset = slot->offset;
+		uint64_t length = slot->length;
+		uint64_t first = i;
+
+		if (slot->length == 0) {
+			printf("Error: Chunk %llu of image \"%s\" is missing in store.\n", (unsigned long long)i, name);
+			goto exit;
+		}
+		for (i++; i < header.chunkCount; i++) {
+			STORE_SLOT *next = index_find(store->index, hashes[i]);
+			if ((next->length == 0) || (next->offset != offset + length) || (length % STORE_CHUNK_SIZE)) {
+				break;
+			}
+			length += next->length;
+		}
+
+		if (!copy_file_part(store->pool_fd, offset, fd, first * STORE_CHUNK_SIZE, length)) {
+			goto write_error;
+		}
+	}
+
+	// read back, it must be the same as stored
+	uint8_t *buf = malloc(STORE_CHUNK_SIZE * 16);
+	CHECKSUM32 ctx;
+	if (!buf) {
+		printf("Error: Out of memory.\n");
+		goto exit;
+	}
+	checksum32_init(&ctx);
+	for (uint64_t pos = 0; pos < header.size;) {
+		ssize_t len = pread(fd, buf, STORE_CHUNK_SIZE * 16, pos);
+		if (len <= 0) {
+			break;
+		}
+		checksum32_update(&ctx, buf, len);
+		pos += len;
+	}
+	free(buf);
+	if (checksum32_final(&ctx) != header.checksum) {
+		printf("Error: Image \"%s\" checksum mismatch, store is damaged.\n", name);
+		goto exit;
+	}
+
+	retval = true;
+	goto exit;
+
+write_error:
+	printf("Error: Cannot write image \"%s\".\n", name);
+
+exit:
+	free(hashes);
+	return retval;
+}
+
+bool store_remove(STORE *store, char *name) {
+	char path[STORE_MAX_PATH];
+
+	if (!store_name_valid(name) || !store_path(store, path, "manifests/%s", name) || unlink(path)) {
+		printf("Error: No image \"%s\" in store \"%s\".\n", name, store->dirname);
+		return false;
+	}
+	return true;
+}
+
+static int slot_offset_compare(const void *a, const void *b) {
+	const STORE_SLOT *slot_a = a;
+	const STORE_SLOT *slot_b = b;
+
+	return (slot_a->offset > slot_b->offset) - (slot_a->offset < slot_b->offset);
+}
+
+// Drop chunks not used by any manifest. Live chunks are copied to new pool
+// in their original order and indexed in new index, which replaces the old
+// one atomically. Any unreadable manifest stops collection.
+bool store_gc(STORE *store, STORE_STATS *stats) {
+	char path[STORE_MAX_PATH];
+	char pool_path[STORE_MAX_PATH];
+	uint8_t *live = calloc(store->index->slotCount, 1);
+	STORE_SLOT *slots = index_slots(store->index);
+	STORE_SLOT *kept = NULL;
+	STORE_INDEX_HEADER *index = NULL;
+	uint32_t generation = store->index->generation + 1;
+	uint32_t slot_count = STORE_INITIAL_SLOTS;
+	uint32_t count = 0;
+	bool retval = false;
+	int pool_fd = -1;
+	DIR *dir;
+
+	if (!live) {
+		printf("Error: Out of memory.\n");
+		return false;
+	}
+
+	// mark
+	store_path(store, path, "manifests");
+	dir = opendir(path);
+	if (!dir) {
+		printf("Error: Cannot list store \"%s\".\n", store->dirname);
+		goto exit;
+	}
+	for (struct dirent *de; (de = readdir(dir));) {
+		STORE_MANIFEST_HEADER header;
+		uint64_t (*hashes)[2];
+
+		if (de->d_name[0] == '.') {
+			continue;
+		}
+		if (!store_load_manifest(store, de->d_name, &header, &hashes)) {
+			printf("Error: Manifest of image \"%s\" is broken, nothing collected.\n", de->d_name);
+			closedir(dir);
+			goto exit;
+		}
+		for (uint64_t i = 0; i < header.chunkCount; i++) {
+			STORE_SLOT *slot = index_find(store->index, hashes[i]);
+			if (slot->length != 0) {
+				live[slot - slots] = 1;
+			}
+		}
+		free(hashes);
+	}
+	closedir(dir);
+
+	// sweep
+	for (uint32_t i = 0; i < store->index->slotCount; i++) {
+		count += live[i];
+	}
+	kept = malloc((count ? count : 1) * sizeof(STORE_SLOT));
+	if (!kept) {
+		printf("Error: Out of memory.\n");
+		goto exit;
+	}
+	count = 0;
+	for (uint32_t i = 0; i < store->index->slotCount; i++) {
+		if (live[i]) {
+			kept[count++] = slots[i];
+		}
+	}
+	qsort(kept, count, sizeof(STORE_SLOT), slot_offset_compare);
+
+	while (((uint64_t)count + 1) * 4 > (uint64_t)slot_count * 3) {
+		slot_count *= 2;
+	}
+	store_path(store, pool_path, "pool.%u", generation);
+	store_path(store, path, "index.tmp");
+	pool_fd = open(pool_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	index = index_create(path, slot_count, generation);
+	if ((pool_fd < 0) || !index) {
+		printf("Error: Cannot write to store \"%s\".\n", store->dirname);
+		goto exit;
+	}
+
+	for (uint32_t i = 0; i < count;) {
+		uint64_t offset = kept[i].offset;
+		uint64_t length = 0;
+		uint64_t new_offset = index->poolSize;
+
+		// run of chunks following each other in old pool
+		for (; (i < count) && (kept[i].offset == offset + length); i++) {
+			STORE_SLOT *slot = index_find(index, kept[i].hash);
+			*slot = kept[i];
+			slot->offset = new_offset + length;
+			index->used++;
+			length += STORE_CHUNK_SIZE;
+		}
+		if (!copy_file_part(store->pool_fd, offset, pool_fd, new_offset, length)) {
+			printf("Error: Cannot write to store \"%s\".\n", store->dirname);
+			goto exit;
+		}
+		index->poolSize += length;
+	}
+
+	if (fdatasync(pool_fd) || msync(index, index_size(slot_count), MS_SYNC)) {
+		printf("Error: Cannot write to store \"%s\".\n", store->dirname);
+		goto exit;
+	}
+	char index_path[STORE_MAX_PATH];
+	store_path(store, index_path, "index");
+	if (rename(path, index_path)) {
+		printf("Error: Cannot write to store \"%s\".\n", store->dirname);
+		goto exit;
+	}
+
+	if (stats) {
+		memset(stats, 0, sizeof(STORE_STATS));
+		stats->chunks = count;
+		stats->removed = store->index->used - count;
+		stats->freed = store->index->poolSize - index->poolSize;
+	}
+
+	// old pool is not needed anymore
+	store_path(store, path, "pool.%u", store->index->generation);
+	unlink(path);
+	munmap(store->index, index_size(store->index->slotCount));
+	close(store->pool_fd);
+	store->index = index;
+	store->pool_fd = pool_fd;
+	store->pool_end = index->poolSize;
+	index = NULL;
+	pool_fd = -1;
+	retval = true;
+
+exit:
+	if (index) {
+		munmap(index, index_size(slot_count));
+		store_path(store, path, "index.tmp");
+		unlink(path);
+	}
+	if (pool_fd >= 0) {
+		close(pool_fd);
+		unlink(pool_path);
+	}
+	free(kept);
+	free(live);
+	return retval;
+}
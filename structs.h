@@ -226,6 +226,130 @@ typedef struct {
 	uint16_t		checksum;
 } FW_BREC;
 
+// ACTOS application (*.AP) header
+
+typedef struct {
+	uint8_t			file_type;		// 'P'
+	uint8_t			ap_type;		// 0:ap_system, 1:ap_user
+	char			magic[4];		// 0x57, 0x47, 0x19, 0x97
+	uint8_t			major_version;
+	uint8_t			minor_version;
+
+	uint32_t		text_offset;
+	uint16_t		text_length;
+	uint16_t		text_addr;
+
+	uint32_t		data_offset;
+	uint16_t		data_length;
+	uint16_t		data_addr;
+
+	uint16_t		bss_length;
+	uint16_t		bss_addr;
+
+	uint16_t		entry;
+	uint8_t			entry_bank;
+	uint8_t			banks;			// max 252
+} AP_HEAD;
+
+typedef struct {
+	uint32_t		offset;
+	uint16_t		length;
+	uint16_t		addr;
+} AP_BANK;
+
+typedef struct {
+	AP_HEAD			head;
+	AP_BANK			bank[252];
+} AP_FULLHEAD;
+
+// daemon protocol
+
+typedef enum {
+	DAEMON_CMD_READ = 1,			// read sectors from area, data in memfd
+	DAEMON_CMD_HEADER,			// firmware header at lba, data in memfd
+	DAEMON_CMD_SYSINFO,			// firmware sysinfo, data in memfd
+	DAEMON_CMD_DETACH			// detach device and forget it
+} DAEMON_CMD;
+
+typedef enum {
+	DAEMON_STATUS_OK = 0,
+	DAEMON_STATUS_BAD_REQUEST,
+	DAEMON_STATUS_NO_DEVICE,
+	DAEMON_STATUS_IO_ERROR,
+	DAEMON_STATUS_NO_MEMORY
+} DAEMON_STATUS;
+
+typedef struct {
+	uint32_t		magic;			// DAEMON_MAGIC
+	uint8_t			cmd;			// DAEMON_CMD
+	uint8_t			area;			// DEVICE_AREA for DAEMON_CMD_READ
+	uint8_t			lun;
+	uint8_t			reserved;
+	uint16_t		vendorId;		// 0000:0000 - device from command line
+	uint16_t		productId;
+	uint32_t		lba;			// in sectors
+	uint32_t		count;			// in sectors
+} DAEMON_REQUEST;
+
+typedef struct {
+	uint32_t		magic;			// DAEMON_MAGIC
+	uint32_t		status;			// DAEMON_STATUS
+	uint32_t		length;			// data length in passed memfd, 0 - no fd
+} DAEMON_RESPONSE;
+
+// RAM watch log: header, region table and change records, each followed
+// by its data
+
+typedef struct {
+	uint32_t		magic;			// WATCH_MAGIC
+	uint16_t		version;		// WATCH_VERSION
+	uint16_t		regionCount;
+	uint64_t		startTime;		// CLOCK_REALTIME in ns
+} WATCH_LOG_HEADER;
+
+typedef struct {
+	uint32_t		address;		// in bytes
+	uint32_t		length;			// in bytes
+} WATCH_REGION;
+
+typedef struct {
+	uint64_t		time;			// ns since start
+	uint32_t		sample;			// 0 - initial contents
+	uint32_t		address;		// in bytes
+	uint16_t		length;			// changed bytes following
+} WATCH_RECORD;
+
+// Content addressed store: index file is header followed by hash table
+// slots, manifest is header followed by hash of each image chunk
+
+typedef struct {
+	uint32_t		magic;			// STORE_MAGIC
+	uint16_t		version;		// STORE_VERSION
+	uint16_t		reserved;
+	uint32_t		chunkSize;		// STORE_CHUNK_SIZE
+	uint32_t		generation;		// pool file is "pool.GENERATION"
+	uint32_t		slotCount;		// power of 2
+	uint32_t		used;			// slots used
+	uint64_t		poolSize;		// pool bytes surely written
+} STORE_INDEX_HEADER;
+
+typedef struct {
+	uint64_t		hash[2];
+	uint64_t		offset;			// in pool
+	uint32_t		length;			// 0 - empty slot
+	uint32_t		reserved;
+} STORE_SLOT;
+
+typedef struct {
+	uint32_t		magic;			// STORE_MANIFEST_MAGIC
+	uint16_t		version;		// STORE_VERSION
+	uint16_t		reserved;
+	uint32_t		chunkSize;		// STORE_CHUNK_SIZE
+	uint32_t		checksum;		// checksum32 of whole image
+	uint64_t		size;			// image bytes
+	uint64_t		chunkCount;
+} STORE_MANIFEST_HEADER;
+
 #pragma pack()
 
 #endif
@@ -1,9 +1,16 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <string.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <iconv.h>
 #include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
 
 #include "usbfw.h"
 
@@ -16,34 +23,6 @@ void dbg_printf(char* format, ...) {
 }
 #endif
 
-// expected format is XXXX:XXXX where X is hex digit
-bool parse_devid(char *devstring) {
-	char *product;
-	uint32_t vid, pid;
-
-	if (!devstring) {
-		return false;
-	}
-
-
-	product = strchr(devstring, ':');
-	if (!product) {
-		return false;
-	}
-
-	vid = strtoul(devstring, NULL, 16);
-	pid = strtoul(++product, NULL, 16);
-
-	if ((vid > 0xFFFF) || (pid > 0xFFFF)) {
-		return false;
-	}
-
-	app.vid = (uint16_t)(vid & 0xFFFF);
-	app.pid = (uint16_t)(pid & 0XFFFF);
-	app.is_dev = true;
-	return true;
-}
-
 char * decode_pdt(uint8_t pdt) {
 	switch (pdt) {
 		case 0x00:
@@ -77,7 +56,7 @@ char * decode_fcapacity(uint8_t desc) {
 }
 
 char * humanize_size(uint64_t size) {
-	static char size_buffer[32];
+	static __thread char size_buffer[32];
 	double dsize = (double)size;
 
 	if (size < 1024L) {
@@ -106,7 +85,7 @@ char * humanize_size(uint64_t size) {
 
 
 char * covert_usb_string_descriptor(uint8_t *src, uint32_t length) {
-	static char buf[256];
+	static __thread char buf[256];
 	char *bufoutptr = buf;
 	char *bufinptr = (char *)src;
 	size_t bufinlen = length;
@@ -120,7 +99,7 @@ char * covert_usb_string_descriptor(uint8_t *src, uint32_t length) {
 }
 
 char * convert_mtp_serial(uint8_t serial[16]) {
-	static char buf[33];
+	static __thread char buf[33];
 	char digit;
 
 	for (uint32_t i = 0; i < 16; i++) {
@@ -207,7 +186,7 @@ char * decode_mtpformat(uint8_t mtpformat) {
 }
 
 char * make_filename(char filename[11]) {
-	static char outname[13];
+	static __thread char outname[13];
 	uint32_t i = 0;
 
 	memset(outname, ' ', sizeof(outname));
@@ -233,12 +212,13 @@ char * make_filename(char filename[11]) {
 }
 
 char * make_date(uint32_t actions_time) {
-	static char str[200];
+	static __thread char str[200];
 	time_t time;
+	struct tm tm;
 	struct tm *gmt;
 
 	time = (time_t)(actions_time >> 1); // action_time has 0.5 s resolution
-	gmt = gmtime(&time);
+	gmt = gmtime_r(&time, &tm);
 	if (!gmt) {
 		strcpy(str, "Wrong date");
 	} else if (!strftime(str, sizeof(str), "%Y-%m-%d %H:%M:%S GMT", gmt)) {
@@ -248,85 +228,80 @@ char * make_date(uint32_t actions_time) {
 	return str;
 }
 
-void display_spinner(void) {
-	char spinner[4] = "|/-\\";
-	static int i = 0;
-
-	printf("\b%c", spinner[i++]);
-	fflush(stdout);
-	if (i > 3) {
-		i = 0;
-	}
-}
-
-void display_percent_spinner(uint32_t current, uint32_t max) {
-	char spinner[4] = "|/-\\";
-	static int i = 0;
-	uint32_t percent = 0;
-
-	// avoid strange values
-	if (current > max) {
-		percent = 0;
-	} else {
-		percent = ((uint64_t)current) * 100 / max;
-	}
-
-	// place for digits
-	printf("\b\b\b\b\b%2u%% %c", percent, spinner[i++]);
-	fflush(stdout);
-	if (i > 3) {
-		i = 0;
+// copy part of one file into another, in kernel (reflink on supporting
+// filesystems) when possible
+bool copy_file_part(int in_fd, off_t in_off, int out_fd, off_t out_off, uint64_t len) {
+	uint8_t buf[0x10000];
+	struct stat st;
+
+	// whole blocks are shared when both offsets are block aligned, rest is
+	// copied
+	if (!fstat(out_fd, &st) && (st.st_blksize > 0) && !(in_off % st.st_blksize) && !(out_off % st.st_blksize) && (len >= st.st_blksize)) {
+		struct file_clone_range clone = {
+			.src_fd = in_fd,
+			.src_offset = in_off,
+			.src_length = len - (len % st.st_blksize),
+			.dest_offset = out_off
+		};
+		if (!ioctl(out_fd, FICLONERANGE, &clone)) {
+			in_off += clone.src_length;
+			out_off += clone.src_length;
+			len -= clone.src_length;
+		}
 	}
-}
 
+	while (len) {
+		ssize_t done = copy_file_range(in_fd, &in_off, out_fd, &out_off, len, 0);
+		if (done > 0) {
+			len -= done;
+			continue;
+		} else if (done == 0) {
+			return false;
+		} else if ((errno != EXDEV) && (errno != ENOSYS) && (errno != EINVAL) && (errno != EOPNOTSUPP)) {
+			return false;
+		}
 
-bool confirm(void) {
-	if (!app.is_yesiknow) {
-		printf("You have run "COLOR_RED"DANGEROUS"COLOR_DEFAULT" command!\nYou must confirm you action with adding param \"--yes-i-know-what-im-doing\".\n");
-		return false;
+		// fallback through user space
+		size_t part = (len < sizeof(buf)) ? len : sizeof(buf);
+		if ((pread(in_fd, buf, part, in_off) != (ssize_t)part) || (pwrite(out_fd, buf, part, out_off) != (ssize_t)part)) {
+			return false;
+		}
+		in_off += part;
+		out_off += part;
+		len -= part;
 	}
 
 	return true;
 }
 
-//size is in bytes
-uint16_t checksum16(uint16_t *data, uint32_t size, bool is_new) {
-	static uint16_t checksum;
-
-	if (size & 0x1) {
-		dbg_printf("Checksum 16 data not aligned.\n");
+// CSV field, quoted only when needed
+void print_csv_string(FILE *out, const char *str) {
+	if (!strpbrk(str, ",\"\r\n")) {
+		fputs(str, out);
+		return;
 	}
 
-	size >>= 1;
-
-	if (is_new) {
-		checksum = 0;
-	}
-
-	for (uint32_t i = 0; i < size; i++) {
-		checksum += data[i];
+	fputc('"', out);
+	for (; *str; str++) {
+		if (*str == '"') {
+			fputc('"', out);
+		}
+		fputc(*str, out);
 	}
-
-	return checksum;
+	fputc('"', out);
 }
 
-//size is in bytes
-uint32_t checksum32(uint32_t *data, uint32_t size, bool is_new) {
-	static uint32_t checksum;
-
-	if (size & 0x3) {
-		dbg_printf("Checksum 32 data not aligned.\n");
-	}
-
-	size >>= 2;
-
-	if (is_new) {
-		checksum = 0;
-	}
-
-	for (uint32_t i = 0; i < size; i++) {
-		checksum += data[i];
+void print_json_string(FILE *out, const char *str) {
+	fputc('"', out);
+	for (; *str; str++) {
+		uint8_t c = *str;
+		if ((c == '"') || (c == '\\')) {
+			fprintf(out, "\\%c", c);
+		} else if (c < 0x20) {
+			fprintf(out, "\\u%04x", c);
+		} else {
+			fputc(c, out);
+		}
 	}
-
-	return checksum;
+	fputc('"', out);
 }
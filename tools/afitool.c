@@ -0,0 +1,641 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <libgen.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "../usbfw.h"
+
+#define		AFITOOL_LIST		"afi.lst"	// entries order and attributes for pack
+#define		AFITOOL_MAX_THREADS	64
+#define		AFITOOL_BUFFER		0x100000
+
+typedef struct {
+	char			*filename;
+	int			fd;
+	uint8_t			*data;
+	size_t			size;
+	FW_AFI_HEADER		*header;
+} AFI_MAP;
+
+typedef struct {
+	char			**files;
+	uint32_t		count;
+	uint32_t		next;		// next file to verify, taken atomically
+	uint32_t		failed;		// files failing verification
+	pthread_mutex_t		print_lock;	// keeps report of one file together
+} VERIFY_JOB;
+
+
+void usage(char *app) {
+	printf("Usage:\n");
+	printf("\t%s info AFI_FILE\n", app);
+	printf("\t%s verify [-j THREADS] AFI_FILE...\n", app);
+	printf("\t%s extract AFI_FILE [DIR]\n", app);
+	printf("\t%s pack DIR AFI_FILE\n", app);
+	printf("\t%s convert RAW_FW BREC SYSINFO VVVV:PPPP AFI_FILE\n\n", app);
+	printf("Extract writes every entry to DIR (default current one) and list of entries\n");
+	printf("with their attributes to DIR/%s. Pack builds AFI from files listed there.\n", AFITOOL_LIST);
+	printf("Convert makes from RAW main firmware dump (or AFI containing one), bootrecord\n");
+	printf("and sysinfo the same AFI as usbfw AFI dump of device VVVV:PPPP would be.\n\n");
+}
+
+// 8.3 name without padding, safe as file name
+static char * entry_name(FW_AFI_DIR_ENTRY *entry) {
+	char *name = make_filename(entry->filename);
+
+	for (int32_t i = strlen(name) - 1; (i >= 0) && ((name[i] == ' ') || (name[i] == '.')); i--) {
+		name[i] = 0;
+	}
+	for (char *c = name; *c; c++) {
+		if (*c == '/') {
+			*c = '_';
+		}
+	}
+
+	return name;
+}
+
+static bool afi_map(AFI_MAP *map, char *filename, bool is_quiet) {
+	struct stat st;
+
+	map->filename = filename;
+	map->data = MAP_FAILED;
+	map->fd = open(filename, O_RDONLY);
+	if ((map->fd < 0) || fstat(map->fd, &st)) {
+		if (!is_quiet) {
+			printf("Error: Cannot open file \"%s\".\n", filename);
+		}
+		goto error;
+	}
+
+	map->size = st.st_size;
+	if (map->size < sizeof(FW_AFI_HEADER)) {
+		if (!is_quiet) {
+			printf("Error: File \"%s\" is too small to be AFI.\n", filename);
+		}
+		goto error;
+	}
+
+	map->data = mmap(NULL, map->size, PROT_READ, MAP_PRIVATE, map->fd, 0);
+	if (map->data == MAP_FAILED) {
+		if (!is_quiet) {
+			printf("Error: Cannot map file \"%s\".\n", filename);
+		}
+		goto error;
+	}
+	// whole file is read once in order
+	madvise(map->data, map->size, MADV_SEQUENTIAL);
+	madvise(map->data, map->size, MADV_WILLNEED);
+
+	map->header = (FW_AFI_HEADER *)map->data;
+	return true;
+
+error:
+	if (map->fd >= 0) {
+		close(map->fd);
+	}
+	return false;
+}
+
+static void afi_unmap(AFI_MAP *map) {
+	munmap(map->data, map->size);
+	close(map->fd);
+}
+
+static bool is_entry_used(FW_AFI_DIR_ENTRY *entry) {
+	return entry->filename[0] != 0;
+}
+
+static bool is_entry_inside(AFI_MAP *map, FW_AFI_DIR_ENTRY *entry) {
+	return (uint64_t)entry->offset + entry->length <= map->size;
+}
+
+// Check header and all entries, problems are written to 'report'. Returns
+// count of problems.
+static uint32_t afi_check(AFI_MAP *map, char *report, size_t size) {
+	FW_AFI_HEADER *header = map->header;
+	uint32_t errors = 0;
+	int len = 0;
+
+	if (memcmp(header->magic, "AFI", 3)) {
+		snprintf(report, size, "    not AFI file\n");
+		return 1;
+	}
+
+	uint32_t checksum = checksum32(header, sizeof(FW_AFI_HEADER) - sizeof(uint32_t));
+	if (checksum != header->checksum) {
+		len += snprintf(report + len, size - len, "    header checksum 0x%08X, should be 0x%08X\n", header->checksum, checksum);
+		errors++;
+	}
+
+	for (uint32_t i = 0; (i < 126) && (len < size); i++) {
+		FW_AFI_DIR_ENTRY *entry = &header->diritem[i];
+
+		if (!is_entry_used(entry)) {
+			continue;
+		}
+		if (!is_entry_inside(map, entry)) {
+			len += snprintf(report + len, size - len, "    %-12s past end of file\n", entry_name(entry));
+			errors++;
+			continue;
+		}
+
+		checksum = checksum32(map->data + entry->offset, entry->length);
+		if (checksum != entry->checksum) {
+			len += snprintf(report + len, size - len, "    %-12s checksum 0x%08X, should be 0x%08X\n", entry_name(entry), entry->checksum, checksum);
+			errors++;
+		}
+	}
+
+	return errors;
+}
+
+static int afitool_info(char *filename) {
+	AFI_MAP map;
+	char report[4096] = "";
+
+	if (!afi_map(&map, filename, false)) {
+		return 1;
+	}
+
+	FW_AFI_HEADER *header = map.header;
+	uint32_t errors = afi_check(&map, report, sizeof(report));
+
+	printf("\n    AFI HEADER INFORMATION:\n");
+	printf("    -----------------------\n\n");
+	printf("                 Magic : %.3s\n", header->magic);
+	printf("     Vendor:Product ID : %04hX:%04hX\n", header->vendorId, header->productId);
+	printf("               Version : %02hhX %02hhX %02hhX %02hhX\n", header->version[0], header->version[1], header->version[2], header->version[3]);
+	printf("                  Date : %02hhX %02hhX %02hhX %02hhX\n", header->date[0], header->date[1], header->date[2], header->date[3]);
+	printf("              Checksum : 0x%08X\n", header->checksum);
+
+	printf("\n\n    ENTRIES:\n");
+	printf("    --------\n\n");
+	printf("    Name         Type  Download  Offset      Length      Checksum\n");
+	for (uint32_t i = 0; i < 126; i++) {
+		FW_AFI_DIR_ENTRY *entry = &header->diritem[i];
+
+		if (is_entry_used(entry)) {
+			printf("    %-12s  '%c'  0x%08X  0x%08X  0x%08X  0x%08X\n", entry_name(entry), entry->type, entry->downloadAddr, entry->offset, entry->length, entry->checksum);
+		}
+	}
+
+	printf("\n    %s\n%s\n", errors ? "VERIFICATION FAILED:" : "Verification OK.", report);
+
+	afi_unmap(&map);
+	return errors ? 1 : 0;
+}
+
+static void * verify_thread(void *data) {
+	VERIFY_JOB *job = data;
+	char report[4096];
+
+	while (true) {
+		uint32_t i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+		AFI_MAP map;
+		uint32_t errors;
+
+		if (i >= job->count) {
+			break;
+		}
+
+		report[0] = 0;
+		if (afi_map(&map, job->files[i], true)) {
+			errors = afi_check(&map, report, sizeof(report));
+			afi_unmap(&map);
+		} else {
+			snprintf(report, sizeof(report), "    cannot open or map\n");
+			errors = 1;
+		}
+
+		pthread_mutex_lock(&job->print_lock);
+		printf("%s: %s\n%s", job->files[i], errors ? "FAILED" : "OK", report);
+		pthread_mutex_unlock(&job->print_lock);
+
+		if (errors) {
+			__atomic_fetch_add(&job->failed, 1, __ATOMIC_RELAXED);
+		}
+	}
+
+	return NULL;
+}
+
+// files are spread over threads, each file is checked by one of them
+static int afitool_verify(char **files, uint32_t count, uint32_t threads) {
+	pthread_t thread[AFITOOL_MAX_THREADS];
+	VERIFY_JOB job = {
+		.files = files,
+		.count = count,
+		.next = 0,
+		.failed = 0
+	};
+	uint32_t started = 0;
+
+	if (threads == 0) {
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if (threads > AFITOOL_MAX_THREADS) {
+		threads = AFITOOL_MAX_THREADS;
+	}
+	if (threads > count) {
+		threads = count;
+	}
+
+	pthread_mutex_init(&job.print_lock, NULL);
+	for (uint32_t i = 1; i < threads; i++) {
+		if (pthread_create(&thread[started], NULL, verify_thread, &job)) {
+			break;
+		}
+		started++;
+	}
+	verify_thread(&job);
+	for (uint32_t i = 0; i < started; i++) {
+		pthread_join(thread[i], NULL);
+	}
+	pthread_mutex_destroy(&job.print_lock);
+
+	printf("\n%u file(s) verified, %u failed.\n", count, job.failed);
+	return job.failed ? 1 : 0;
+}
+
+static int afitool_extract(char *filename, char *dir) {
+	AFI_MAP map;
+	char path[4096];
+	int retval = 1;
+	FILE *list = NULL;
+
+	if (!afi_map(&map, filename, false)) {
+		return 1;
+	}
+
+	FW_AFI_HEADER *header = map.header;
+	if (memcmp(header->magic, "AFI", 3)) {
+		printf("Error: File \"%s\" isn't AFI file.\n", filename);
+		goto exit;
+	}
+
+	if (mkdir(dir, 0755) && (errno != EEXIST)) {
+		printf("Error: Cannot create directory \"%s\".\n", dir);
+		goto exit;
+	}
+
+	snprintf(path, sizeof(path), "%s/%s", dir, AFITOOL_LIST);
+	list = fopen(path, "w");
+	if (!list) {
+		printf("Error: Cannot open file \"%s\".\n", path);
+		goto exit;
+	}
+	fprintf(list, "# afitool entry list: NAME TYPE DOWNLOAD_ADDR SUBTYPE\n");
+	fprintf(list, "header %04hX:%04hX %02hhX%02hhX%02hhX%02hhX %02hhX%02hhX%02hhX%02hhX\n", header->vendorId, header->productId,
+	        header->version[0], header->version[1], header->version[2], header->version[3], header->date[0], header->date[1], header->date[2], header->date[3]);
+
+	for (uint32_t i = 0; i < 126; i++) {
+		FW_AFI_DIR_ENTRY *entry = &header->diritem[i];
+
+		if (!is_entry_used(entry)) {
+			continue;
+		}
+		if (!is_entry_inside(&map, entry)) {
+			printf("Error: Entry \"%s\" lies past end of file.\n", entry_name(entry));
+			goto exit;
+		}
+
+		snprintf(path, sizeof(path), "%s/%s", dir, entry_name(entry));
+		int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0) {
+			printf("Error: Cannot open file \"%s\".\n", path);
+			goto exit;
+		}
+		// in kernel copy, reflink where filesystem allows
+		bool is_copied = copy_file_part(map.fd, entry->offset, fd, 0, entry->length);
+		if (close(fd) || !is_copied) {
+			printf("Error: Cannot write file \"%s\".\n", path);
+			goto exit;
+		}
+
+		fprintf(list, "%s 0x%02hhX 0x%08X %02hhX%02hhX%02hhX%02hhX\n", entry_name(entry), entry->type, entry->downloadAddr,
+		        entry->subtype[0], entry->subtype[1], entry->subtype[2], entry->subtype[3]);
+		printf("%-12s 0x%08X bytes extracted.\n", entry_name(entry), entry->length);
+	}
+	retval = 0;
+
+exit:
+	if (list && fclose(list)) {
+		printf("Error: Cannot write file \"%s/%s\".\n", dir, AFITOOL_LIST);
+		retval = 1;
+	}
+	afi_unmap(&map);
+	return retval;
+}
+
+static void parse_bytes(char *str, uint8_t *bytes, uint32_t count) {
+	uint32_t value = strtoul(str, NULL, 16);
+
+	for (uint32_t i = 0; i < count; i++) {
+		bytes[i] = value >> (8 * (count - 1 - i));
+	}
+}
+
+// 8.3 name into space padded directory form
+static bool parse_entry_name(char *name, char filename[11]) {
+	char *dot = strrchr(name, '.');
+	size_t base_len = dot ? (size_t)(dot - name) : strlen(name);
+	size_t ext_len = dot ? strlen(dot + 1) : 0;
+
+	if ((base_len == 0) || (base_len > 8) || (ext_len > 3)) {
+		return false;
+	}
+	memset(filename, ' ', 11);
+	memcpy(filename, name, base_len);
+	if (dot) {
+		memcpy(filename + 8, dot + 1, ext_len);
+	}
+	return true;
+}
+
+// entries are streamed one after another in list order
+static int afitool_pack(char *dir, char *filename) {
+	char path[4096];
+	char line[1024];
+	uint8_t *buf = NULL;
+	AFI_CONTEXT afi = { .file = NULL };
+	bool is_header = false;
+	bool is_created = false;
+	int retval = 1;
+	FILE *list;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, AFITOOL_LIST);
+	list = fopen(path, "r");
+	if (!list) {
+		printf("Error: Cannot open file \"%s\".\n", path);
+		return 1;
+	}
+
+	buf = malloc(AFITOOL_BUFFER);
+	if (!buf) {
+		printf("Error: Out of memory.\n");
+		goto exit;
+	}
+
+	for (uint32_t line_no = 1; fgets(line, sizeof(line), list); line_no++) {
+		char name[256], type[16], daddr[16], extra[16];
+		FW_AFI_DIR_ENTRY entry;
+
+		if ((line[0] == '#') || (line[0] == '\n')) {
+			continue;
+		}
+		if (sscanf(line, "%255s %15s %15s %15s", name, type, daddr, extra) != 4) {
+			printf("Error: Wrong line %u in \"%s/%s\".\n", line_no, dir, AFITOOL_LIST);
+			goto exit;
+		}
+
+		if (!is_header) {
+			uint32_t vid, pid;
+
+			if (strcmp(name, "header") || (sscanf(type, "%x:%x", &vid, &pid) != 2)) {
+				printf("Error: List \"%s/%s\" must start with header line.\n", dir, AFITOOL_LIST);
+				goto exit;
+			}
+			if (!afi_new_file(&afi, filename, vid, pid)) {
+				printf("Error: Cannot open output file \"%s\".\n", filename);
+				goto exit;
+			}
+			is_created = true;
+			// header stays in memory until close, so it may be completed now
+			parse_bytes(daddr, afi.header.version, 4);
+			parse_bytes(extra, afi.header.date, 4);
+			is_header = true;
+			continue;
+		}
+
+		memset(&entry, 0, sizeof(entry));
+		if (!parse_entry_name(name, entry.filename)) {
+			printf("Error: \"%s\" isn't 8.3 file name.\n", name);
+			goto exit;
+		}
+		entry.type = strtoul(type, NULL, 0);
+		entry.downloadAddr = strtoul(daddr, NULL, 0);
+		parse_bytes(extra, entry.subtype, 4);
+
+		snprintf(path, sizeof(path), "%s/%s", dir, name);
+		int fd = open(path, O_RDONLY);
+		if (fd < 0) {
+			printf("Error: Cannot open file \"%s\".\n", path);
+			goto exit;
+		}
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+		ssize_t len;
+		afi_entry_begin(&afi, &entry);
+		while ((len = read(fd, buf, AFITOOL_BUFFER)) > 0) {
+			if (!afi_entry_write(&afi, buf, len)) {
+				break;
+			}
+		}
+		close(fd);
+		if (len != 0) {
+			printf("Error: Cannot copy file \"%s\".\n", path);
+			goto exit;
+		}
+		if (!afi_entry_end(&afi, &entry)) {
+			goto exit;
+		}
+		printf("%-12s 0x%08X bytes packed.\n", name, entry.length);
+	}
+
+	if (!is_header) {
+		printf("Error: List \"%s/%s\" is empty.\n", dir, AFITOOL_LIST);
+		goto exit;
+	}
+	if (!afi_close(&afi)) {
+		printf("Error: Cannot write to output file \"%s\".\n", filename);
+		goto exit;
+	}
+	printf("AFI file \"%s\" ready.\n", filename);
+	retval = 0;
+
+exit:
+	// incomplete output must not look like valid AFI
+	if (retval) {
+		afi_abort(&afi);
+		if (is_created) {
+			unlink(filename);
+		}
+	}
+	free(buf);
+	fclose(list);
+	return retval;
+}
+
+static bool read_whole(char *filename, void *buf, size_t size) {
+	struct stat st;
+	bool retval;
+
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		printf("Error: Cannot open file \"%s\".\n", filename);
+		return false;
+	}
+	retval = !fstat(fd, &st) && (st.st_size == size) && (read(fd, buf, size) == size);
+	close(fd);
+
+	if (!retval) {
+		printf("Error: File \"%s\" should have exactly %zu bytes.\n", filename, size);
+	}
+	return retval;
+}
+
+// Same entries as in usbfw AFI dump. Main firmware is shared with RAW file
+// (or copied in kernel) and only read through mapping for its checksum.
+static int afitool_convert(char *raw_filename, char *brec_filename, char *sysinfo_filename, char *devid, char *filename) {
+	AFI_CONTEXT afi = { .file = NULL };
+	FW_AFI_DIR_ENTRY dir_entry;
+	FW_HEADER fw_header;
+	FW_BREC fw_brec;
+	FW_SYSINFO sysinfo;
+	uint32_t vid, pid;
+	struct stat st;
+	uint8_t *raw = MAP_FAILED;
+	off_t base;
+	bool is_created = false;
+	int retval = 1;
+
+	if ((sscanf(devid, "%x:%x", &vid, &pid) != 2) || (vid > 0xFFFF) || (pid > 0xFFFF)) {
+		printf("Error: Device ID must be in VVVV:PPPP format.\n");
+		return 1;
+	}
+
+	if (!read_whole(brec_filename, &fw_brec, sizeof(FW_BREC)) || !read_whole(sysinfo_filename, &sysinfo, sizeof(FW_SYSINFO))) {
+		return 1;
+	}
+	if (memcmp(&sysinfo, "SYS INFO", 8)) {
+		printf("Error: File \"%s\" isn't sysinfo.\n", sysinfo_filename);
+		return 1;
+	}
+
+	int fd = open(raw_filename, O_RDONLY);
+	if ((fd < 0) || fstat(fd, &st)) {
+		printf("Error: Cannot open file \"%s\".\n", raw_filename);
+		goto exit;
+	}
+	if (!load_fw_image_header(fd, &base, &fw_header)) {
+		printf("Error: No main firmware found in \"%s\".\n", raw_filename);
+		goto exit;
+	}
+	uint64_t length = (uint64_t)get_fw_size(&fw_header) * SECTOR_SIZE;
+	if (base + length > st.st_size) {
+		printf("Error: Main firmware in \"%s\" is truncated.\n", raw_filename);
+		goto exit;
+	}
+
+	if (!afi_new_file(&afi, filename, vid, pid)) {
+		printf("Error: Cannot open output file \"%s\".\n", filename);
+		goto exit;
+	}
+	is_created = true;
+
+	memset(&dir_entry, 0, sizeof(FW_AFI_DIR_ENTRY));
+	memcpy(dir_entry.filename, "BREC    BIN", 11);
+	memcpy(&dir_entry.filename[4], fw_brec.type, 4);
+	dir_entry.type = 'B';
+	dir_entry.downloadAddr = AFI_DADDR_B;
+	dir_entry.length = sizeof(FW_BREC);
+	if (!afi_add_whole(&afi, &dir_entry, (uint8_t *)&fw_brec)) {
+		goto write_error;
+	}
+
+	off_t out_base = afi_append_base(&afi);
+	if ((out_base < 0) || !copy_file_part(fd, base, fileno(afi.file), out_base, length)) {
+		goto write_error;
+	}
+
+	raw = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (raw == MAP_FAILED) {
+		printf("Error: Cannot map file \"%s\".\n", raw_filename);
+		goto exit;
+	}
+	madvise(raw + base, length, MADV_SEQUENTIAL);
+
+	memset(&dir_entry, 0, sizeof(FW_AFI_DIR_ENTRY));
+	memcpy(dir_entry.filename, "FWIMAGE FW ", 11);
+	dir_entry.type = 'I';
+	dir_entry.downloadAddr = AFI_DADDR_I;
+	dir_entry.length = length;
+	dir_entry.checksum = checksum32(raw + base, length);
+	if (!afi_add_appended(&afi, &dir_entry)) {
+		goto write_error;
+	}
+
+	memset(&dir_entry, 0, sizeof(FW_AFI_DIR_ENTRY));
+	memcpy(dir_entry.filename, "SYSINFO BIN", 11);
+	dir_entry.type = ' ';
+	dir_entry.length = sizeof(FW_SYSINFO);
+	if (!afi_add_whole(&afi, &dir_entry, (uint8_t *)&sysinfo) || !afi_close(&afi)) {
+		goto write_error;
+	}
+
+	printf("AFI file \"%s\" ready.\n", filename);
+	retval = 0;
+	goto exit;
+
+write_error:
+	printf("Error: Cannot write to output file \"%s\".\n", filename);
+
+exit:
+	// incomplete output must not look like valid AFI
+	if (retval) {
+		afi_abort(&afi);
+		if (is_created) {
+			unlink(filename);
+		}
+	}
+	if (raw != MAP_FAILED) {
+		munmap(raw, st.st_size);
+	}
+	if (fd >= 0) {
+		close(fd);
+	}
+	return retval;
+}
+
+int main(int argc, char *argv[]) {
+	char *app = basename(argv[0]);
+
+	if (argc < 3) {
+		usage(app);
+		return -1;
+	}
+
+	if (!strcmp(argv[1], "info") && (argc == 3)) {
+		return afitool_info(argv[2]);
+	} else if (!strcmp(argv[1], "verify")) {
+		uint32_t threads = 0;
+		int first = 2;
+
+		if (!strcmp(argv[2], "-j")) {
+			if (argc < 5) {
+				usage(app);
+				return -1;
+			}
+			threads = strtoul(argv[3], NULL, 0);
+			first = 4;
+		}
+		return afitool_verify(&argv[first], argc - first, threads);
+	} else if (!strcmp(argv[1], "extract") && (argc <= 4)) {
+		return afitool_extract(argv[2], (argc == 4) ? argv[3] : ".");
+	} else if (!strcmp(argv[1], "pack") && (argc == 4)) {
+		return afitool_pack(argv[2], argv[3]);
+	} else if (!strcmp(argv[1], "convert") && (argc == 7)) {
+		return afitool_convert(argv[2], argv[3], argv[4], argv[5], argv[6]);
+	}
+
+	usage(app);
+	return -1;
+}
@@ -1,57 +1,36 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <getopt.h>
+#include <fnmatch.h>
 #include <libgen.h>
 
-#pragma pack(1)
-
-typedef struct {
-	uint8_t			file_type;		// 'P'
-	uint8_t			ap_type;		// 0:ap_system, 1:ap_user
-	char			magic[4];		// 0x57, 0x47, 0x19, 0x97
-	uint8_t			major_version;
-	uint8_t			minor_version;
-
-	uint32_t		text_offset;
-	uint16_t		text_length;
-	uint16_t		text_addr;
-
-	uint32_t		data_offset;
-	uint16_t		data_length;
-	uint16_t		data_addr;
-
-	uint16_t		bss_length;
-	uint16_t		bss_addr;
-
-	uint16_t		entry;
-	uint8_t			entry_bank;
-	uint8_t			banks;			// max 252
-} AP_HEAD;
-
-
-typedef struct {
-	uint32_t		offset;
-	uint16_t		length;
-	uint16_t		addr;
-} AP_BANK;
-
+#include "../usbfw.h"
 
 typedef struct {
-	AP_HEAD			head;
-	AP_BANK			bank[252];
-} AP_FULLHEAD;
+	OUTPUT_FORMAT		format;
+	bool			is_named;	// text of plain file starts with its name
+} APINFO_OPTIONS;
 
-#pragma pack()
-
-char magic[4] = { 0x57, 0x47, 0x19, 0x97 };
-
-FILE *apfile;
-AP_FULLHEAD ap_header;
+struct option longopt[] = {
+	{"csv", 0, NULL, 'c'},
+	{"json", 0, NULL, 'J'},
+	{"threads", 1, NULL, 'j'},
+	{NULL, 0, NULL, 0}
+};
 
 
 void usage(char *app) {
-	printf("Usage:\n\t%s AP_FILE\n\n", app);
+	printf("Usage:\n\t%s [--csv | --json] [-j THREADS] FILE|DIR|GLOB...\n\n", app);
+	printf("FILE is ACTOS application or RAW or AFI firmware image, whose *.AP directory\n");
+	printf("files are analysed in place. Directories are searched recursively and\n");
+	printf("files are processed in parallel.\n");
+	printf("With --csv or --json one record per file is printed, JSON as one object per\n");
+	printf("line.\n\n");
 }
 
 char * decode_ap_type(uint8_t ap_type) {
@@ -65,59 +44,184 @@ char * decode_ap_type(uint8_t ap_type) {
 	}
 }
 
-int main(int argc, char *argv[]) {
+static void ap_print_text(FILE *out, char *name, AP_FULLHEAD *ap_header, char *error) {
 	bool is_bank = false;
 
-	if (argc < 2) {
-		usage(basename(argv[0]));
-		return -1;
+	if (error) {
+		fprintf(out, "Error: File \"%s\" isn't proper ACTOS application (%s).\n\n", name, error);
 	}
 
-	apfile = fopen(argv[1], "r");
-	if (!apfile) {
-		printf("Error: Cannot open file \"%s\".\n\n", argv[1]);
-		return 0;
-	}
+	fprintf(out, "\n    HEADER INFORMATION:\n");
+	fprintf(out, "    -------------------\n\n");
+	fprintf(out, "             File Type : %c\n", ap_header->head.file_type);
+	fprintf(out, "      Application Type : 0x%02hhX (%s)\n", ap_header->head.ap_type, decode_ap_type(ap_header->head.ap_type));
+	fprintf(out, "         ACTOS Version : %hhu.%hhu\n", ap_header->head.major_version, ap_header->head.minor_version);
+	fprintf(out, "   TEXT Segment Offset : 0x%08X\n", ap_header->head.text_offset);
+	fprintf(out, "                Length : 0x%04hX\n", ap_header->head.text_length);
+	fprintf(out, "               Address : 0x%04hX\n", ap_header->head.text_addr);
+	fprintf(out, "   DATA Segment Offset : 0x%08X\n", ap_header->head.data_offset);
+	fprintf(out, "                Length : 0x%04hX\n", ap_header->head.data_length);
+	fprintf(out, "               Address : 0x%04hX\n", ap_header->head.data_addr);
+	fprintf(out, "    BSS Segment Length : 0x%04hX\n", ap_header->head.bss_length);
+	fprintf(out, "               Address : 0x%04hX\n", ap_header->head.bss_addr);
+	fprintf(out, "                 Entry : 0x%04hX\n", ap_header->head.entry);
+	fprintf(out, "            Entry Bank : 0x%02hhX\n", ap_header->head.entry_bank);
+	fprintf(out, "                 Banks : 0x%02hhX\n", ap_header->head.banks);
+
+	fprintf(out, "\n\n    NON EMPTY BANKS:\n");
+	fprintf(out, "    ----------------\n\n");
 
-	fread(&ap_header, sizeof(AP_FULLHEAD), 1, apfile);
+	for (uint32_t i = 0; i < 252; i++) {
+		if (ap_header->bank[i].offset != 0) {
+			is_bank = true;
+			fprintf(out, "      Bank 0x%02hhX Offset : 0x%08X\n", i, ap_header->bank[i].offset);
+			fprintf(out, "                Lenght : 0x%04hX\n", ap_header->bank[i].length);
+			fprintf(out, "               Address : 0x%04hX\n\n", ap_header->bank[i].addr);
+		}
+	}
 
-	if ((ap_header.head.file_type != 'P') && memcmp(ap_header.head.magic, magic, 4)) {
-		printf("Error: File \"%s\" isn't proper ACTOS application.\n\n", argv[1]);
+	if (!is_bank) {
+		fprintf(out, "    None\n\n");
 	}
+}
+
+static void ap_print_csv_header(void) {
+	printf("file,valid,error,file_type,ap_type,version,text_offset,text_length,text_addr,data_offset,data_length,data_addr,");
+	printf("bss_length,bss_addr,entry,entry_bank,banks,bank_table\n");
+}
 
-	printf("\n    HEADER INFORMATION:\n");
-	printf("    -------------------\n\n");
-	printf("             File Type : %c\n", ap_header.head.file_type);
-	printf("      Application Type : 0x%02hhX (%s)\n", ap_header.head.ap_type, decode_ap_type(ap_header.head.ap_type));
-	printf("         ACTOS Version : %hhu.%hhu\n", ap_header.head.major_version, ap_header.head.minor_version);
-	printf("   TEXT Segment Offset : 0x%08X\n", ap_header.head.text_offset);
-	printf("                Length : 0x%04hX\n", ap_header.head.text_length);
-	printf("               Address : 0x%04hX\n", ap_header.head.text_addr);
-	printf("   DATA Segment Offset : 0x%08X\n", ap_header.head.data_offset);
-	printf("                Length : 0x%04hX\n", ap_header.head.data_length);
-	printf("               Address : 0x%04hX\n", ap_header.head.data_addr);
-	printf("    BSS Segment Length : 0x%04hX\n", ap_header.head.bss_length);
-	printf("               Address : 0x%04hX\n", ap_header.head.bss_addr);
-	printf("                 Entry : 0x%04hX\n", ap_header.head.entry);
-	printf("            Entry Bank : 0x%02hhX\n", ap_header.head.entry_bank);
-	printf("                 Banks : 0x%02hhX\n", ap_header.head.banks);
-
-	printf("\n\n    NON EMPTY BANKS:\n");
-	printf("    ----------------\n\n");
+// bank table is one field, "BANK:OFFSET:LENGTH:ADDR" of non empty banks joined by ';'
+static void ap_print_csv(FILE *out, char *name, AP_FULLHEAD *ap_header, char *error) {
+	AP_HEAD *head = &ap_header->head;
+	char *sep = "";
 
+	print_csv_string(out, name);
+	fprintf(out, ",%u,%s,%u,%u,%hhu.%hhu", !error, error ? error : "", head->file_type, head->ap_type, head->major_version, head->minor_version);
+	fprintf(out, ",0x%08X,0x%04hX,0x%04hX", head->text_offset, head->text_length, head->text_addr);
+	fprintf(out, ",0x%08X,0x%04hX,0x%04hX", head->data_offset, head->data_length, head->data_addr);
+	fprintf(out, ",0x%04hX,0x%04hX,0x%04hX,0x%02hhX,0x%02hhX,", head->bss_length, head->bss_addr, head->entry, head->entry_bank, head->banks);
 	for (uint32_t i = 0; i < 252; i++) {
-		if (ap_header.bank[i].offset != 0) {
-			is_bank = true;
-			printf("      Bank 0x%02hhX Offset : 0x%08X\n", i, ap_header.bank[i].offset);
-			printf("                Lenght : 0x%04hX\n", ap_header.bank[i].length);
-			printf("               Address : 0x%04hX\n\n", ap_header.bank[i].addr);
+		if (ap_header->bank[i].offset != 0) {
+			fprintf(out, "%s0x%02X:0x%08X:0x%04hX:0x%04hX", sep, i, ap_header->bank[i].offset, ap_header->bank[i].length, ap_header->bank[i].addr);
+			sep = ";";
 		}
 	}
+	fprintf(out, "\n");
+}
 
-	if (!is_bank) {
-		printf("    None\n\n");
+static void ap_print_json(FILE *out, char *name, AP_FULLHEAD *ap_header, char *error) {
+	AP_HEAD *head = &ap_header->head;
+	char *sep = "";
+
+	fprintf(out, "{\"file\":");
+	print_json_string(out, name);
+	fprintf(out, ",\"valid\":%s,\"error\":", error ? "false" : "true");
+	if (error) {
+		print_json_string(out, error);
+	} else {
+		fprintf(out, "null");
+	}
+	fprintf(out, ",\"file_type\":%u,\"ap_type\":%u,\"major_version\":%u,\"minor_version\":%u", head->file_type, head->ap_type, head->major_version, head->minor_version);
+	fprintf(out, ",\"text_offset\":%u,\"text_length\":%u,\"text_addr\":%u", head->text_offset, head->text_length, head->text_addr);
+	fprintf(out, ",\"data_offset\":%u,\"data_length\":%u,\"data_addr\":%u", head->data_offset, head->data_length, head->data_addr);
+	fprintf(out, ",\"bss_length\":%u,\"bss_addr\":%u,\"entry\":%u,\"entry_bank\":%u,\"banks\":%u,\"bank_table\":[", head->bss_length, head->bss_addr, head->entry, head->entry_bank, head->banks);
+	for (uint32_t i = 0; i < 252; i++) {
+		if (ap_header->bank[i].offset != 0) {
+			fprintf(out, "%s{\"bank\":%u,\"offset\":%u,\"length\":%u,\"addr\":%u}", sep, i, ap_header->bank[i].offset, ap_header->bank[i].length, ap_header->bank[i].addr);
+			sep = ",";
+		}
+	}
+	fprintf(out, "]}\n");
+}
+
+static void apinfo_module(FILE *out, char *name, uint8_t *data, size_t size, OUTPUT_FORMAT format, bool is_named) {
+	AP_FULLHEAD ap_header;
+	char *error = check_ap_header(data, size, &ap_header);
+
+	switch (format) {
+		case FORMAT_CSV:
+			ap_print_csv(out, name, &ap_header, error);
+			break;
+		case FORMAT_JSON:
+			ap_print_json(out, name, &ap_header, error);
+			break;
+		default:
+			if (is_named) {
+				fprintf(out, "\n    %s\n", name);
+			}
+			ap_print_text(out, name, &ap_header, error);
+			break;
+	}
+}
+
+// RAW and AFI firmware images are searched for *.AP directory files, which
+// are analysed in place and named IMAGE:FILE
+static bool apinfo_file(char *filename, uint8_t *data, size_t size, FILE *out, void *arg) {
+	APINFO_OPTIONS *options = arg;
+	FW_IMAGE_FILE files[FW_IMAGE_MAX_FILES];
+	int32_t count = fw_image_files(data, size, files);
+	bool is_found = false;
+
+	if (count < 0) {
+		apinfo_module(out, filename, data, size, options->format, options->is_named);
+		return true;
+	}
+
+	for (int32_t i = 0; i < count; i++) {
+		if (fnmatch("*.AP", files[i].name, FNM_CASEFOLD) == 0) {
+			char name[strlen(filename) + sizeof(files[i].name) + 1];
+			sprintf(name, "%s:%s", filename, files[i].name);
+			apinfo_module(out, name, files[i].data, files[i].length, options->format, true);
+			is_found = true;
+		}
+	}
+
+	if (!is_found && (options->format == FORMAT_TEXT)) {
+		fprintf(out, "No ACTOS applications found in firmware image \"%s\".\n\n", filename);
+	}
+	return true;
+}
+
+int main(int argc, char *argv[]) {
+	APINFO_OPTIONS options = { .format = FORMAT_TEXT, .is_named = false };
+	uint32_t threads = 0;
+	uint32_t count;
+	char **files;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "j:", longopt, NULL)) != -1) {
+		switch (opt) {
+			case 'c':
+				options.format = FORMAT_CSV;
+				break;
+			case 'J':
+				options.format = FORMAT_JSON;
+				break;
+			case 'j':
+				threads = strtoul(optarg, NULL, 0);
+				break;
+			default:
+				usage(basename(argv[0]));
+				return -1;
+		}
+	}
+
+	if (optind >= argc) {
+		usage(basename(argv[0]));
+		return -1;
+	}
+
+	files = file_job_collect(&argv[optind], argc - optind, &count);
+	if (!files) {
+		return 1;
+	}
+
+	options.is_named = (count > 1);
+	if (options.format == FORMAT_CSV) {
+		ap_print_csv_header();
 	}
+	bool retval = file_job_run(files, count, threads, apinfo_file, &options);
 
-	fclose(apfile);
-	return 0;
+	file_job_free(files, count);
+	return retval ? 0 : 1;
 }
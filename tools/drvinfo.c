@@ -1,13 +1,21 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <getopt.h>
+#include <fnmatch.h>
 #include <libgen.h>
 
+#include "../usbfw.h"
+
 #pragma pack(1)
 
 #define		BANKA_SIZE		0x200
 #define		BANKB_SIZE		0x600
+#define		BANK_EMPTY		0x7676
 
 typedef struct {
 	uint8_t			file_type;		// 'D'
@@ -28,15 +36,32 @@ typedef struct {
 
 #pragma pack()
 
-char magic[4] = { 0x57, 0x47, 0x19, 0x97 };
+typedef enum {
+	BANK_NORMAL = 0,
+	BANK_NONSTANDARD,			// length shorter than bank header
+	BANK_IS_EMPTY
+} BANK_STATE;
+
+typedef struct {
+	OUTPUT_FORMAT		format;
+	bool			is_named;	// text of plain file starts with its name
+} DRVINFO_OPTIONS;
 
-FILE *drvfile;
-DRV_HEAD drv_header;
-BANK_HEAD bank_header;
+struct option longopt[] = {
+	{"csv", 0, NULL, 'c'},
+	{"json", 0, NULL, 'J'},
+	{"threads", 1, NULL, 'j'},
+	{NULL, 0, NULL, 0}
+};
 
 
 void usage(char *app) {
-	printf("Usage:\n\t%s DRV_FILE\n\n", app);
+	printf("Usage:\n\t%s [--csv | --json] [-j THREADS] FILE|DIR|GLOB...\n\n", app);
+	printf("FILE is ACTOS driver or RAW or AFI firmware image, whose *.DRV directory\n");
+	printf("files are analysed in place. Directories are searched recursively and\n");
+	printf("files are processed in parallel.\n");
+	printf("With --csv or --json one record per file is printed, JSON as one object per\n");
+	printf("line.\n\n");
 }
 
 char * decode_drv_type(uint8_t ap_type) {
@@ -62,107 +87,296 @@ char * decode_drv_type(uint8_t ap_type) {
 	}
 }
 
-int main(int argc, char *argv[]) {
-	bool is_bank;
+// Copy header from file data (zero padded when file is short) and check it.
+// Returns NULL for proper driver, reason otherwise.
+static char * drv_check(uint8_t *data, size_t size, DRV_HEAD *drv_header) {
+	memset(drv_header, 0, sizeof(DRV_HEAD));
+	memcpy(drv_header, data, (size < sizeof(DRV_HEAD)) ? size : sizeof(DRV_HEAD));
 
-	if (argc < 2) {
-		usage(basename(argv[0]));
-		return -1;
+	if (size < sizeof(DRV_HEAD)) {
+		return "short file";
+	}
+	if (drv_header->file_type != 'D') {
+		return "bad file type";
 	}
+	if ((drv_header->bankA_offset > drv_header->bankB_offset) || (drv_header->bankB_offset > size)) {
+		return "bank outside file";
+	}
+	return NULL;
+}
+
+// bank header at 'offset', zero padded past file end
+static BANK_STATE drv_bank(uint8_t *data, size_t size, uint32_t offset, BANK_HEAD *bank_header) {
+	memset(bank_header, 0, sizeof(BANK_HEAD));
+	if (offset < size) {
+		memcpy(bank_header, data + offset, ((size - offset) < sizeof(BANK_HEAD)) ? (size - offset) : sizeof(BANK_HEAD));
+	}
+
+	if (bank_header->length < sizeof(BANK_HEAD)) {
+		return BANK_NONSTANDARD;
+	} else if (bank_header->length == BANK_EMPTY) {
+		return BANK_IS_EMPTY;
+	}
+	return BANK_NORMAL;
+}
 
-	drvfile = fopen(argv[1], "r");
-	if (!drvfile) {
-		printf("Error: Cannot open file \"%s\".\n\n", argv[1]);
-		return 0;
+// A banks lie between bank A and bank B offset, B banks from there to file end
+static void drv_bank_range(DRV_HEAD *drv_header, size_t size, bool is_b, uint32_t *offset, uint32_t *end, uint32_t *step) {
+	*offset = is_b ? drv_header->bankB_offset : drv_header->bankA_offset;
+	*end = is_b ? size : drv_header->bankB_offset;
+	*step = is_b ? BANKB_SIZE : BANKA_SIZE;
+}
+
+static void drv_print_text(FILE *out, char *name, uint8_t *data, size_t size, DRV_HEAD *drv_header, char *error) {
+	BANK_HEAD bank_header;
+
+	if (error) {
+		fprintf(out, "Error: File \"%s\" isn't proper ACTOS driver (%s).\n\n", name, error);
 	}
 
-	fread(&drv_header, sizeof(DRV_HEAD), 1, drvfile);
+	fprintf(out, "\n    HEADER INFORMATION:\n");
+	fprintf(out, "    -------------------\n\n");
+	fprintf(out, "             File Type : %c\n", drv_header->file_type);
+	fprintf(out, "           Driver Type : 0x%02hhX (%s)\n", drv_header->drv_type, decode_drv_type(drv_header->drv_type));
+	fprintf(out, " Resident Code Address : 0x%04hX\n", drv_header->rcode_addr);
+	fprintf(out, "                Length : 0x%04hX\n", drv_header->rcode_length);
+	fprintf(out, "     Init Code Address : 0x%04hX\n", drv_header->init_API);
+	fprintf(out, "     Exit Code Address : 0x%04hX\n", drv_header->exit_API);
+	fprintf(out, "         Bank A Offset : 0x%08X\n", drv_header->bankA_offset);
+	fprintf(out, "         Bank B Offset : 0x%08X\n", drv_header->bankB_offset);
 
-	if (drv_header.file_type != 'D') {
-		printf("Error: File \"%s\" isn't proper ACTOS driver.\n\n", argv[1]);
+	// bank offsets of broken driver may be anything
+	if (error) {
+		fprintf(out, "\n");
+		return;
 	}
 
-	printf("\n    HEADER INFORMATION:\n");
-	printf("    -------------------\n\n");
-	printf("             File Type : %c\n", drv_header.file_type);
-	printf("           Driver Type : 0x%02hhX (%s)\n", drv_header.drv_type, decode_drv_type(drv_header.drv_type));
-	printf(" Resident Code Address : 0x%04hX\n", drv_header.rcode_addr);
-	printf("                Length : 0x%04hX\n", drv_header.rcode_length);
-	printf("     Init Code Address : 0x%04hX\n", drv_header.init_API);
-	printf("     Exit Code Address : 0x%04hX\n", drv_header.exit_API);
-	printf("         Bank A Offset : 0x%08X\n", drv_header.bankA_offset);
-	printf("         Bank B Offset : 0x%08X\n", drv_header.bankB_offset);
+	for (uint32_t b = 0; b < 2; b++) {
+		char letter = b ? 'B' : 'A';
+		uint32_t offset, end, step;
+		bool is_bank = false;
 
-	printf("\n\n    'A' BANKS:\n");
-	printf("    ----------\n\n");
+		fprintf(out, b ? "\n\n     'B' BANKS:\n     ----------\n\n" : "\n\n    'A' BANKS:\n    ----------\n\n");
 
-	is_bank = false;
-	uint32_t offset = drv_header.bankA_offset;
-	uint32_t end = drv_header.bankB_offset;
+		drv_bank_range(drv_header, size, b, &offset, &end, &step);
+		for (uint32_t i = 0; offset < end; i++, offset += step) {
+			is_bank = true;
+			switch (drv_bank(data, size, offset, &bank_header)) {
+				case BANK_NONSTANDARD:
+					fprintf(out, "    Bank %c 0x%02hhX Length : 0x%04hX (Nonstandard format)\n\n", letter, i, bank_header.length);
+					continue;
+				case BANK_IS_EMPTY:
+					fprintf(out, "    Bank %c 0x%02hhX Length : Empty \n\n", letter, i);
+					continue;
+				default:
+					break;
+			}
 
-	for (uint32_t i = 0; offset < end; i++, offset += BANKA_SIZE) {
-		is_bank = true;
-		fseek(drvfile, offset, SEEK_SET);
-		fread(&bank_header, sizeof(BANK_HEAD), 1, drvfile);
+			fprintf(out, "    Bank %c 0x%02hhX Length : 0x%04hX\n", letter, i, bank_header.length);
+			fprintf(out, "     Local Vars Length : 0x%02hhX\n", bank_header.local_var_length);
+			for (uint32_t j = 0; j < 8; j++) {
+				if (bank_header.entry_points[j] != BANK_EMPTY) {
+					fprintf(out, "         %s %1u : 0x%04hX\n", j ? "           " : "Entry point", j, bank_header.entry_points[j]);
+				}
+			}
+			fprintf(out, "\n");
+		}
 
-		if (bank_header.length < sizeof(BANK_HEAD)) {
-			printf("    Bank A 0x%02hhX Length : 0x%04hX (Nonstandard format)\n\n", i, bank_header.length);
-			continue;
-		} else if (bank_header.length == 0x7676) {
-			printf("    Bank A 0x%02hhX Length : Empty \n\n", i);
-			continue;
+		if (!is_bank) {
+			fprintf(out, "    None\n\n");
 		}
+	}
+}
 
-		printf("    Bank A 0x%02hhX Length : 0x%04hX\n", i, bank_header.length);
-		printf("     Local Vars Length : 0x%02hhX\n", bank_header.local_var_length);
-		for (uint32_t j = 0; j < 8; j++) {
-			if (bank_header.entry_points[j] != 0x7676) {
-				printf("         %s %1u : 0x%04hX\n", j ? "           " : "Entry point", j, bank_header.entry_points[j]);
-			}
+static void drv_print_csv_header(void) {
+	printf("file,valid,error,file_type,drv_type,drv_type_name,rcode_addr,rcode_length,init_api,exit_api,");
+	printf("bank_a_offset,bank_b_offset,bank_a_count,bank_b_count,banks\n");
+}
+
+// banks are one field, "BANK:LENGTH:LOCALS:ENTRY/ENTRY/..." joined by ';',
+// LENGTH is "empty" or "nonstandard" for such banks
+static void drv_print_csv(FILE *out, char *name, uint8_t *data, size_t size, DRV_HEAD *drv_header, char *error) {
+	BANK_HEAD bank_header;
+	uint32_t counts[2] = { 0, 0 };
+	char *sep = "";
+
+	if (!error) {
+		for (uint32_t b = 0; b < 2; b++) {
+			uint32_t offset, end, step;
+			drv_bank_range(drv_header, size, b, &offset, &end, &step);
+			counts[b] = (end > offset) ? ((end - offset + step - 1) / step) : 0;
 		}
-		printf("\n");
 	}
 
-	if (!is_bank) {
-		printf("    None\n\n");
+	print_csv_string(out, name);
+	fprintf(out, ",%u,%s,%u,%u,%s", !error, error ? error : "", drv_header->file_type, drv_header->drv_type, decode_drv_type(drv_header->drv_type));
+	fprintf(out, ",0x%04hX,0x%04hX,0x%04hX,0x%04hX", drv_header->rcode_addr, drv_header->rcode_length, drv_header->init_API, drv_header->exit_API);
+	fprintf(out, ",0x%08X,0x%08X,%u,%u,", drv_header->bankA_offset, drv_header->bankB_offset, counts[0], counts[1]);
+
+	for (uint32_t b = 0; b < 2; b++) {
+		uint32_t offset, end, step;
+
+		drv_bank_range(drv_header, size, b, &offset, &end, &step);
+		for (uint32_t i = 0; i < counts[b]; i++, offset += step) {
+			BANK_STATE state = drv_bank(data, size, offset, &bank_header);
+
+			fprintf(out, "%s%c%02X:", sep, b ? 'B' : 'A', i);
+			sep = ";";
+			if (state == BANK_NONSTANDARD) {
+				fprintf(out, "nonstandard");
+				continue;
+			} else if (state == BANK_IS_EMPTY) {
+				fprintf(out, "empty");
+				continue;
+			}
+			fprintf(out, "0x%04hX:0x%02hhX:", bank_header.length, bank_header.local_var_length);
+			for (uint32_t j = 0; j < 8; j++) {
+				fprintf(out, "%s", j ? "/" : "");
+				if (bank_header.entry_points[j] != BANK_EMPTY) {
+					fprintf(out, "0x%04hX", bank_header.entry_points[j]);
+				}
+			}
+		}
 	}
+	fprintf(out, "\n");
+}
 
+static void drv_print_json(FILE *out, char *name, uint8_t *data, size_t size, DRV_HEAD *drv_header, char *error) {
+	BANK_HEAD bank_header;
 
-	printf("\n\n     'B' BANKS:\n");
-	printf("     ----------\n\n");
+	fprintf(out, "{\"file\":");
+	print_json_string(out, name);
+	fprintf(out, ",\"valid\":%s,\"error\":", error ? "false" : "true");
+	if (error) {
+		print_json_string(out, error);
+	} else {
+		fprintf(out, "null");
+	}
+	fprintf(out, ",\"file_type\":%u,\"drv_type\":%u,\"drv_type_name\":\"%s\"", drv_header->file_type, drv_header->drv_type, decode_drv_type(drv_header->drv_type));
+	fprintf(out, ",\"rcode_addr\":%u,\"rcode_length\":%u,\"init_api\":%u,\"exit_api\":%u", drv_header->rcode_addr, drv_header->rcode_length, drv_header->init_API, drv_header->exit_API);
+	fprintf(out, ",\"bank_a_offset\":%u,\"bank_b_offset\":%u", drv_header->bankA_offset, drv_header->bankB_offset);
 
-	is_bank = false;
-	offset = drv_header.bankB_offset;
-	fseek(drvfile, 0, SEEK_END);
-	end = ftell(drvfile);
+	for (uint32_t b = 0; b < 2; b++) {
+		uint32_t offset, end, step;
+		char *sep = "";
 
-	for (uint32_t i = 0; offset < end; i++, offset += BANKB_SIZE) {
-		is_bank = true;
-		fseek(drvfile, offset, SEEK_SET);
-		fread(&bank_header, sizeof(BANK_HEAD), 1, drvfile);
+		fprintf(out, ",\"%s\":[", b ? "banks_b" : "banks_a");
+		drv_bank_range(drv_header, size, b, &offset, &end, &step);
+		for (uint32_t i = 0; !error && (offset < end); i++, offset += step) {
+			BANK_STATE state = drv_bank(data, size, offset, &bank_header);
 
-		if (bank_header.length < sizeof(BANK_HEAD)) {
-			printf("    Bank B 0x%02hhX Length : 0x%04hX (Nonstandard format)\n\n", i, bank_header.length);
-			continue;
-		} else if (bank_header.length == 0x7676) {
-			printf("    Bank A 0x%02hhX Length : Empty \n\n", i);
-			continue;
+			fprintf(out, "%s{\"bank\":%u,\"state\":\"%s\"", sep, i, (state == BANK_NORMAL) ? "normal" : ((state == BANK_IS_EMPTY) ? "empty" : "nonstandard"));
+			sep = ",";
+			if (state == BANK_NORMAL) {
+				char *ep_sep = "";
+				fprintf(out, ",\"length\":%u,\"local_var_length\":%u,\"entry_points\":[", bank_header.length, bank_header.local_var_length);
+				for (uint32_t j = 0; j < 8; j++) {
+					if (bank_header.entry_points[j] != BANK_EMPTY) {
+						fprintf(out, "%s%u", ep_sep, bank_header.entry_points[j]);
+					} else {
+						fprintf(out, "%snull", ep_sep);
+					}
+					ep_sep = ",";
+				}
+				fprintf(out, "]");
+			} else if (state == BANK_NONSTANDARD) {
+				fprintf(out, ",\"length\":%u", bank_header.length);
+			}
+			fprintf(out, "}");
 		}
+		fprintf(out, "]");
+	}
+	fprintf(out, "}\n");
+}
 
-		printf("    Bank B 0x%02hhX Length : 0x%04hX\n", i, bank_header.length);
-		printf("     Local Vars Length : 0x%02hhX\n", bank_header.local_var_length);
-		for (uint32_t j = 0; j < 8; j++) {
-			if (bank_header.entry_points[j] != 0x7676) {
-				printf("         %s %1u : 0x%04hX\n", j ? "           " : "Entry point", j, bank_header.entry_points[j]);
+static void drvinfo_module(FILE *out, char *name, uint8_t *data, size_t size, OUTPUT_FORMAT format, bool is_named) {
+	DRV_HEAD drv_header;
+	char *error = drv_check(data, size, &drv_header);
+
+	switch (format) {
+		case FORMAT_CSV:
+			drv_print_csv(out, name, data, size, &drv_header, error);
+			break;
+		case FORMAT_JSON:
+			drv_print_json(out, name, data, size, &drv_header, error);
+			break;
+		default:
+			if (is_named) {
+				fprintf(out, "\n    %s\n", name);
 			}
+			drv_print_text(out, name, data, size, &drv_header, error);
+			break;
+	}
+}
+
+// RAW and AFI firmware images are searched for *.DRV directory files, which
+// are analysed in place and named IMAGE:FILE
+static bool drvinfo_file(char *filename, uint8_t *data, size_t size, FILE *out, void *arg) {
+	DRVINFO_OPTIONS *options = arg;
+	FW_IMAGE_FILE files[FW_IMAGE_MAX_FILES];
+	int32_t count = fw_image_files(data, size, files);
+	bool is_found = false;
+
+	if (count < 0) {
+		drvinfo_module(out, filename, data, size, options->format, options->is_named);
+		return true;
+	}
+
+	for (int32_t i = 0; i < count; i++) {
+		if (fnmatch("*.DRV", files[i].name, FNM_CASEFOLD) == 0) {
+			char name[strlen(filename) + sizeof(files[i].name) + 1];
+			sprintf(name, "%s:%s", filename, files[i].name);
+			drvinfo_module(out, name, files[i].data, files[i].length, options->format, true);
+			is_found = true;
 		}
-		printf("\n");
 	}
 
-	if (!is_bank) {
-		printf("    None\n\n");
+	if (!is_found && (options->format == FORMAT_TEXT)) {
+		fprintf(out, "No ACTOS drivers found in firmware image \"%s\".\n\n", filename);
+	}
+	return true;
+}
+
+int main(int argc, char *argv[]) {
+	DRVINFO_OPTIONS options = { .format = FORMAT_TEXT, .is_named = false };
+	uint32_t threads = 0;
+	uint32_t count;
+	char **files;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "j:", longopt, NULL)) != -1) {
+		switch (opt) {
+			case 'c':
+				options.format = FORMAT_CSV;
+				break;
+			case 'J':
+				options.format = FORMAT_JSON;
+				break;
+			case 'j':
+				threads = strtoul(optarg, NULL, 0);
+				break;
+			default:
+				usage(basename(argv[0]));
+				return -1;
+		}
+	}
+
+	if (optind >= argc) {
+		usage(basename(argv[0]));
+		return -1;
+	}
+
+	files = file_job_collect(&argv[optind], argc - optind, &count);
+	if (!files) {
+		return 1;
+	}
+
+	options.is_named = (count > 1);
+	if (options.format == FORMAT_CSV) {
+		drv_print_csv_header();
 	}
+	bool retval = file_job_run(files, count, threads, drvinfo_file, &options);
 
-	fclose(drvfile);
-	return 0;
+	file_job_free(files, count);
+	return retval ? 0 : 1;
 }
@@ -0,0 +1,662 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <libgen.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CARVE_X86
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define CARVE_NEON
+#endif
+
+#include "../usbfw.h"
+
+#define		CARVE_CHUNK		0x1000000	// 16 MiB of image scanned by thread at once
+#define		CARVE_MAX_THREADS	64
+#define		CARVE_INITIAL_HITS	256
+
+typedef enum {
+	CARVE_FW = 0,
+	CARVE_AFI,
+	CARVE_BREC,
+	CARVE_SYSINFO,
+	CARVE_AP,
+	CARVE_TYPES
+} CARVE_TYPE;
+
+// Scanner looks for first two magic bytes of all patterns at once, rest of
+// magic and structure are checked only at such candidates.
+typedef struct {
+	char			*name;
+	char			*magic;
+	uint32_t		magic_length;
+	uint32_t		magic_offset;	// magic position inside structure
+} CARVE_PATTERN;
+
+typedef struct {
+	uint64_t		offset;		// structure start in image
+	uint64_t		length;		// bytes it describes, 0 when unknown
+	CARVE_TYPE		type;
+	char			*error;		// NULL for structure passing checks
+	char			details[80];
+} CARVE_HIT;
+
+typedef struct {
+	CARVE_HIT		*hits;
+	uint32_t		count;
+	uint32_t		allocated;
+	uint64_t		rejected[CARVE_TYPES];	// candidates failing checks
+	bool			is_failed;		// out of memory
+} CARVE_LIST;
+
+// one thread scanning part of image
+typedef struct {
+	uint8_t			*data;
+	size_t			size;
+	bool			is_all;		// keep rejected candidates too
+	CARVE_LIST		*list;
+} CARVE_SCAN;
+
+typedef void (*CARVE_KERNEL)(CARVE_SCAN *scan, size_t pos, size_t end);
+
+typedef struct {
+	uint8_t			*data;
+	size_t			size;
+	bool			is_all;
+	CARVE_KERNEL		kernel;
+	uint64_t		next;		// next chunk start, taken atomically
+	pthread_mutex_t		lock;		// guards merging into list
+	CARVE_LIST		list;
+} CARVE_JOB;
+
+static const CARVE_PATTERN patterns[CARVE_TYPES] = {
+	[CARVE_FW] = { "FW", "\x55\xAA\xF0\x0F", 4, 0 },	// FW_HEADER_MAGIC
+	[CARVE_AFI] = { "AFI", "AFI", 3, 0 },
+	[CARVE_BREC] = { "BREC", "BREC", 4, 4 },
+	[CARVE_SYSINFO] = { "SYSINFO", "SYS INFOHW", 10, 0 },
+	[CARVE_AP] = { "AP", AP_MAGIC, 4, 2 }
+};
+
+struct option longopt[] = {
+	{"all", 0, NULL, 'a'},
+	{"csv", 0, NULL, 'c'},
+	{"json", 0, NULL, 'J'},
+	{"threads", 1, NULL, 'j'},
+	{NULL, 0, NULL, 0}
+};
+
+
+void usage(char *app) {
+	printf("Usage:\n\t%s [-a] [--csv | --json] [-j THREADS] IMAGE\n\n", app);
+	printf("IMAGE is raw NAND or LUN dump (file or block device). It is scanned in\n");
+	printf("parallel for firmware headers, AFI headers, bootrecords, sysinfo and ACTOS\n");
+	printf("applications, which are checked and listed ordered by offset.\n");
+	printf("With -a (--all) candidates failing checks are listed too, with --csv or --json\n");
+	printf("one record per structure is printed, JSON as one object per line.\n\n");
+}
+
+static bool carve_add(CARVE_LIST *list, CARVE_HIT *hit) {
+	if (list->count == list->allocated) {
+		uint32_t allocated = list->allocated ? (list->allocated * 2) : CARVE_INITIAL_HITS;
+		CARVE_HIT *hits = realloc(list->hits, allocated * sizeof(CARVE_HIT));
+		if (!hits) {
+			list->is_failed = true;
+			return false;
+		}
+		list->hits = hits;
+		list->allocated = allocated;
+	}
+	list->hits[list->count++] = *hit;
+	return true;
+}
+
+// text from image, non printable characters replaced and trailing spaces cut
+static void carve_text(char *out, uint8_t *text, uint32_t length) {
+	uint32_t i;
+
+	for (i = 0; (i < length) && text[i]; i++) {
+		out[i] = ((text[i] < 0x20) || (text[i] > 0x7E)) ? '.' : text[i];
+	}
+	while ((i > 0) && (out[i - 1] == ' ')) {
+		i--;
+	}
+	out[i] = 0;
+}
+
+static void carve_fw(CARVE_HIT *hit, uint8_t *data, size_t left) {
+	FW_HEADER *fw_header = (FW_HEADER *)data;
+	char name[33];
+	uint32_t files = 0;
+
+	if (left < sizeof(FW_HEADER)) {
+		hit->error = "truncated";
+		return;
+	}
+	hit->error = check_fw_header(fw_header);
+	if (hit->error) {
+		return;
+	}
+
+	for (uint32_t i = 0; i < 240; i++) {
+		if (fw_header->diritem[i].filename[0] != 0) {
+			files++;
+		}
+	}
+	hit->length = (uint64_t)get_fw_size(fw_header) * SECTOR_SIZE;
+	carve_text(name, fw_header->deviceName, 32);
+	snprintf(hit->details, sizeof(hit->details), "%04X:%04X version %01hhX.%01hhX.%02hhX.%02hhX%02hhX, %u files%s%s",
+		fw_header->vendorId, fw_header->productId,
+		fw_header->version[0] >> 4, fw_header->version[0] & 0xF,
+		fw_header->version[1], fw_header->version[2], fw_header->version[3],
+		files, name[0] ? ", " : "", name);
+}
+
+static void carve_afi(CARVE_HIT *hit, uint8_t *data, size_t left) {
+	FW_AFI_HEADER *afi = (FW_AFI_HEADER *)data;
+	uint32_t entries = 0;
+
+	if (left < sizeof(FW_AFI_HEADER)) {
+		hit->error = "truncated";
+		return;
+	}
+	hit->error = check_afi_header(afi);
+	if (hit->error) {
+		return;
+	}
+
+	hit->length = sizeof(FW_AFI_HEADER);
+	for (uint32_t i = 0; i < 126; i++) {
+		if (afi->diritem[i].filename[0] != 0) {
+			uint64_t end = (uint64_t)afi->diritem[i].offset + afi->diritem[i].length;
+			if (end > hit->length) {
+				hit->length = end;
+			}
+			entries++;
+		}
+	}
+	snprintf(hit->details, sizeof(hit->details), "%04X:%04X, %u entries", afi->vendorId, afi->productId, entries);
+}
+
+static void carve_brec(CARVE_HIT *hit, uint8_t *data, size_t left) {
+	FW_BREC *brec = (FW_BREC *)data;
+	char type[5];
+
+	if (left < sizeof(FW_BREC)) {
+		hit->error = "truncated";
+		return;
+	}
+	hit->error = check_brec(brec);
+	if (hit->error) {
+		return;
+	}
+
+	hit->length = sizeof(FW_BREC);
+	carve_text(type, brec->type, 4);
+	snprintf(hit->details, sizeof(hit->details), "type %s, version 0x%04hX", type, brec->version);
+}
+
+static void carve_sysinfo(CARVE_HIT *hit, uint8_t *data, size_t left) {
+	FW_SYSINFO *sysinfo = (FW_SYSINFO *)data;
+
+	if (left < sizeof(FW_SYSINFO)) {
+		hit->error = "truncated";
+		return;
+	}
+	hit->error = check_sysinfo(sysinfo);
+	if (hit->error) {
+		return;
+	}
+
+	hit->length = sizeof(FW_SYSINFO);
+	snprintf(hit->details, sizeof(hit->details), "IC %04hX, firmware %04X:%04X", sysinfo->hwScan.icVersion, sysinfo->fwScan.vendorId, sysinfo->fwScan.productId);
+}
+
+// application size isn't known, its segments and banks only have to lie
+// inside image
+static void carve_ap(CARVE_HIT *hit, uint8_t *data, size_t left) {
+	AP_FULLHEAD ap_header;
+
+	hit->error = check_ap_header(data, left, &ap_header);
+	if (hit->error) {
+		return;
+	}
+
+	hit->length = (uint64_t)ap_header.head.text_offset + ap_header.head.text_length;
+	if ((uint64_t)ap_header.head.data_offset + ap_header.head.data_length > hit->length) {
+		hit->length = (uint64_t)ap_header.head.data_offset + ap_header.head.data_length;
+	}
+	for (uint32_t i = 0; i < 252; i++) {
+		if (ap_header.bank[i].offset && ((uint64_t)ap_header.bank[i].offset + ap_header.bank[i].length > hit->length)) {
+			hit->length = (uint64_t)ap_header.bank[i].offset + ap_header.bank[i].length;
+		}
+	}
+	snprintf(hit->details, sizeof(hit->details), "%s, ACTOS %hhu.%hhu, %u banks",
+		(ap_header.head.ap_type == 0) ? "system" : ((ap_header.head.ap_type == 1) ? "user" : "unknown"),
+		ap_header.head.major_version, ap_header.head.minor_version, ap_header.head.banks);
+}
+
+static void carve_check(CARVE_SCAN *scan, CARVE_TYPE type, uint64_t offset) {
+	CARVE_HIT hit = { .offset = offset, .length = 0, .type = type, .error = NULL, .details = "" };
+	uint8_t *data = scan->data + offset;
+	size_t left = scan->size - offset;
+
+	switch (type) {
+		case CARVE_FW:
+			carve_fw(&hit, data, left);
+			break;
+		case CARVE_AFI:
+			carve_afi(&hit, data, left);
+			break;
+		case CARVE_BREC:
+			carve_brec(&hit, data, left);
+			break;
+		case CARVE_SYSINFO:
+			carve_sysinfo(&hit, data, left);
+			break;
+		default:
+			carve_ap(&hit, data, left);
+			break;
+	}
+
+	if (hit.error) {
+		scan->list->rejected[type]++;
+		if (!scan->is_all) {
+			return;
+		}
+	}
+	carve_add(scan->list, &hit);
+}
+
+// whole magic of every pattern starting with candidate bytes
+static void carve_candidate(CARVE_SCAN *scan, size_t pos) {
+	for (uint32_t type = 0; type < CARVE_TYPES; type++) {
+		const CARVE_PATTERN *pattern = &patterns[type];
+
+		if ((pos < pattern->magic_offset) || (pos + pattern->magic_length > scan->size)) {
+			continue;
+		}
+		if (memcmp(scan->data + pos, pattern->magic, pattern->magic_length) == 0) {
+			carve_check(scan, type, pos - pattern->magic_offset);
+		}
+	}
+}
+
+// Kernels report every position in [pos, end) where first two bytes of some
+// magic are found. Second byte is loaded from following position, so vector
+// loops stop one byte before image end and scalar code does the rest.
+
+static void carve_scalar(CARVE_SCAN *scan, size_t pos, size_t end) {
+	for (; (pos < end) && (pos + 1 < scan->size); pos++) {
+		for (uint32_t type = 0; type < CARVE_TYPES; type++) {
+			if ((scan->data[pos] == (uint8_t)patterns[type].magic[0]) && (scan->data[pos + 1] == (uint8_t)patterns[type].magic[1])) {
+				carve_candidate(scan, pos);
+				break;
+			}
+		}
+	}
+}
+
+#ifdef CARVE_X86
+__attribute__((target("sse2")))
+static void carve_sse2(CARVE_SCAN *scan, size_t pos, size_t end) {
+	__m128i first[CARVE_TYPES];
+	__m128i second[CARVE_TYPES];
+
+	for (uint32_t i = 0; i < CARVE_TYPES; i++) {
+		first[i] = _mm_set1_epi8(patterns[i].magic[0]);
+		second[i] = _mm_set1_epi8(patterns[i].magic[1]);
+	}
+
+	for (; (pos + 16 <= end) && (pos + 17 <= scan->size); pos += 16) {
+		__m128i v0 = _mm_loadu_si128((const __m128i *)(scan->data + pos));
+		__m128i v1 = _mm_loadu_si128((const __m128i *)(scan->data + pos + 1));
+		__m128i hit = _mm_setzero_si128();
+
+		for (uint32_t i = 0; i < CARVE_TYPES; i++) {
+			hit = _mm_or_si128(hit, _mm_and_si128(_mm_cmpeq_epi8(v0, first[i]), _mm_cmpeq_epi8(v1, second[i])));
+		}
+		for (uint32_t mask = _mm_movemask_epi8(hit); mask; mask &= mask - 1) {
+			carve_candidate(scan, pos + __builtin_ctz(mask));
+		}
+	}
+	carve_scalar(scan, pos, end);
+}
+
+__attribute__((target("avx2")))
+static void carve_avx2(CARVE_SCAN *scan, size_t pos, size_t end) {
+	__m256i first[CARVE_TYPES];
+	__m256i second[CARVE_TYPES];
+
+	for (uint32_t i = 0; i < CARVE_TYPES; i++) {
+		first[i] = _mm256_set1_epi8(patterns[i].magic[0]);
+		second[i] = _mm256_set1_epi8(patterns[i].magic[1]);
+	}
+
+	for (; (pos + 32 <= end) && (pos + 33 <= scan->size); pos += 32) {
+		__m256i v0 = _mm256_loadu_si256((const __m256i *)(scan->data + pos));
+		__m256i v1 = _mm256_loadu_si256((const __m256i *)(scan->data + pos + 1));
+		__m256i hit = _mm256_setzero_si256();
+
+		for (uint32_t i = 0; i < CARVE_TYPES; i++) {
+			hit = _mm256_or_si256(hit, _mm256_and_si256(_mm256_cmpeq_epi8(v0, first[i]), _mm256_cmpeq_epi8(v1, second[i])));
+		}
+		for (uint32_t mask = _mm256_movemask_epi8(hit); mask; mask &= mask - 1) {
+			carve_candidate(scan, pos + __builtin_ctz(mask));
+		}
+	}
+	carve_scalar(scan, pos, end);
+}
+#endif
+
+#ifdef CARVE_NEON
+static void carve_neon(CARVE_SCAN *scan, size_t pos, size_t end) {
+	uint8x16_t first[CARVE_TYPES];
+	uint8x16_t second[CARVE_TYPES];
+
+	for (uint32_t i = 0; i < CARVE_TYPES; i++) {
+		first[i] = vdupq_n_u8(patterns[i].magic[0]);
+		second[i] = vdupq_n_u8(patterns[i].magic[1]);
+	}
+
+	for (; (pos + 16 <= end) && (pos + 17 <= scan->size); pos += 16) {
+		uint8x16_t v0 = vld1q_u8(scan->data + pos);
+		uint8x16_t v1 = vld1q_u8(scan->data + pos + 1);
+		uint8x16_t hit = vdupq_n_u8(0);
+
+		for (uint32_t i = 0; i < CARVE_TYPES; i++) {
+			hit = vorrq_u8(hit, vandq_u8(vceqq_u8(v0, first[i]), vceqq_u8(v1, second[i])));
+		}
+		// narrowing shift leaves 4 bits per byte
+		uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(hit), 4)), 0);
+		for (; mask; mask &= mask - 1) {
+			uint32_t bit = __builtin_ctzll(mask);
+			if ((bit & 3) == 0) {
+				carve_candidate(scan, pos + (bit / 4));
+			}
+		}
+	}
+	carve_scalar(scan, pos, end);
+}
+#endif
+
+static CARVE_KERNEL carve_kernel(void) {
+#ifdef CARVE_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		return carve_avx2;
+	} else if (__builtin_cpu_supports("sse2")) {
+		return carve_sse2;
+	}
+#elif defined(CARVE_NEON)
+	return carve_neon;
+#endif
+	return carve_scalar;
+}
+
+// Chunks are taken in image order, so together threads read image almost
+// sequentially. Hits are collected per thread and merged at the end.
+static void * carve_thread(void *data) {
+	CARVE_JOB *job = data;
+	CARVE_LIST list = { .hits = NULL, .count = 0, .allocated = 0, .is_failed = false };
+	CARVE_SCAN scan = {
+		.data = job->data,
+		.size = job->size,
+		.is_all = job->is_all,
+		.list = &list
+	};
+
+	memset(list.rejected, 0, sizeof(list.rejected));
+	while (!list.is_failed) {
+		uint64_t pos = __atomic_fetch_add(&job->next, CARVE_CHUNK, __ATOMIC_RELAXED);
+		uint64_t end = pos + CARVE_CHUNK;
+
+		if (pos >= job->size) {
+			break;
+		}
+		if (end > job->size) {
+			end = job->size;
+		}
+		// chunk start is page aligned, its read starts before it is scanned
+		madvise(job->data + pos, end - pos, MADV_WILLNEED);
+		job->kernel(&scan, pos, end);
+	}
+
+	pthread_mutex_lock(&job->lock);
+	for (uint32_t i = 0; i < CARVE_TYPES; i++) {
+		job->list.rejected[i] += list.rejected[i];
+	}
+	job->list.is_failed |= list.is_failed;
+	for (uint32_t i = 0; (i < list.count) && !job->list.is_failed; i++) {
+		carve_add(&job->list, &list.hits[i]);
+	}
+	pthread_mutex_unlock(&job->lock);
+
+	free(list.hits);
+	return NULL;
+}
+
+static int carve_compare(const void *a, const void *b) {
+	const CARVE_HIT *hit_a = a;
+	const CARVE_HIT *hit_b = b;
+
+	if (hit_a->offset != hit_b->offset) {
+		return (hit_a->offset < hit_b->offset) ? -1 : 1;
+	}
+	return (int)hit_a->type - (int)hit_b->type;
+}
+
+// Directory of valid FW or AFI header names its files, so magic of BREC and
+// others shows up there too. Hits inside header are rejected, hits must be
+// sorted.
+static void carve_reject_nested(CARVE_LIST *list, bool is_all) {
+	uint64_t end = 0;
+	char *error = NULL;
+	uint32_t kept = 0;
+
+	for (uint32_t i = 0; i < list->count; i++) {
+		CARVE_HIT *hit = &list->hits[i];
+
+		if (!hit->error && (hit->offset < end)) {
+			hit->error = error;
+			list->rejected[hit->type]++;
+		}
+		if (!hit->error && (hit->type == CARVE_FW) && (hit->offset + sizeof(FW_HEADER) > end)) {
+			end = hit->offset + sizeof(FW_HEADER);
+			error = "inside FW header";
+		} else if (!hit->error && (hit->type == CARVE_AFI) && (hit->offset + sizeof(FW_AFI_HEADER) > end)) {
+			end = hit->offset + sizeof(FW_AFI_HEADER);
+			error = "inside AFI header";
+		}
+
+		if (!hit->error || is_all) {
+			list->hits[kept++] = *hit;
+		}
+	}
+	list->count = kept;
+}
+
+static void carve_print(CARVE_HIT *hit, OUTPUT_FORMAT format) {
+	switch (format) {
+		case FORMAT_CSV:
+			printf("0x%010" PRIX64 ",%s,0x%08" PRIX64 ",%u,%s,", hit->offset, patterns[hit->type].name, hit->length, !hit->error, hit->error ? hit->error : "");
+			print_csv_string(stdout, hit->details);
+			printf("\n");
+			break;
+		case FORMAT_JSON:
+			printf("{\"offset\":%" PRIu64 ",\"type\":\"%s\",\"length\":%" PRIu64 ",\"valid\":%s,\"error\":", hit->offset, patterns[hit->type].name, hit->length, hit->error ? "false" : "true");
+			if (hit->error) {
+				print_json_string(stdout, hit->error);
+			} else {
+				printf("null");
+			}
+			printf(",\"details\":");
+			print_json_string(stdout, hit->details);
+			printf("}\n");
+			break;
+		default:
+			if (hit->error) {
+				printf("  0x%010" PRIX64 "  %-7s  %10s  Rejected: %s\n", hit->offset, patterns[hit->type].name, "", hit->error);
+			} else {
+				printf("  0x%010" PRIX64 "  %-7s  0x%08" PRIX64 "  %s\n", hit->offset, patterns[hit->type].name, hit->length, hit->details);
+			}
+			break;
+	}
+}
+
+static double carve_time(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1000000000.0;
+}
+
+static int carve_image(char *filename, uint32_t threads, bool is_all, OUTPUT_FORMAT format) {
+	pthread_t thread[CARVE_MAX_THREADS];
+	CARVE_JOB job = {
+		.is_all = is_all,
+		.kernel = carve_kernel(),
+		.next = 0,
+		.list = { .hits = NULL, .count = 0, .allocated = 0, .is_failed = false }
+	};
+	uint32_t started = 0;
+	uint64_t rejected = 0;
+	struct stat st;
+	int retval = 1;
+
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		printf("Error: Cannot open \"%s\".\n", filename);
+		return 1;
+	}
+
+	if (fstat(fd, &st)) {
+		printf("Error: Cannot get size of \"%s\".\n", filename);
+		goto exit;
+	}
+	job.size = st.st_size;
+
+	// LUN dump may be read straight from block device
+	if (S_ISBLK(st.st_mode) && ioctl(fd, BLKGETSIZE64, &job.size)) {
+		printf("Error: Cannot get size of \"%s\".\n", filename);
+		goto exit;
+	}
+	if (job.size == 0) {
+		printf("Error: Image \"%s\" is empty.\n", filename);
+		goto exit;
+	}
+
+	job.data = mmap(NULL, job.size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (job.data == MAP_FAILED) {
+		printf("Error: Cannot map \"%s\".\n", filename);
+		goto exit;
+	}
+	madvise(job.data, job.size, MADV_SEQUENTIAL);
+
+	if (threads == 0) {
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if (threads > CARVE_MAX_THREADS) {
+		threads = CARVE_MAX_THREADS;
+	}
+	if (threads > (job.size + CARVE_CHUNK - 1) / CARVE_CHUNK) {
+		threads = (job.size + CARVE_CHUNK - 1) / CARVE_CHUNK;
+	}
+
+	double start = carve_time();
+	memset(job.list.rejected, 0, sizeof(job.list.rejected));
+	pthread_mutex_init(&job.lock, NULL);
+	for (uint32_t i = 1; i < threads; i++) {
+		if (pthread_create(&thread[started], NULL, carve_thread, &job)) {
+			break;
+		}
+		started++;
+	}
+	carve_thread(&job);
+	for (uint32_t i = 0; i < started; i++) {
+		pthread_join(thread[i], NULL);
+	}
+	pthread_mutex_destroy(&job.lock);
+	double elapsed = carve_time() - start;
+
+	if (job.list.is_failed) {
+		printf("Error: Out of memory.\n");
+		goto unmap;
+	}
+
+	qsort(job.list.hits, job.list.count, sizeof(CARVE_HIT), carve_compare);
+	carve_reject_nested(&job.list, is_all);
+	if (format == FORMAT_CSV) {
+		printf("offset,type,length,valid,error,details\n");
+	} else if (format == FORMAT_TEXT) {
+		printf("\n  %12s  %-7s  %10s  %s\n", "OFFSET", "TYPE", "LENGTH", "DETAILS");
+		printf("  %12s  %-7s  %10s  %s\n", "------------", "-------", "----------", "-------");
+	}
+	for (uint32_t i = 0; i < job.list.count; i++) {
+		carve_print(&job.list.hits[i], format);
+	}
+
+	for (uint32_t i = 0; i < CARVE_TYPES; i++) {
+		rejected += job.list.rejected[i];
+	}
+	if (format == FORMAT_TEXT) {
+		printf("\n%" PRIu64 " structure(s) found, %" PRIu64 " candidate(s) rejected.\n", job.list.count - (is_all ? rejected : 0), rejected);
+		printf("Scanned %s in %.3f s", humanize_size(job.size), elapsed);
+		printf(" (%.1f MiB/s, %u thread(s)).\n\n", (elapsed > 0) ? (job.size / (1024.0 * 1024.0) / elapsed) : 0.0, started + 1);
+	}
+	retval = 0;
+
+unmap:
+	munmap(job.data, job.size);
+exit:
+	free(job.list.hits);
+	close(fd);
+	return retval;
+}
+
+int main(int argc, char *argv[]) {
+	OUTPUT_FORMAT format = FORMAT_TEXT;
+	uint32_t threads = 0;
+	bool is_all = false;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "aj:", longopt, NULL)) != -1) {
+		switch (opt) {
+			case 'a':
+				is_all = true;
+				break;
+			case 'c':
+				format = FORMAT_CSV;
+				break;
+			case 'J':
+				format = FORMAT_JSON;
+				break;
+			case 'j':
+				threads = strtoul(optarg, NULL, 0);
+				break;
+			default:
+				usage(basename(argv[0]));
+				return -1;
+		}
+	}
+
+	if (optind != argc - 1) {
+		usage(basename(argv[0]));
+		return -1;
+	}
+
+	return carve_image(argv[optind], threads, is_all, format);
+}
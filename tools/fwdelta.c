@@ -0,0 +1,480 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libgen.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "../usbfw.h"
+
+#define		FWDELTA_MAGIC		0x50574655	// "UFWP"
+#define		FWDELTA_VERSION		2
+#define		FWDELTA_BLOCK		SECTOR_SIZE	// firmware files start at sector boundary
+#define		FWDELTA_NONE		UINT64_MAX
+#define		FWDELTA_BUFFER		0x100000
+
+#pragma pack(1)
+
+typedef struct {
+	uint32_t		magic;
+	uint16_t		version;
+	uint16_t		reserved;
+	uint64_t		oldSize;
+	uint64_t		newSize;
+	uint64_t		oldHash[2];		// store_hash of whole files, so patch is
+	uint64_t		newHash[2];		// applied only to the right one
+	uint32_t		opCount;
+} FWDELTA_HEADER;
+
+typedef enum {
+	FWDELTA_COPY = 1,				// copy 'length' bytes from old file 'offset'
+	FWDELTA_INSERT					// 'length' bytes of new data follow
+} FWDELTA_OP_TYPE;
+
+typedef struct {
+	uint8_t			type;
+	uint8_t			reserved[3];
+	uint32_t		length;
+	uint64_t		offset;
+} FWDELTA_OP;
+
+#pragma pack()
+
+typedef struct {
+	char			*filename;
+	int			fd;
+	uint8_t			*data;
+	size_t			size;
+	bool			is_fw;		// firmware image found inside
+	off_t			base;		// its position
+	FW_HEADER		header;
+} IMAGE;
+
+typedef struct {
+	FILE			*file;
+	IMAGE			*new;
+	FWDELTA_OP		op;		// op being extended
+	uint64_t		new_pos;	// new file position of its data
+	uint32_t		count;
+	uint64_t		copied;
+	uint64_t		inserted;
+} PATCH_WRITER;
+
+
+void usage(char *app) {
+	printf("Usage:\n");
+	printf("\t%s diff OLD_FILE NEW_FILE PATCH_FILE\n", app);
+	printf("\t%s apply OLD_FILE PATCH_FILE NEW_FILE\n\n", app);
+	printf("Files are RAW or AFI firmware images (any other files work too, but without\n");
+	printf("directory guided matching).\n\n");
+}
+
+static bool image_open(IMAGE *img, char *filename) {
+	struct stat st;
+
+	img->filename = filename;
+	img->data = MAP_FAILED;
+	img->fd = open(filename, O_RDONLY);
+	if ((img->fd < 0) || fstat(img->fd, &st)) {
+		printf("Error: Cannot open file \"%s\".\n", filename);
+		return false;
+	}
+
+	img->size = st.st_size;
+	if (img->size) {
+		img->data = mmap(NULL, img->size, PROT_READ, MAP_PRIVATE, img->fd, 0);
+		if (img->data == MAP_FAILED) {
+			printf("Error: Cannot map file \"%s\".\n", filename);
+			close(img->fd);
+			return false;
+		}
+	}
+
+	img->is_fw = load_fw_image_header(img->fd, &img->base, &img->header);
+	return true;
+}
+
+static void image_close(IMAGE *img) {
+	if (img->data != MAP_FAILED) {
+		munmap(img->data, img->size);
+	}
+	close(img->fd);
+}
+
+static uint64_t block_hash(const uint8_t *data) {
+	uint64_t hash = 0xCBF29CE484222325ULL;
+
+	for (uint32_t i = 0; i < FWDELTA_BLOCK; i += 8) {
+		uint64_t word;
+		memcpy(&word, data + i, 8);
+		hash = (hash ^ word) * 0x100000001B3ULL;
+		hash ^= hash >> 29;
+	}
+	return hash;
+}
+
+// Open addressing table of old file blocks, 'size' is power of 2 at least
+// twice of blocks count. First of equal blocks stays.
+static uint32_t * index_old(IMAGE *old, uint32_t *size) {
+	uint32_t blocks = old->size / FWDELTA_BLOCK;
+	uint32_t *table;
+
+	*size = 1;
+	while (*size < blocks * 2) {
+		*size <<= 1;
+	}
+	table = malloc(*size * sizeof(uint32_t));
+	if (!table) {
+		return NULL;
+	}
+	memset(table, 0xFF, *size * sizeof(uint32_t));
+
+	for (uint32_t i = 0; i < blocks; i++) {
+		const uint8_t *block = old->data + ((size_t)i * FWDELTA_BLOCK);
+		uint32_t slot = block_hash(block) & (*size - 1);
+
+		while (table[slot] != UINT32_MAX) {
+			if (!memcmp(old->data + ((size_t)table[slot] * FWDELTA_BLOCK), block, FWDELTA_BLOCK)) {
+				break;
+			}
+			slot = (slot + 1) & (*size - 1);
+		}
+		if (table[slot] == UINT32_MAX) {
+			table[slot] = i;
+		}
+	}
+
+	return table;
+}
+
+static uint64_t lookup_old(IMAGE *old, uint32_t *table, uint32_t size, const uint8_t *block) {
+	uint32_t slot = block_hash(block) & (size - 1);
+
+	for (; table[slot] != UINT32_MAX; slot = (slot + 1) & (size - 1)) {
+		uint64_t offset = (uint64_t)table[slot] * FWDELTA_BLOCK;
+		if (!memcmp(old->data + offset, block, FWDELTA_BLOCK)) {
+			return offset;
+		}
+	}
+	return FWDELTA_NONE;
+}
+
+// Where each new block probably is in old file: directory files are matched
+// by name, so changed file is compared with its previous version first.
+static uint64_t * directory_hints(IMAGE *old, IMAGE *new, uint32_t *same, uint32_t *changed, uint32_t *added) {
+	uint32_t blocks = (new->size + FWDELTA_BLOCK - 1) / FWDELTA_BLOCK;
+	uint64_t *hints = malloc(blocks * sizeof(uint64_t));
+
+	*same = *changed = *added = 0;
+	if (!hints) {
+		return NULL;
+	}
+	for (uint32_t i = 0; i < blocks; i++) {
+		hints[i] = FWDELTA_NONE;
+	}
+	if (!old->is_fw || !new->is_fw) {
+		return hints;
+	}
+
+	// image header with directory itself
+	if (!(new->base % FWDELTA_BLOCK)) {
+		for (uint32_t j = 0; (j < sizeof(FW_HEADER) / FWDELTA_BLOCK) && (new->base / FWDELTA_BLOCK + j < blocks); j++) {
+			hints[new->base / FWDELTA_BLOCK + j] = old->base + ((uint64_t)j * FWDELTA_BLOCK);
+		}
+	}
+
+	for (uint32_t i = 0; i < 240; i++) {
+		FW_DIR_ENTRY *entry = &new->header.diritem[i];
+		FW_DIR_ENTRY *old_entry = NULL;
+
+		if (entry->filename[0] == 0) {
+			continue;
+		}
+		for (uint32_t j = 0; j < 240; j++) {
+			if (!memcmp(old->header.diritem[j].filename, entry->filename, 11)) {
+				old_entry = &old->header.diritem[j];
+				break;
+			}
+		}
+		if (!old_entry) {
+			(*added)++;
+			continue;
+		}
+		if ((old_entry->length == entry->length) && (old_entry->checksum == entry->checksum)) {
+			(*same)++;
+		} else {
+			(*changed)++;
+		}
+
+		uint64_t start = new->base + ((uint64_t)entry->offset * SECTOR_SIZE);
+		uint64_t old_start = old->base + ((uint64_t)old_entry->offset * SECTOR_SIZE);
+		uint32_t count = (entry->length + FWDELTA_BLOCK - 1) / FWDELTA_BLOCK;
+		if (start % FWDELTA_BLOCK) {
+			continue;
+		}
+		for (uint32_t j = 0; (j < count) && (start / FWDELTA_BLOCK + j < blocks); j++) {
+			hints[start / FWDELTA_BLOCK + j] = old_start + ((uint64_t)j * FWDELTA_BLOCK);
+		}
+	}
+
+	return hints;
+}
+
+static bool patch_flush(PATCH_WRITER *pw) {
+	if (pw->op.length == 0) {
+		return true;
+	}
+	if (fwrite(&pw->op, sizeof(FWDELTA_OP), 1, pw->file) != 1) {
+		return false;
+	}
+	if (pw->op.type == FWDELTA_INSERT) {
+		if (fwrite(pw->new->data + pw->new_pos, pw->op.length, 1, pw->file) != 1) {
+			return false;
+		}
+		pw->inserted += pw->op.length;
+	} else {
+		pw->copied += pw->op.length;
+	}
+	pw->count++;
+	pw->op.length = 0;
+	return true;
+}
+
+// extend current op when new piece continues it, otherwise start new one
+static bool patch_add(PATCH_WRITER *pw, FWDELTA_OP_TYPE type, uint64_t offset, uint64_t new_pos, uint32_t length) {
+	bool is_next = (pw->op.length > 0) && (pw->op.type == type) && ((uint64_t)pw->op.length + length <= UINT32_MAX);
+
+	if (is_next && (type == FWDELTA_COPY)) {
+		is_next = (pw->op.offset + pw->op.length == offset);
+	}
+	if (is_next) {
+		pw->op.length += length;
+		return true;
+	}
+
+	if (!patch_flush(pw)) {
+		return false;
+	}
+	memset(&pw->op, 0, sizeof(FWDELTA_OP));
+	pw->op.type = type;
+	pw->op.offset = (type == FWDELTA_COPY) ? offset : 0;
+	pw->op.length = length;
+	pw->new_pos = new_pos;
+	return true;
+}
+
+static int fwdelta_diff(char *old_filename, char *new_filename, char *patch_filename) {
+	IMAGE old, new;
+	PATCH_WRITER pw = { .file = NULL, .new = &new, .op = { .length = 0 }, .count = 0, .copied = 0, .inserted = 0 };
+	FWDELTA_HEADER header;
+	uint32_t *table = NULL;
+	uint64_t *hints = NULL;
+	uint32_t table_size, same, changed, added;
+	int retval = 1;
+
+	if (!image_open(&old, old_filename)) {
+		return 1;
+	}
+	if (!image_open(&new, new_filename)) {
+		image_close(&old);
+		return 1;
+	}
+
+	table = index_old(&old, &table_size);
+	hints = directory_hints(&old, &new, &same, &changed, &added);
+	if (!table || !hints) {
+		printf("Error: Out of memory.\n");
+		goto exit;
+	}
+
+	pw.file = fopen(patch_filename, "w");
+	if (!pw.file) {
+		printf("Error: Cannot open output file \"%s\".\n", patch_filename);
+		goto exit;
+	}
+	setvbuf(pw.file, NULL, _IOFBF, FWDELTA_BUFFER);
+
+	// header is completed at the end
+	memset(&header, 0, sizeof(header));
+	fwrite(&header, sizeof(header), 1, pw.file);
+
+	// every new block is taken from hinted place, place following previous
+	// copy or any equal old block, in this order
+	uint64_t last = FWDELTA_NONE;
+	for (uint64_t pos = 0; pos < new.size; pos += FWDELTA_BLOCK) {
+		const uint8_t *block = new.data + pos;
+		uint32_t len = ((new.size - pos) < FWDELTA_BLOCK) ? (new.size - pos) : FWDELTA_BLOCK;
+		uint64_t candidate[2] = { hints[pos / FWDELTA_BLOCK], last };
+		uint64_t found = FWDELTA_NONE;
+
+		for (uint32_t i = 0; (i < 2) && (found == FWDELTA_NONE); i++) {
+			if ((candidate[i] != FWDELTA_NONE) && (candidate[i] + len <= old.size) && !memcmp(old.data + candidate[i], block, len)) {
+				found = candidate[i];
+			}
+		}
+		if ((found == FWDELTA_NONE) && (len == FWDELTA_BLOCK)) {
+			found = lookup_old(&old, table, table_size, block);
+		}
+
+		if (!patch_add(&pw, (found == FWDELTA_NONE) ? FWDELTA_INSERT : FWDELTA_COPY, found, pos, len)) {
+			goto write_error;
+		}
+		last = (found == FWDELTA_NONE) ? FWDELTA_NONE : found + len;
+	}
+	if (!patch_flush(&pw)) {
+		goto write_error;
+	}
+
+	header.magic = FWDELTA_MAGIC;
+	header.version = FWDELTA_VERSION;
+	header.oldSize = old.size;
+	header.newSize = new.size;
+	store_hash(old.data, old.size, header.oldHash);
+	store_hash(new.data, new.size, header.newHash);
+	header.opCount = pw.count;
+	if (fseek(pw.file, 0, SEEK_SET) || (fwrite(&header, sizeof(header), 1, pw.file) != 1)) {
+		goto write_error;
+	}
+	if (fclose(pw.file)) {
+		pw.file = NULL;
+		goto write_error;
+	}
+	pw.file = NULL;
+
+	if (old.is_fw && new.is_fw) {
+		printf("Directory files: %u unchanged, %u changed, %u new.\n", same, changed, added);
+	}
+	printf("Patch \"%s\" ready, %u operation(s), %s copied, ", patch_filename, pw.count, humanize_size(pw.copied));
+	printf("%s inserted.\n", humanize_size(pw.inserted));
+	retval = 0;
+	goto exit;
+
+write_error:
+	printf("Error: Cannot write to output file \"%s\".\n", patch_filename);
+
+exit:
+	if (pw.file) {
+		fclose(pw.file);
+	}
+	free(hints);
+	free(table);
+	image_close(&new);
+	image_close(&old);
+	return retval;
+}
+
+// copies are done in kernel, inserted data goes through buffer
+static int fwdelta_apply(char *old_filename, char *patch_filename, char *new_filename) {
+	IMAGE old;
+	FWDELTA_HEADER header;
+	FWDELTA_OP op;
+	uint8_t *buf = NULL;
+	uint64_t pos = 0;
+	int retval = 1;
+	int fd = -1;
+	FILE *patch;
+
+	patch = fopen(patch_filename, "r");
+	if (!patch) {
+		printf("Error: Cannot open file \"%s\".\n", patch_filename);
+		return 1;
+	}
+	setvbuf(patch, NULL, _IOFBF, FWDELTA_BUFFER);
+
+	if ((fread(&header, sizeof(header), 1, patch) != 1) || (header.magic != FWDELTA_MAGIC) || (header.version != FWDELTA_VERSION)) {
+		printf("Error: File \"%s\" isn't firmware patch.\n", patch_filename);
+		fclose(patch);
+		return 1;
+	}
+
+	if (!image_open(&old, old_filename)) {
+		fclose(patch);
+		return 1;
+	}
+	uint64_t hash[2];
+	store_hash(old.data, old.size, hash);
+	if ((old.size != header.oldSize) || memcmp(hash, header.oldHash, sizeof(hash))) {
+		printf("Error: Patch is not for file \"%s\".\n", old_filename);
+		goto exit;
+	}
+
+	buf = malloc(FWDELTA_BUFFER);
+	fd = open(new_filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (!buf || (fd < 0)) {
+		printf("Error: Cannot open output file \"%s\".\n", new_filename);
+		goto exit;
+	}
+
+	for (uint32_t i = 0; i < header.opCount; i++) {
+		if (fread(&op, sizeof(op), 1, patch) != 1) {
+			goto broken;
+		}
+
+		if (op.type == FWDELTA_COPY) {
+			if ((op.offset + op.length > old.size) || !copy_file_part(old.fd, op.offset, fd, pos, op.length)) {
+				goto broken;
+			}
+			pos += op.length;
+		} else if (op.type == FWDELTA_INSERT) {
+			for (uint32_t done = 0; done < op.length;) {
+				size_t len = ((op.length - done) < FWDELTA_BUFFER) ? (op.length - done) : FWDELTA_BUFFER;
+				if ((fread(buf, len, 1, patch) != 1) || (pwrite(fd, buf, len, pos) != (ssize_t)len)) {
+					goto broken;
+				}
+				done += len;
+				pos += len;
+			}
+		} else {
+			goto broken;
+		}
+	}
+
+	// result is read back once to be sure it is exactly the new file
+	if (pos != header.newSize) {
+		goto broken;
+	}
+	uint8_t *data = pos ? mmap(NULL, pos, PROT_READ, MAP_SHARED, fd, 0) : NULL;
+	if (data == MAP_FAILED) {
+		goto broken;
+	}
+	store_hash(data, pos, hash);
+	if (data) {
+		munmap(data, pos);
+	}
+	if (memcmp(hash, header.newHash, sizeof(hash))) {
+		goto broken;
+	}
+
+	printf("File \"%s\" ready, %s.\n", new_filename, humanize_size(pos));
+	retval = 0;
+	goto exit;
+
+broken:
+	printf("Error: Patch \"%s\" is broken or output can't be written.\n", patch_filename);
+
+exit:
+	if ((fd >= 0) && close(fd)) {
+		retval = 1;
+	}
+	free(buf);
+	image_close(&old);
+	fclose(patch);
+	return retval;
+}
+
+int main(int argc, char *argv[]) {
+	char *app = basename(argv[0]);
+
+	if ((argc == 5) && !strcmp(argv[1], "diff")) {
+		return fwdelta_diff(argv[2], argv[3], argv[4]);
+	} else if ((argc == 5) && !strcmp(argv[1], "apply")) {
+		return fwdelta_apply(argv[2], argv[3], argv[4]);
+	}
+
+	usage(app);
+	return -1;
+}
@@ -0,0 +1,179 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <libgen.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "../usbfw.h"
+
+
+void usage(char *app) {
+	printf("Usage:\n");
+	printf("\t%s add STORE_DIR FILE...\n", app);
+	printf("\t%s list STORE_DIR\n", app);
+	printf("\t%s restore STORE_DIR NAME OUT_FILE\n", app);
+	printf("\t%s remove STORE_DIR NAME...\n", app);
+	printf("\t%s gc STORE_DIR\n\n", app);
+	printf("Store keeps every distinct %u byte chunk of its images once. Add puts files\n", STORE_CHUNK_SIZE);
+	printf("to store as images named by their base names, usbfw --store puts dumps there\n");
+	printf("directly. Gc frees chunks not used by any image anymore.\n\n");
+}
+
+static int fwstore_add(char *dirname, char **files, int count) {
+	STORE store;
+	STORE_STATS stats;
+	int retval = 0;
+
+	if (!store_open(&store, dirname)) {
+		return 1;
+	}
+
+	for (int i = 0; i < count; i++) {
+		int fd = open(files[i], O_RDONLY);
+		if (fd < 0) {
+			printf("Error: Cannot open file \"%s\".\n", files[i]);
+			retval = 1;
+			continue;
+		}
+
+		char *name = basename(files[i]);
+		if (store_add(&store, name, fd, &stats)) {
+			printf("%s: %llu of %llu chunk(s) new, ", name, (unsigned long long)stats.added, (unsigned long long)stats.chunks);
+			printf("%s written.\n", humanize_size(stats.written));
+		} else {
+			// store may be left unusable, don't add more to it
+			close(fd);
+			retval = 1;
+			break;
+		}
+		close(fd);
+	}
+
+	store_close(&store);
+	return retval;
+}
+
+static int fwstore_list(char *dirname) {
+	char path[STORE_MAX_PATH];
+	STORE store;
+	DIR *dir;
+
+	if (!store_open(&store, dirname)) {
+		return 1;
+	}
+
+	snprintf(path, sizeof(path), "%s/manifests", dirname);
+	dir = opendir(path);
+	if (!dir) {
+		printf("Error: Cannot list store \"%s\".\n", dirname);
+		store_close(&store);
+		return 1;
+	}
+
+	for (struct dirent *de; (de = readdir(dir));) {
+		STORE_MANIFEST_HEADER header;
+		uint64_t (*hashes)[2];
+
+		if (de->d_name[0] == '.') {
+			continue;
+		}
+		if (!store_load_manifest(&store, de->d_name, &header, &hashes)) {
+			printf("%-32s broken manifest\n", de->d_name);
+			continue;
+		}
+		printf("%-32s %12llu bytes  checksum 0x%08X\n", de->d_name, (unsigned long long)header.size, header.checksum);
+		free(hashes);
+	}
+	closedir(dir);
+
+	printf("\n%u chunk(s) in pool, %s.\n", store.index->used, humanize_size(store.index->poolSize));
+	store_close(&store);
+	return 0;
+}
+
+static int fwstore_restore(char *dirname, char *name, char *filename) {
+	STORE store;
+	int retval = 1;
+	int fd;
+
+	if (!store_open(&store, dirname)) {
+		return 1;
+	}
+
+	fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		printf("Error: Cannot open output file \"%s\".\n", filename);
+	} else {
+		if (store_restore(&store, name, fd)) {
+			printf("Image \"%s\" restored to \"%s\".\n", name, filename);
+			retval = 0;
+		}
+		if (close(fd)) {
+			retval = 1;
+		}
+	}
+
+	store_close(&store);
+	return retval;
+}
+
+static int fwstore_remove(char *dirname, char **names, int count) {
+	STORE store;
+	int retval = 0;
+
+	if (!store_open(&store, dirname)) {
+		return 1;
+	}
+	for (int i = 0; i < count; i++) {
+		if (!store_remove(&store, names[i])) {
+			retval = 1;
+		}
+	}
+	store_close(&store);
+	return retval;
+}
+
+static int fwstore_gc(char *dirname) {
+	STORE store;
+	STORE_STATS stats;
+	int retval = 1;
+
+	if (!store_open(&store, dirname)) {
+		return 1;
+	}
+	if (store_gc(&store, &stats)) {
+		printf("%llu chunk(s) kept, %llu removed, ", (unsigned long long)stats.chunks, (unsigned long long)stats.removed);
+		printf("%s freed.\n", humanize_size(stats.freed));
+		retval = 0;
+	}
+	store_close(&store);
+	return retval;
+}
+
+int main(int argc, char *argv[]) {
+	char *app = basename(argv[0]);
+
+	if (argc < 3) {
+		usage(app);
+		return -1;
+	}
+
+	if (!strcmp(argv[1], "add") && (argc >= 4)) {
+		return fwstore_add(argv[2], &argv[3], argc - 3);
+	} else if (!strcmp(argv[1], "list") && (argc == 3)) {
+		return fwstore_list(argv[2]);
+	} else if (!strcmp(argv[1], "restore") && (argc == 5)) {
+		return fwstore_restore(argv[2], argv[3], argv[4]);
+	} else if (!strcmp(argv[1], "remove") && (argc >= 4)) {
+		return fwstore_remove(argv[2], &argv[3], argc - 3);
+	} else if (!strcmp(argv[1], "gc") && (argc == 3)) {
+		return fwstore_gc(argv[2]);
+	}
+
+	usage(app);
+	return -1;
+}
@@ -3,6 +3,7 @@
 
 #include <stdbool.h>
 #include <stdio.h>
+#include <pthread.h>
 #include <libusb.h>
 
 // SCSI commands
@@ -28,6 +29,7 @@
 // AFI download address
 #define		AFI_DADDR_B		0x00000006
 #define		AFI_DADDR_I		0x00000011
+#define		AFI_BUFFER_SIZE		0x100000	// stdio buffer of AFI being written
 
 // colors
 #define		COLOR_DEFAULT		"\033[0m"
@@ -36,14 +38,90 @@
 
 // long commands
 #define		CMDLINE_YESIKNOW	1000
+#define		CMDLINE_DAEMON		1001
+#define		CMDLINE_BATCH		1002
+#define		CMDLINE_RANGELIST	1003
+#define		CMDLINE_MAXTRANSFER	1004
+#define		CMDLINE_MERGEGAP	1005
+#define		CMDLINE_NOCACHE		1006
+#define		CMDLINE_EXTRACT		1007
+#define		CMDLINE_SKIPGAPS	1008
+#define		CMDLINE_BASE		1009
+#define		CMDLINE_SKIPERASED	1010
+#define		CMDLINE_ERASEBLOCK	1011
+#define		CMDLINE_VERIFYERASED	1012
+#define		CMDLINE_WATCH		1013
+#define		CMDLINE_INTERVAL	1014
+#define		CMDLINE_SAMPLES		1015
+#define		CMDLINE_WATCHCSV	1016
+#define		CMDLINE_SNAPSHOT	1017
+#define		CMDLINE_STORE		1018
+#define		CMDLINE_PROGRESS	1019
 
 // other
 #define		USB_TIMEOUT		1000		// 1s
+#define		USB_MIN_RATE		256		// slowest expected data phase in bytes per ms
 #define		SECTOR_SIZE		512
 #define		SYSINFO_SIZE		192
 #define		DEFAULT_OUT_FILENAME	"read_out.bin"
 #define		DEFAULT_IN_FILENAME	"write_in.bin"
 #define		MAX_SEARCH_LBA		65535		// max sector for alternate firmware search
+#define		ALT_FW_MIN_ALIGN	0x10		// alternate firmware probes - min alignment
+#define		ALT_FW_MAX_ALIGN	0x8000		// alternate firmware probes - max alignment
+#define		ALT_FW_MAX_CANDIDATES	16
+#define		FW_HEADER_MAGIC		0x0FF0AA55
+#define		AP_MAGIC		"\x57\x47\x19\x97"
+#define		RAM_SECTORS		0x800		// max RAM sector + 1
+#define		BATCH_MAX_ARGS		32		// max arguments in one batch line
+#define		MAX_TRANSFER_SECTORS	128		// default sectors in one read command
+#define		MAX_TRANSFER_LIMIT	0xFFFF		// max sectors in one read command
+#define		DEFAULT_MERGE_GAP	16		// max gap in sectors read through between ranges
+#define		DEFAULT_ERASE_BLOCK	256		// presumed NAND erase block in sectors
+#define		RANGE_MAX_LINE		1024		// max line length in range list
+
+// cache
+#define		CACHE_MAX_PATH		4096
+#define		CACHE_MAX_NAME		256
+#define		SESSION_MAX_SERIAL	64
+#define		SYSINFO_RETRIES		16		// sysinfo reads until it has proper magic
+
+// daemon
+#define		DAEMON_MAGIC		0x44574655	// "UFWD"
+#define		DAEMON_MAX_CLIENTS	16
+#define		DAEMON_MAX_DEVICES	8
+#define		DAEMON_MAX_SECTORS	0x20000		// 64MiB per request
+
+// block access cache
+#define		BLOCKDEV_DEFAULT_SECTORS	2048		// 1MiB of cached sectors
+#define		BLOCKDEV_MIN_READAHEAD	8		// first window after sequential access
+#define		BLOCKDEV_MAX_READAHEAD	MAX_TRANSFER_SECTORS
+#define		BLOCKDEV_NONE		0xFFFFFFFF	// no cache slot
+
+// mapped device area
+#define		DEVMAP_PREFETCH		16		// pages read on single fault
+
+// RAM watch
+#define		WATCH_MAGIC		0x57574655	// "UFWW"
+#define		WATCH_VERSION		1
+#define		WATCH_MAX_REGIONS	16
+#define		WATCH_MERGE_GAP		8		// unchanged bytes joined into one record
+#define		SNAPSHOT_RETRIES	4		// re-reads of changing sectors in snapshot
+
+// content addressed store
+#define		STORE_MAGIC		0x53574655	// "UFWS"
+#define		STORE_MANIFEST_MAGIC	0x4D574655	// "UFWM"
+#define		STORE_VERSION		1
+#define		STORE_CHUNK_SIZE	4096		// deduplicated unit, 8 sectors
+#define		STORE_INITIAL_SLOTS	0x10000		// index hash table slots of new store
+#define		STORE_MAX_THREADS	16		// hashing and writing threads
+#define		STORE_MAX_PATH		4096
+
+// progress display
+#define		PROGRESS_INTERVAL	100000000	// 100ms between status redraws, in ns
+
+// many files tools
+#define		FILE_JOB_MAX_THREADS	64
+#define		FW_IMAGE_MAX_FILES	(126 + 240)	// AFI entries and firmware directory files
 
 #ifdef DEBUG
 void dbg_printf(char* format, ...);
@@ -69,9 +147,27 @@ typedef enum {
 	APPCMD_READ_RAM,
 	APPCMD_DUMP_RAW,
 	APPCMD_DUMP_AFI,
-	APPCMD_ENTRY
+	APPCMD_ENTRY,
+	APPCMD_DAEMON,
+	APPCMD_BATCH,
+	APPCMD_EXTRACT,
+	APPCMD_WATCH,
+	APPCMD_WATCH_CSV
 } APP_COMMAND;
 
+typedef enum {
+	PARSE_OK = 0,
+	PARSE_HELP,
+	PARSE_ERROR
+} PARSE_RESULT;
+
+typedef enum {
+	AREA_LUN = 0,			// mass storage LUN (READ10)
+	AREA_FW_LOG,			// firmware logical area
+	AREA_FW_PHY,			// firmware physical area
+	AREA_RAM			// device RAM
+} DEVICE_AREA;
+
 
 typedef struct {
 	struct libusb_device_descriptor	dev_descr;
@@ -81,9 +177,225 @@ typedef struct {
 	uint8_t				endpoint_out;
 	uint8_t				interface;
 	bool				is_claimed;
+	uint32_t			tag;		// last command tag sent to device
 } USB_BULK_CONTEXT;
 
 
+typedef struct {
+	uint32_t			lba;		// first sector
+	uint32_t			count;		// sectors count
+	char				*filename;	// output file name
+	int				fd;		// output file
+	off_t				offset;		// position of first sector in output
+	void				*data;		// caller data, e.g. directory entry
+} READ_RANGE;
+
+
+typedef struct {
+	uint32_t			lba;		// first sector
+	uint32_t			count;		// sectors count, max transfer at most
+} READ_REQUEST;
+
+
+// running sums of 32 and 16 bit words, data may come in pieces of any size
+typedef struct {
+	uint32_t			sum;
+	uint8_t				partial[4];	// bytes of word cut by last update
+	uint32_t			pending;	// count of them
+} CHECKSUM32;
+
+
+typedef struct {
+	uint16_t			sum;
+	uint8_t				partial[2];
+	uint32_t			pending;
+} CHECKSUM16;
+
+
+// record format of tools processing many files
+typedef enum {
+	FORMAT_TEXT = 0,
+	FORMAT_CSV,
+	FORMAT_JSON				// one object per line
+} OUTPUT_FORMAT;
+
+
+// called with mapped content of every file, output goes to 'out'
+typedef bool (*FILE_JOB_CALLBACK)(char *filename, uint8_t *data, size_t size, FILE *out, void *arg);
+
+
+// directory file found in RAW or AFI image mapped in memory
+typedef struct {
+	char				name[13];	// 8.3 name without padding
+	uint8_t				*data;		// inside mapped image
+	uint32_t			length;		// cut at image end
+	bool				is_truncated;	// image ends before file does
+} FW_IMAGE_FILE;
+
+
+// called with every request data just after it is read from device
+typedef bool (*READ_CALLBACK)(READ_REQUEST *req, uint8_t *buf, void *data);
+
+
+typedef enum {
+	PROGRESS_TEXT = 0,				// percent, rate and ETA redrawn in place
+	PROGRESS_QUIET,					// nothing shown
+	PROGRESS_MACHINE				// key=value lines on stderr
+} PROGRESS_MODE;
+
+typedef struct {
+	PROGRESS_MODE			mode;
+	const char			*name;		// task name in machine readable lines
+	uint64_t			total;		// units of work
+	uint32_t			unit;		// bytes in unit, 0 - units aren't data
+	uint64_t			done;		// units done, added atomically
+	uint32_t			errors;		// non fatal errors, added atomically
+	double				start;		// monotonic time of start in s
+	uint32_t			shown;		// length of text status on screen
+	bool				is_running;	// renderer thread started
+	bool				is_stopping;	// renderer asked to finish
+	pthread_t			thread;
+	pthread_mutex_t			lock;		// guards is_stopping
+	pthread_cond_t			cond;		// wakes renderer to finish
+} PROGRESS;
+
+
+typedef struct {
+	FW_HEADER			*header;	// directory of verified image
+	uint32_t			first_sector;	// image start on device
+	CHECKSUM32			checksum[240];	// running sums of directory files
+	uint32_t			seen[240];	// bytes of each file summed so far
+	PROGRESS			*progress;	// gets error for every mismatch
+} FW_VERIFY;
+
+
+// AFI file being built, header is kept in memory and written at close
+typedef struct {
+	FILE				*file;
+	FW_AFI_HEADER			header;
+	uint32_t			count;		// directory entries used
+	uint32_t			offset;		// where next entry data goes
+	FW_AFI_DIR_ENTRY		entry;		// entry being streamed
+	CHECKSUM32			checksum;	// running sum of its data
+} AFI_CONTEXT;
+
+
+typedef struct {
+	bool				is_valid;	// header below is valid
+	uint8_t				lun;		// LUN of cached header
+	uint32_t			lba;		// first sector of cached header
+	FW_HEADER			header;
+} SESSION_HEADER;
+
+
+typedef struct {
+	USB_BULK_CONTEXT		uctx;
+	uint32_t			max_transfer;	// setting - max sectors in one command
+	bool				is_cache;	// setting - use on disk cache
+	PROGRESS_MODE			progress_mode;	// setting - how long operations show progress
+	PROGRESS			progress;	// of running long operation
+	uint16_t			vid;		// vendor ID of open device
+	uint16_t			pid;		// product ID of open device
+	char				serial[SESSION_MAX_SERIAL];	// USB serial, file name safe
+	bool				is_open;	// device open and claimed
+	bool				is_act;		// firmware mode initialized
+	bool				is_key;		// disk cache key below is valid
+	uint8_t				key_lun;	// LUN of main header giving key
+	uint32_t			key_checksum;	// main firmware dirCheckSum
+	uint8_t				key_sector[SECTOR_SIZE];	// main header first sector
+	SESSION_HEADER			header[2];	// cached main and other firmware header
+	bool				is_sysinfo;	// sysinfo below is valid
+	FW_SYSINFO			sysinfo;	// cached sysinfo
+	bool				is_brec;	// bootrecord below is valid
+	uint8_t				brec_lun;	// LUN of cached bootrecord
+	uint32_t			brec_lba;	// first sector of cached bootrecord
+	FW_BREC				brec;		// cached bootrecord
+	uint8_t				capacity_mask;	// LUNs with valid capacity below
+	SCSI_CAPACITY			capacity[8];	// cached LUN capacities
+	bool				is_alt;		// alternate firmware location below is valid
+	uint8_t				alt_lun;	// LUN of alternate firmware location
+	uint32_t			alt_lba;	// alternate firmware first sector
+} SESSION_CONTEXT;
+
+
+typedef struct {
+	uint32_t			lba;		// cached sector
+	uint32_t			prev;		// LRU list, towards recently used
+	uint32_t			next;		// LRU list, towards least recently used
+	uint32_t			hash_next;	// next slot in the same hash bucket
+	bool				is_used;	// slot holds sector (maybe pending)
+	bool				is_pending;	// sector is being read by some thread
+} BLOCKDEV_SLOT;
+
+
+typedef struct {
+	uint64_t			hits;		// sectors found in cache
+	uint64_t			misses;		// sectors read from device on demand
+	uint64_t			coalesced;	// misses waiting for read of other thread
+	uint64_t			readahead;	// sectors read ahead
+	uint64_t			requests;	// device read requests
+} BLOCKDEV_STATS;
+
+
+typedef struct {
+	SESSION_CONTEXT			*session;	// device, used by one thread at once
+	DEVICE_AREA			area;		// area read by device
+	uint8_t				lun;		// LUN read by device
+	uint32_t			size;		// cache slots count
+	BLOCKDEV_SLOT			*slots;
+	uint8_t				*data;		// sector of each slot
+	uint32_t			*buckets;	// hash table heads, 'size' of them
+	uint32_t			head;		// most recently used slot
+	uint32_t			tail;		// least recently used slot
+	uint32_t			seq_next;	// sector after last read, for sequential detection
+	uint32_t			window;		// current read ahead window in sectors
+	BLOCKDEV_STATS			stats;
+	pthread_mutex_t			lock;		// guards everything above
+	pthread_cond_t			cond;		// signalled when pending sectors come
+	pthread_mutex_t			io_lock;	// serializes device access
+	uint32_t			max_run;	// longest single device read
+	uint8_t				*io_buf;	// 'max_run' sectors, guarded by io_lock
+} BLOCKDEV;
+
+
+typedef struct {
+	BLOCKDEV			*dev;		// device read on faults
+	uint32_t			lba;		// first mapped sector
+	uint32_t			count;		// mapped sectors
+	uint8_t				*addr;		// mapped area
+	uint64_t			size;		// mapped bytes, whole pages
+	uint32_t			page_size;
+	uint32_t			prefetch;	// max pages read on single fault
+	uint8_t				*present;	// page already filled, for each one
+	uint8_t				*buf;		// fault thread read buffer
+	int				uffd;		// userfaultfd
+	int				stop[2];	// pipe stopping fault thread
+	pthread_t			thread;		// fault thread
+	uint64_t			faults;		// faults served
+	uint64_t			pages;		// pages filled with device data
+	uint64_t			errors;		// pages left zeroed after read error
+} DEVMAP;
+
+
+typedef struct {
+	char				dirname[STORE_MAX_PATH];
+	int				lock_fd;	// locked for whole time store is open
+	int				pool_fd;	// chunk data
+	STORE_INDEX_HEADER		*index;		// mapped index file, slots follow
+	uint64_t			pool_end;	// where next chunk goes
+	pthread_mutex_t			lock;		// guards index and pool_end
+} STORE;
+
+
+typedef struct {
+	uint64_t			chunks;		// chunks of image or left after collection
+	uint64_t			added;		// new chunks put to pool
+	uint64_t			written;	// bytes written to pool
+	uint64_t			removed;	// chunks dropped by collection
+	uint64_t			freed;		// pool bytes freed by collection
+} STORE_STATS;
+
+
 typedef struct {
 	APP_COMMAND			cmd;		// command to execute
 	char				*ofilename;	// output filename
@@ -103,15 +415,68 @@ typedef struct {
 	bool				is_alt_fw;	// use alternate (backup?) firmware
 	bool				is_yesiknow;	// confirmation of dangerous commands
 	uint16_t			entry_param;	// parameter for entry command
+	char				*socket_path;	// daemon UNIX socket
+	char				*batch_filename;// batch script, "-" for stdin
+	char				*range_filename;// range list for read commands
+	uint32_t			max_transfer;	// max sectors in one read command
+	uint32_t			merge_gap;	// max gap read through between ranges
+	bool				is_cache;	// use on disk cache
+	char				*extract_pattern;	// glob of directory files to extract
+	bool				is_skip_gaps;	// dump only sectors used by directory files
+	char				*base_filename;	// previous dump for incremental one
+	bool				is_skip_erased;	// don't read blocks looking erased
+	uint32_t			erase_block;	// erase block size in sectors
+	uint32_t			verify_erased;	// skipped blocks to read anyway
+	char				*watch_regions;	// RAM regions to watch, ADDR:LEN,...
+	uint32_t			interval;	// between watch samples in us, 0 - no wait
+	uint32_t			samples;	// watch samples to take, 0 - until interrupted
+	char				*watch_log;	// watch log to export as CSV
+	bool				is_snapshot;	// read RAM twice and re-read changed sectors
+	char				*store_dirname;	// store dumps go to, NULL - plain files
+	PROGRESS_MODE			progress_mode;	// how long operations show progress
 } APP_CONTEXT;
 
 
 //afi.c
-FILE * afi_new_file(char *filename);
-void afi_add_whole(FILE *fafi, FW_AFI_DIR_ENTRY *afi_entry, uint8_t* data);
-void afi_add_appended(FILE *fafi, FW_AFI_DIR_ENTRY *afi_entry);
+bool afi_new_file(AFI_CONTEXT *afi, char *filename, uint16_t vid, uint16_t pid);
+bool afi_new_stream(AFI_CONTEXT *afi, FILE *file, uint16_t vid, uint16_t pid);
+void afi_entry_begin(AFI_CONTEXT *afi, FW_AFI_DIR_ENTRY *afi_entry);
+bool afi_entry_write(AFI_CONTEXT *afi, const void *data, size_t size);
+bool afi_entry_end(AFI_CONTEXT *afi, FW_AFI_DIR_ENTRY *afi_entry);
+bool afi_add_whole(AFI_CONTEXT *afi, FW_AFI_DIR_ENTRY *afi_entry, uint8_t* data);
+off_t afi_append_base(AFI_CONTEXT *afi);
+bool afi_add_appended(AFI_CONTEXT *afi, FW_AFI_DIR_ENTRY *afi_entry);
+bool afi_close(AFI_CONTEXT *afi);
+void afi_abort(AFI_CONTEXT *afi);
+
+//batch.c
+bool batch_run(void);
+
+//blockdev.c
+bool blockdev_open(BLOCKDEV *dev, SESSION_CONTEXT *session, DEVICE_AREA area, uint8_t lun, uint32_t size);
+void blockdev_close(BLOCKDEV *dev);
+bool blockdev_read(BLOCKDEV *dev, uint32_t lba, uint32_t count, uint8_t *buf);
+void blockdev_invalidate(BLOCKDEV *dev);
+void blockdev_get_stats(BLOCKDEV *dev, BLOCKDEV_STATS *stats);
+
+//cache.c
+bool cache_path(char *path, size_t size, char *name);
+bool cache_load(SESSION_CONTEXT *session, char *item, void *buf, size_t size);
+void cache_store(SESSION_CONTEXT *session, char *item, void *buf, size_t size);
+
+//checksum.c
+void checksum32_init(CHECKSUM32 *ctx);
+void checksum32_update(CHECKSUM32 *ctx, const void *data, size_t size);
+uint32_t checksum32_final(CHECKSUM32 *ctx);
+void checksum16_init(CHECKSUM16 *ctx);
+void checksum16_update(CHECKSUM16 *ctx, const void *data, size_t size);
+uint16_t checksum16_final(CHECKSUM16 *ctx);
+uint32_t checksum32(const void *data, size_t size);
+uint16_t checksum16(const void *data, size_t size);
 
 //cmdline.c
+bool parse_devid(char *devstring);
+PARSE_RESULT parseargs(int argc, char *argv[]);
 void parseparams(int argc, char *argv[]);
 
 //commands.c
@@ -123,6 +488,8 @@ void command_init_read_fcapacity(CBW *cbw, uint8_t lun);
 int command_perform_read_fcapacity(CBW *cbw, USB_BULK_CONTEXT *uctx, SCSI_FORMAT_CAPACITY *fcapacity);
 void command_init_read_capacity(CBW *cbw, uint8_t lun);
 int command_perform_read_capacity(CBW *cbw, USB_BULK_CONTEXT *uctx, SCSI_CAPACITY *capacity);
+void command_init_read10(CBW *cbw, uint8_t lun, uint32_t lba, uint16_t count, uint32_t sector_size);
+int command_perform_read10(CBW *cbw, USB_BULK_CONTEXT *uctx, uint8_t *buf);
 void command_init_read10one(CBW *cbw, uint8_t lun, uint32_t lba, uint32_t sector_size);
 int command_perform_read10one(CBW *cbw, USB_BULK_CONTEXT *uctx, uint8_t *buf);
 void command_init_write10one(CBW *cbw, uint8_t lun, uint32_t lba, uint32_t sector_size);
@@ -134,6 +501,8 @@ void command_init_act_init(CBW *cbw);
 int command_perform_act_init(CBW *cbw, USB_BULK_CONTEXT *uctx, uint8_t *buf);
 void command_init_act_detach(CBW *cbw);
 int command_perform_act_detach(CBW *cbw, USB_BULK_CONTEXT *uctx);
+void command_init_act_read(CBW *cbw, uint8_t lun, uint32_t lba, uint16_t count, bool is_log);
+int command_perform_act_read(CBW *cbw, USB_BULK_CONTEXT *uctx, uint8_t *buf);
 void command_init_act_readone(CBW *cbw, uint8_t lun, uint32_t lba, bool is_log);
 int command_perform_act_readone(CBW *cbw, USB_BULK_CONTEXT *uctx, uint8_t *buf);
 void command_init_act_read_ram(CBW *cbw, uint16_t sector, uint16_t length);
@@ -149,20 +518,92 @@ void free_bulk_context(USB_BULK_CONTEXT *uctx);
 bool open_device(USB_BULK_CONTEXT *uctx, uint16_t vid, uint16_t pid);
 bool open_and_claim(USB_BULK_CONTEXT *uctx, uint16_t vid, uint16_t pid);
 
+//daemon.c
+bool daemon_run(void);
+
+//devmap.c
+bool devmap_open(DEVMAP *map, BLOCKDEV *dev, uint32_t lba, uint32_t count, uint32_t prefetch);
+void devmap_close(DEVMAP *map);
+
+//filejob.c
+char ** file_job_collect(char **args, uint32_t count, uint32_t *file_count);
+void file_job_free(char **files, uint32_t count);
+bool file_job_run(char **files, uint32_t count, uint32_t threads, FILE_JOB_CALLBACK callback, void *data);
+
 //fw.c
 bool init_act(USB_BULK_CONTEXT *uctx);
-uint32_t search_alternate_fw(USB_BULK_CONTEXT *uctx, uint8_t lun, uint32_t max_lba);
+uint32_t search_alternate_fw(SESSION_CONTEXT *session, uint8_t lun, uint32_t max_lba);
 bool get_fw_header(USB_BULK_CONTEXT *uctx, FW_HEADER *fw_header, uint8_t lun, uint32_t start_lba);
-uint32_t get_fw_size(USB_BULK_CONTEXT *uctx, uint8_t lun, uint32_t start_lba);
+uint32_t get_fw_size(FW_HEADER *fw_header);
+bool load_fw_image_header(int fd, off_t *base, FW_HEADER *fw_header);
+int32_t fw_image_files(uint8_t *data, size_t size, FW_IMAGE_FILE *files);
+char * check_fw_header(FW_HEADER *fw_header);
+char * check_afi_header(FW_AFI_HEADER *afi);
+char * check_brec(FW_BREC *brec);
+char * check_sysinfo(FW_SYSINFO *sysinfo);
+char * check_ap_header(uint8_t *data, size_t size, AP_FULLHEAD *ap_header);
+READ_RANGE * get_fw_extents(FW_HEADER *fw_header, uint32_t first_sector, uint32_t size, bool is_files_only, uint32_t *count);
+void fw_verify_init(FW_VERIFY *verify, FW_HEADER *fw_header, uint32_t first_sector, PROGRESS *progress);
+bool fw_verify_request(READ_REQUEST *req, uint8_t *buf, void *data);
+bool fw_verify_report(FW_VERIFY *verify);
 bool test_ram_access(USB_BULK_CONTEXT *uctx);
 bool get_fw_sysinfo(USB_BULK_CONTEXT *uctx, FW_SYSINFO *sysinfo);
 void detach_device(USB_BULK_CONTEXT *uctx, bool detach);
 
+//io.c
+bool read_area(SESSION_CONTEXT *session, DEVICE_AREA area, uint8_t lun, uint32_t lba, uint32_t count, uint8_t *buf);
+
 //main.c
 extern APP_CONTEXT app;
+extern SESSION_CONTEXT session;
+bool confirm(void);
+bool run_command(void);
+
+//plan.c
+READ_RANGE * load_range_list(char *filename, char *default_prefix, uint32_t *count);
+READ_RANGE * make_range(uint32_t lba, uint32_t count, char *filename);
+bool open_ranges(READ_RANGE *ranges, uint32_t count);
+void free_ranges(READ_RANGE *ranges, uint32_t count);
+uint32_t plan_reads(READ_RANGE *ranges, uint32_t count, uint32_t merge_gap, uint32_t max_transfer, READ_REQUEST **requests);
+bool read_ranges(SESSION_CONTEXT *session, DEVICE_AREA area, uint8_t lun, READ_RANGE *ranges, uint32_t count, uint32_t merge_gap, READ_CALLBACK callback, void *data);
+
+//progress.c
+void progress_start(PROGRESS *progress, PROGRESS_MODE mode, const char *name, uint64_t total, uint32_t unit);
+void progress_add(PROGRESS *progress, uint64_t count);
+void progress_error(PROGRESS *progress);
+void progress_stop(PROGRESS *progress);
+
+//scan.c
+bool read_skip_erased(SESSION_CONTEXT *session, DEVICE_AREA area, uint8_t lun, uint32_t lba, uint32_t count, uint32_t block_size, uint32_t verify, int fd, char *map_filename);
+
+//store.c
+void store_hash(const void *data, size_t size, uint64_t hash[2]);
+bool store_open(STORE *store, char *dirname);
+void store_close(STORE *store);
+bool store_add(STORE *store, char *name, int fd, STORE_STATS *stats);
+bool store_load_manifest(STORE *store, char *name, STORE_MANIFEST_HEADER *header, uint64_t (**hashes)[2]);
+bool store_restore(STORE *store, char *name, int fd);
+bool store_remove(STORE *store, char *name);
+bool store_gc(STORE *store, STORE_STATS *stats);
+
+//watch.c
+bool watch_run(void);
+bool watch_export_csv(void);
+bool ram_snapshot(SESSION_CONTEXT *session, uint32_t lba, uint32_t count, uint8_t *buf, char *map_filename);
+
+//session.c
+void zero_session(SESSION_CONTEXT *session);
+bool session_open(SESSION_CONTEXT *session, uint16_t vid, uint16_t pid);
+bool session_init_act(SESSION_CONTEXT *session);
+bool session_get_key(SESSION_CONTEXT *session, uint8_t lun);
+FW_HEADER * session_get_header(SESSION_CONTEXT *session, uint8_t lun, uint32_t lba);
+FW_SYSINFO * session_get_sysinfo(SESSION_CONTEXT *session, uint8_t lun);
+FW_BREC * session_get_brec(SESSION_CONTEXT *session, uint8_t lun, uint32_t lba);
+SCSI_CAPACITY * session_get_capacity(SESSION_CONTEXT *session, uint8_t lun);
+void session_detach(SESSION_CONTEXT *session, bool detach);
+void session_close(SESSION_CONTEXT *session);
 
 //tool.c
-bool parse_devid(char *devstring);
 char * decode_pdt(uint8_t);
 char * decode_fcapacity(uint8_t desc);
 char * humanize_size(uint64_t size);
@@ -175,11 +616,9 @@ char * decode_lightmode(uint8_t lightmode);
 char * decode_mtpformat(uint8_t mtpformat);
 char * make_filename(char filename[11]);
 char * make_date(uint32_t actions_time);
-void display_spinner(void);
-void display_percent_spinner(uint32_t current, uint32_t max);
 bool test_ram_access(USB_BULK_CONTEXT *uctx);
-bool confirm(void);
-uint16_t checksum16(uint16_t *data, uint32_t size, bool is_new);
-uint32_t checksum32(uint32_t *data, uint32_t size, bool is_new);
+bool copy_file_part(int in_fd, off_t in_off, int out_fd, off_t out_off, uint64_t len);
+void print_csv_string(FILE *out, const char *str);
+void print_json_string(FILE *out, const char *str);
 
 #endif
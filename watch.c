@@ -0,0 +1,448 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+
+#include "usbfw.h"
+
+// one RAM command, reads from sector start up to last needed byte
+typedef struct {
+	uint16_t			sector;
+	uint16_t			length;		// in bytes, 0x200 at most
+	uint32_t			skip;		// bytes before region start
+	uint32_t			dest;		// position in sample buffer
+	uint32_t			size;		// region bytes from this read
+} WATCH_READ;
+
+static volatile sig_atomic_t is_quit = 0;
+
+
+static void watch_signal(int sig) {
+	is_quit = 1;
+}
+
+static uint64_t watch_time(clockid_t clock) {
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// "ADDR:LEN[,ADDR:LEN...]", addresses and lengths in bytes
+static uint32_t watch_parse(char *spec, WATCH_REGION *regions) {
+	uint32_t count = 0;
+	char *copy = strdup(spec);
+	char *save;
+
+	if (!copy) {
+		return 0;
+	}
+
+	for (char *item = strtok_r(copy, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+		char *end;
+
+		if (count >= WATCH_MAX_REGIONS) {
+			printf("Error: Too many watched regions, max is %u.\n", WATCH_MAX_REGIONS);
+			count = 0;
+			break;
+		}
+
+		// length is required, item without it is rejected as empty
+		regions[count].address = strtoul(item, &end, 0);
+		regions[count].length = 0;
+		if (*end == ':') {
+			regions[count].length = strtoul(end + 1, &end, 0);
+		}
+		if ((*end != 0) || (regions[count].length == 0) || ((uint64_t)regions[count].address + regions[count].length > RAM_SECTORS * SECTOR_SIZE)) {
+			printf("Error: Wrong watched region \"%s\".\n", item);
+			count = 0;
+			break;
+		}
+		count++;
+	}
+
+	free(copy);
+	return count;
+}
+
+// split regions into RAM commands, returns their count, with reads NULL
+// only counts them
+static uint32_t watch_plan(WATCH_REGION *regions, uint32_t count, WATCH_READ *reads, uint32_t *total) {
+	uint32_t planned = 0;
+
+	*total = 0;
+	for (uint32_t i = 0; i < count; i++) {
+		uint32_t address = regions[i].address;
+		uint32_t end = address + regions[i].length;
+
+		while (address < end) {
+			uint32_t sector_end = (address / SECTOR_SIZE + 1) * SECTOR_SIZE;
+			uint32_t to = (end < sector_end) ? end : sector_end;
+
+			if (reads) {
+				reads[planned].sector = address / SECTOR_SIZE;
+				reads[planned].length = to - (address & ~(SECTOR_SIZE - 1));
+				reads[planned].skip = address % SECTOR_SIZE;
+				reads[planned].dest = *total;
+				reads[planned].size = to - address;
+			}
+			*total += to - address;
+			planned++;
+			address = to;
+		}
+	}
+
+	return planned;
+}
+
+// log changed bytes of one region, runs split by short unchanged gaps are
+// joined to save record headers
+static bool watch_log_changes(FILE *log, uint64_t time, uint32_t sample, uint32_t address, uint8_t *prev, uint8_t *cur, uint32_t length, uint32_t *changes) {
+	uint32_t i = 0;
+
+	while (i < length) {
+		if (prev && (prev[i] == cur[i])) {
+			i++;
+			continue;
+		}
+
+		uint32_t start = i;
+		uint32_t last = i;
+		for (i++; (i < length) && (i - last <= WATCH_MERGE_GAP) && (i - start < 0xFFFF); i++) {
+			if (!prev || (prev[i] != cur[i])) {
+				last = i;
+			}
+		}
+
+		WATCH_RECORD record = {
+			.time = time,
+			.sample = sample,
+			.address = address + start,
+			.length = last - start + 1
+		};
+		if ((fwrite(&record, sizeof(record), 1, log) != 1) || (fwrite(cur + start, record.length, 1, log) != 1)) {
+			return false;
+		}
+		(*changes)++;
+		i = last + 1;
+	}
+
+	return true;
+}
+
+bool watch_run(void) {
+	WATCH_REGION regions[WATCH_MAX_REGIONS];
+	WATCH_READ *reads;
+	uint32_t region_count, read_count, total;
+	uint8_t *prev = NULL;
+	uint8_t *cur = NULL;
+	uint8_t sector[SECTOR_SIZE];
+	uint32_t sample = 0;
+	uint32_t changes = 0;
+	bool retval = false;
+	FILE *log = NULL;
+	CBW cbw;
+
+	region_count = watch_parse(app.watch_regions, regions);
+	if (!region_count) {
+		return false;
+	}
+	read_count = watch_plan(regions, region_count, NULL, &total);
+	reads = malloc(read_count * sizeof(WATCH_READ));
+	if (!reads) {
+		printf("Error: Out of memory.\n");
+		return false;
+	}
+	watch_plan(regions, region_count, reads, &total);
+
+	if (!session_open(&session, app.vid, app.pid)) {
+		free(reads);
+		return false;
+	}
+
+	if (!session_init_act(&session)) {
+		goto exit;
+	}
+
+	prev = malloc(total);
+	cur = malloc(total);
+	if (!prev || !cur) {
+		printf("Error: Out of memory.\n");
+		goto exit;
+	}
+
+	log = fopen(app.ofilename, "w");
+	if (!log) {
+		printf("Error: Cannot open output file \"%s\".\n", app.ofilename);
+		goto exit;
+	}
+
+	WATCH_LOG_HEADER header = {
+		.magic = WATCH_MAGIC,
+		.version = WATCH_VERSION,
+		.regionCount = region_count,
+		.startTime = watch_time(CLOCK_REALTIME)
+	};
+	fwrite(&header, sizeof(header), 1, log);
+	fwrite(regions, sizeof(WATCH_REGION), region_count, log);
+
+	printf("\nWatching %u RAM region(s) (0x%X bytes in %u command(s) per sample) of device %04X:%04X to log \"%s\".\n", region_count, total, read_count, app.vid, app.pid, app.ofilename);
+	printf("Press Ctrl-C to stop.\n\n");
+
+	is_quit = 0;
+	signal(SIGINT, watch_signal);
+	signal(SIGTERM, watch_signal);
+
+	uint64_t start = watch_time(CLOCK_MONOTONIC);
+	uint64_t next = start;
+
+	// Bulk-only transport allows single command in flight, so fast sampling
+	// means only reading needed bytes and nothing else between commands.
+	for (sample = 0; !is_quit && ((app.samples == 0) || (sample < app.samples)); sample++) {
+		uint64_t time = watch_time(CLOCK_MONOTONIC) - start;
+
+		for (uint32_t i = 0; i < read_count; i++) {
+			command_init_act_read_ram(&cbw, reads[i].sector, reads[i].length);
+			if (command_perform_act_read_ram(&cbw, &session.uctx, sector)) {
+				printf("Error: Reading RAM failed at sector %u in sample %u.\n", reads[i].sector, sample);
+				goto stop;
+			}
+			memcpy(cur + reads[i].dest, sector + reads[i].skip, reads[i].size);
+		}
+
+		// first sample logs whole regions as base for changes
+		uint32_t pos = 0;
+		for (uint32_t i = 0; i < region_count; i++) {
+			if (!watch_log_changes(log, time, sample, regions[i].address, sample ? prev + pos : NULL, cur + pos, regions[i].length, &changes)) {
+				printf("Error: Cannot write to log \"%s\".\n", app.ofilename);
+				goto stop;
+			}
+			pos += regions[i].length;
+		}
+
+		uint8_t *tmp = prev;
+		prev = cur;
+		cur = tmp;
+
+		if (app.interval) {
+			next += (uint64_t)app.interval * 1000;
+			struct timespec ts = { .tv_sec = next / 1000000000ULL, .tv_nsec = next % 1000000000ULL };
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+		}
+	}
+	retval = true;
+
+stop:
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+
+	double elapsed = (watch_time(CLOCK_MONOTONIC) - start) / 1000000000.0;
+	printf("%u sample(s) in %.3f s (%.1f samples/s), %u change record(s) logged.\n\n", sample, elapsed, elapsed > 0 ? sample / elapsed : 0.0, changes);
+
+exit:
+	if (log && fclose(log)) {
+		printf("Error: Cannot write to log \"%s\".\n", app.ofilename);
+		retval = false;
+	}
+	free(prev);
+	free(cur);
+	free(reads);
+	session_detach(&session, app.is_detach);
+	return retval;
+}
+
+// replay log into CSV: time, sample, address, old and new byte value
+bool watch_export_csv(void) {
+	WATCH_LOG_HEADER header;
+	WATCH_REGION regions[WATCH_MAX_REGIONS];
+	WATCH_RECORD record;
+	uint8_t data[0xFFFF];
+	uint8_t *ram = NULL;
+	uint64_t rows = 0;
+	bool retval = false;
+	FILE *csv = NULL;
+
+	FILE *log = fopen(app.watch_log, "r");
+	if (!log) {
+		printf("Error: Cannot open watch log \"%s\".\n", app.watch_log);
+		return false;
+	}
+
+	if ((fread(&header, sizeof(header), 1, log) != 1) || (header.magic != WATCH_MAGIC) || (header.version != WATCH_VERSION) || (header.regionCount > WATCH_MAX_REGIONS)
+	    || (fread(regions, sizeof(WATCH_REGION), header.regionCount, log) != header.regionCount)) {
+		printf("Error: \"%s\" is not proper watch log.\n", app.watch_log);
+		goto exit;
+	}
+
+	ram = malloc(RAM_SECTORS * SECTOR_SIZE);
+	csv = fopen(app.ofilename, "w");
+	if (!ram || !csv) {
+		printf("Error: Cannot open output file \"%s\".\n", app.ofilename);
+		goto exit;
+	}
+
+	fprintf(csv, "time,sample,address,old,new\n");
+	while (fread(&record, sizeof(record), 1, log) == 1) {
+		if (((uint64_t)record.address + record.length > RAM_SECTORS * SECTOR_SIZE) || (fread(data, record.length, 1, log) != 1)) {
+			printf("Error: Watch log \"%s\" is truncated or broken.\n", app.watch_log);
+			goto exit;
+		}
+
+		for (uint32_t i = 0; i < record.length; i++) {
+			uint32_t address = record.address + i;
+
+			// initial contents have no old value, joined runs have unchanged bytes
+			if (record.sample == 0) {
+				fprintf(csv, "%.9f,0,0x%05X,,0x%02X\n", record.time / 1000000000.0, address, data[i]);
+			} else if (ram[address] != data[i]) {
+				fprintf(csv, "%.9f,%u,0x%05X,0x%02X,0x%02X\n", record.time / 1000000000.0, record.sample, address, ram[address], data[i]);
+			} else {
+				continue;
+			}
+			ram[address] = data[i];
+			rows++;
+		}
+	}
+
+	printf("%llu change(s) exported from \"%s\" to \"%s\".\n", (unsigned long long)rows, app.watch_log, app.ofilename);
+	retval = true;
+
+exit:
+	if (csv) {
+		fclose(csv);
+	}
+	free(ram);
+	fclose(log);
+	return retval;
+}
+
+static bool snapshot_read(SESSION_CONTEXT *session, uint32_t sector, uint8_t *buf) {
+	CBW cbw;
+
+	command_init_act_read_ram(&cbw, sector, SECTOR_SIZE);
+	if (command_perform_act_read_ram(&cbw, &session->uctx, buf)) {
+		progress_stop(&session->progress);
+		printf("\nError: Reading RAM failed at sector %u.\n", sector);
+		return false;
+	}
+	return true;
+}
+
+// mark differing bytes as unstable and keep newer data, true if any differ
+static bool snapshot_diff(uint8_t *old, uint8_t *new, uint8_t *unstable) {
+	bool is_diff = false;
+
+	for (uint32_t i = 0; i < SECTOR_SIZE; i++) {
+		if (old[i] != new[i]) {
+			unstable[i] = 1;
+			is_diff = true;
+		}
+	}
+	if (is_diff) {
+		memcpy(old, new, SECTOR_SIZE);
+	}
+	return is_diff;
+}
+
+// Firmware keeps running during dump, so one pass isn't consistent. Second
+// pass finds sectors changed meanwhile, only those are re-read until two
+// reads match or retries run out. Byte runs seen changing are listed in map
+// file as "ADDR LEN" lines.
+bool ram_snapshot(SESSION_CONTEXT *session, uint32_t lba, uint32_t count, uint8_t *buf, char *map_filename) {
+	uint8_t sector[SECTOR_SIZE];
+	uint8_t *unstable = NULL;
+	uint32_t *changed = NULL;
+	uint32_t changed_count = 0;
+	uint32_t retry_count = 0;
+	uint32_t regions = 0;
+	size_t size = (size_t)count * SECTOR_SIZE;
+	bool retval = false;
+	FILE *map = NULL;
+
+	unstable = calloc(size, 1);
+	changed = malloc(count * sizeof(uint32_t));
+	if (!unstable || !changed) {
+		printf("Error: Out of memory.\n");
+		goto exit;
+	}
+
+	printf("Reading RAM ... ");
+	progress_start(&session->progress, session->progress_mode, "ram", count, SECTOR_SIZE);
+	for (uint32_t i = 0; i < count; i++) {
+		if (!snapshot_read(session, lba + i, buf + (i * SECTOR_SIZE))) {
+			goto exit;
+		}
+		progress_add(&session->progress, 1);
+	}
+	progress_stop(&session->progress);
+	printf("done.\n");
+
+	// compare pass, sector must match or it is changing
+	printf("Checking RAM ... ");
+	progress_start(&session->progress, session->progress_mode, "check", count, SECTOR_SIZE);
+	for (uint32_t i = 0; i < count; i++) {
+		uint8_t *old = buf + (i * SECTOR_SIZE);
+
+		if (!snapshot_read(session, lba + i, sector)) {
+			goto exit;
+		}
+		if (snapshot_diff(old, sector, unstable + (i * SECTOR_SIZE))) {
+			changed[changed_count++] = i;
+		}
+		progress_add(&session->progress, 1);
+	}
+	progress_stop(&session->progress);
+	printf("done.\n");
+
+	// re-read changing sectors close together, last read is kept
+	for (uint32_t retry = 0; changed_count && (retry < SNAPSHOT_RETRIES); retry++) {
+		uint32_t left = 0;
+
+		for (uint32_t j = 0; j < changed_count; j++) {
+			uint32_t i = changed[j];
+
+			if (!snapshot_read(session, lba + i, sector)) {
+				goto exit;
+			}
+			if (snapshot_diff(buf + (i * SECTOR_SIZE), sector, unstable + (i * SECTOR_SIZE))) {
+				changed[left++] = i;
+			}
+		}
+		retry_count += changed_count;
+		changed_count = left;
+	}
+
+	map = fopen(map_filename, "w");
+	if (!map) {
+		printf("Error: Cannot open map file \"%s\".\n", map_filename);
+		goto exit;
+	}
+	fprintf(map, "# RAM regions changing during snapshot\n");
+	for (size_t i = 0; i < size;) {
+		if (!unstable[i]) {
+			i++;
+			continue;
+		}
+
+		size_t start = i;
+		while ((i < size) && unstable[i]) {
+			i++;
+		}
+		fprintf(map, "0x%05zX 0x%zX\n", ((size_t)lba * SECTOR_SIZE) + start, i - start);
+		regions++;
+	}
+	if (fclose(map)) {
+		printf("Error: Cannot write map file \"%s\".\n", map_filename);
+		goto exit;
+	}
+
+	printf("%u sector re-read(s), %u sector(s) still changing.\n", retry_count, changed_count);
+	printf("Map of %u unstable region(s) written to \"%s\".\n\n", regions, map_filename);
+	retval = true;
+
+exit:
+	free(changed);
+	free(unstable);
+	return retval;
+}